@@ -0,0 +1,161 @@
+/*
+   LZ4 frame decoder for payloads packed by imagebld -lz4
+
+   Decompresses straight into the final buffer, no scratch memory.
+*/
+
+#include "boot.h"
+#include "BootLZ4.h"
+
+static DWORD BootLz4Read32(const BYTE *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((DWORD)p[3] << 24);
+}
+
+/* Decodes one block to dst.  base is the start of the whole output, matches
+   of linked blocks may reach back into the blocks before this one. */
+static int BootLz4DecompressBlock(const BYTE *src, DWORD srclen, BYTE *base, BYTE *dst, BYTE *dstend) {
+	const BYTE *ip = src;
+	const BYTE *iend = src + srclen;
+	const BYTE *match;
+	BYTE *op = dst;
+	DWORD length, offset;
+	BYTE token, b;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		/* literals */
+		length = token >> 4;
+		if (length == 15) {
+			do {
+				if (ip >= iend) return -1;
+				b = *ip++;
+				length += b;
+			} while (b == 255);
+		}
+		if (length > (DWORD)(iend - ip) || length > (DWORD)(dstend - op)) return -1;
+		xbememcpy(op, ip, length);
+		op += length;
+		ip += length;
+
+		/* the last sequence of a block has no match */
+		if (ip == iend) break;
+
+		if (iend - ip < 2) return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (DWORD)(op - base)) return -1;
+
+		length = token & 15;
+		if (length == 15) {
+			do {
+				if (ip >= iend) return -1;
+				b = *ip++;
+				length += b;
+			} while (b == 255);
+		}
+		length += 4;
+		if (length > (DWORD)(dstend - op)) return -1;
+
+		match = op - offset;
+		if (offset >= length) {
+			xbememcpy(op, match, length);
+			op += length;
+		} else {
+			/* overlapping match, repeats the last offset bytes */
+			while (length--) *op++ = *match++;
+		}
+	}
+
+	return op - dst;
+}
+
+/* Size of the decompressed data as recorded in the frame header, 0 if the
+   frame does not carry it */
+DWORD BootLz4FrameContentSize(const BYTE *src, DWORD srclen) {
+
+	if (srclen < 15 || BootLz4Read32(src) != LZ4_FRAME_MAGIC) return 0;
+	if (!(src[4] & LZ4_FLG_CONTENT_SIZE)) return 0;
+	/* nothing above 4GB fits into an Xbox anyway */
+	if (BootLz4Read32(src + 10) != 0) return 0;
+
+	return BootLz4Read32(src + 6);
+}
+
+void BootLz4StreamInit(struct lz4_stream *s, const BYTE *src, BYTE *dst, DWORD dstlen) {
+	xbememset(s, 0, sizeof(struct lz4_stream));
+	s->src = src;
+	s->dst = dst;
+	s->dstlen = dstlen;
+}
+
+/* Decodes what can be decoded of the first avail bytes of the frame.
+   Returns 1 once the end mark is in, 0 if more input is needed, -1 if the
+   frame is damaged or does not fit.  Block and content checksums are
+   skipped, not verified. */
+int BootLz4StreamDecompress(struct lz4_stream *s, DWORD avail) {
+	const BYTE *ip;
+	DWORD size, need;
+	BYTE flg;
+	int n;
+
+	if (s->done) return 1;
+
+	if (!s->flg) {
+		if (avail < 7) return 0;
+		if (BootLz4Read32(s->src) != LZ4_FRAME_MAGIC) return -1;
+		flg = s->src[4];
+		if ((flg & LZ4_FLG_VERSION_MASK) != LZ4_FLG_VERSION) return -1;
+		if (flg & LZ4_FLG_DICT_ID) return -1;
+
+		/* magic, FLG, BD, optional content size, header checksum */
+		need = 7;
+		if (flg & LZ4_FLG_CONTENT_SIZE) need += 8;
+		if (avail < need) return 0;
+		s->pos = need;
+		s->flg = flg;
+	}
+
+	while (avail - s->pos >= 4) {
+		ip = s->src + s->pos;
+		size = BootLz4Read32(ip);
+
+		/* end mark */
+		if (size == 0) {
+			s->pos += 4;
+			s->done = 1;
+			return 1;
+		}
+
+		/* wait until the whole block is in */
+		need = 4 + (size & ~LZ4_BLOCK_UNCOMPRESSED);
+		if (s->flg & LZ4_FLG_BLOCK_CHECKSUM) need += 4;
+		if (need > avail - s->pos) return 0;
+		ip += 4;
+
+		if (size & LZ4_BLOCK_UNCOMPRESSED) {
+			size &= ~LZ4_BLOCK_UNCOMPRESSED;
+			if (size > s->dstlen - s->out) return -1;
+			xbememcpy(s->dst + s->out, ip, size);
+			s->out += size;
+		} else {
+			n = BootLz4DecompressBlock(ip, size, s->dst, s->dst + s->out, s->dst + s->dstlen);
+			if (n < 0) return -1;
+			s->out += n;
+		}
+		s->pos += need;
+	}
+
+	return 0;
+}
+
+/* Decompresses a whole frame into dst, returns the decompressed size or -1
+   if the frame is damaged or does not fit into dstlen bytes. */
+int BootLz4DecompressFrame(const BYTE *src, DWORD srclen, BYTE *dst, DWORD dstlen) {
+	struct lz4_stream s;
+
+	BootLz4StreamInit(&s, src, dst, dstlen);
+	if (BootLz4StreamDecompress(&s, srclen) != 1) return -1;
+
+	return s.out;
+}
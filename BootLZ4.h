@@ -0,0 +1,46 @@
+#ifndef _BootLZ4_H_
+#define _BootLZ4_H_
+
+/*
+ * LZ4 frame format (lz4.org, "LZ4 Frame Format Description").
+ * imagebld writes these frames and includes this header too, so only
+ * plain C types are used here.
+ */
+
+#define LZ4_FRAME_MAGIC			0x184D2204
+
+/* FLG byte of the frame descriptor */
+#define LZ4_FLG_VERSION_MASK		0xC0
+#define LZ4_FLG_VERSION			0x40
+#define LZ4_FLG_BLOCK_INDEP		0x20
+#define LZ4_FLG_BLOCK_CHECKSUM		0x10
+#define LZ4_FLG_CONTENT_SIZE		0x08
+#define LZ4_FLG_CONTENT_CHECKSUM	0x04
+#define LZ4_FLG_DICT_ID			0x01
+
+/* a block size with the high bit set is a block stored uncompressed */
+#define LZ4_BLOCK_UNCOMPRESSED		0x80000000
+
+/*
+ * A frame decoded while it is still arriving: src fills up from the
+ * front, BootLz4StreamDecompress is told how much of it is in and decodes
+ * every block that is complete by then.
+ */
+struct lz4_stream {
+	const unsigned char *src;
+	unsigned int pos;		/* next byte of src to decode */
+	unsigned char *dst;
+	unsigned int out;		/* bytes decoded into dst */
+	unsigned int dstlen;
+	unsigned char flg;		/* FLG byte, 0 until the header is in */
+	int done;			/* end mark seen */
+};
+
+unsigned int BootLz4FrameContentSize(const unsigned char *src, unsigned int srclen);
+void BootLz4StreamInit(struct lz4_stream *s, const unsigned char *src,
+		unsigned char *dst, unsigned int dstlen);
+int BootLz4StreamDecompress(struct lz4_stream *s, unsigned int avail);
+int BootLz4DecompressFrame(const unsigned char *src, unsigned int srclen,
+		unsigned char *dst, unsigned int dstlen);
+
+#endif // _BootLZ4_H_
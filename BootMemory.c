@@ -40,4 +40,13 @@ void * xbememset(void *dest, int data,  SIZE_T size)
 		*p ++ = data;
 	}
 	return dest;
-}
\ No newline at end of file
+}
+
+int _memcmp(const BYTE *pb, const BYTE *pb1, int n)
+{
+	while (n-- > 0) {
+		if (*pb != *pb1) return *pb - *pb1;
+		pb++; pb1++;
+	}
+	return 0;
+}
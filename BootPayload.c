@@ -0,0 +1,173 @@
+/*
+   Payload directory lookup for payloads embedded by imagebld
+*/
+
+#include <stddef.h>
+
+#include "consts.h"
+#include "xboxkrnl.h"
+#include "xbox.h"
+#include "boot.h"
+#include "BootPayload.h"
+#include "BootLZ4.h"
+
+/* The XBE is mapped at its base address, file offsets become addresses */
+#define XBE_BASE 0x10000
+
+/* Entries of images from before the chunk digests end here */
+#define ENTRY_MIN_SIZE offsetof(struct payload_entry, chunk_table)
+
+/* Where BootPayloadFind copies the entries to, one per type */
+static struct payload_entry Found[PAYLOAD_CONFIG];
+
+/* Returns the entry of a payload type, as this version knows entries:
+   fields the image has no room for are 0, so an entry from before the
+   chunk digests has no chunk table. */
+struct payload_entry *BootPayloadFind(unsigned int type) {
+	struct payload_dir *dir = (struct payload_dir *)(XBE_BASE + PAYLOAD_DIR_OFFSET);
+	struct payload_entry *found;
+	BYTE *entry;
+	unsigned int size;
+	int i;
+
+	if (dir->magic != PAYLOAD_DIR_MAGIC || dir->version != PAYLOAD_DIR_VERSION) {
+		dprintf("No payload directory in the XBE\n");
+		return NULL;
+	}
+	if (dir->entry_size < ENTRY_MIN_SIZE) {
+		dprintf("Payload entries of %d bytes are too short, the XBE is bad\n", dir->entry_size);
+		return NULL;
+	}
+	if (type < 1 || type > PAYLOAD_CONFIG) return NULL;
+
+	size = dir->entry_size < sizeof(struct payload_entry) ? dir->entry_size :
+		sizeof(struct payload_entry);
+	entry = (BYTE *)(XBE_BASE + dir->table);
+	for (i = 0; i < dir->count; i++) {
+		if (((struct payload_entry *)entry)->type == type) {
+			found = &Found[type - 1];
+			xbememset(found, 0, sizeof(struct payload_entry));
+			xbememcpy(found, entry, size);
+			return found;
+		}
+		entry += dir->entry_size;
+	}
+
+	return NULL;
+}
+
+/* Checks length stored bytes of a payload from pos on against its digest.
+   With a chunk table that is one chunk, without it the whole payload. */
+static int BootPayloadCheck(struct payload_entry *entry, unsigned int pos, BYTE *data, unsigned int length) {
+	BYTE Context[XC_SHA_CONTEXT_SIZE];
+	BYTE Digest[XC_SHA_DIGEST_SIZE];
+	BYTE *expected = entry->digest;
+
+	if (entry->digest_type != PAYLOAD_DIGEST_SHA1) return 1;
+	if (entry->chunk_table)
+		expected = (BYTE *)(XBE_BASE + entry->chunk_table) +
+			(pos >> entry->chunk_shift) * PAYLOAD_DIGEST_SIZE;
+
+	XcSHAInit(Context);
+	XcSHAUpdate(Context, data, length);
+	XcSHAFinal(Context, Digest);
+	if (_memcmp(Digest, expected, PAYLOAD_DIGEST_SIZE) == 0) return 1;
+
+	dprintf("Payload %d is damaged at byte %u, the XBE is bad\n", entry->type, pos);
+	return 0;
+}
+
+/* Sets the bytes checked at a time, a chunk of the chunk table or all of
+   them.  Returns 0 for a chunk size out of range, shifting by it would be
+   undefined and the table walk with it. */
+static int BootPayloadChunk(struct payload_entry *entry, unsigned int *chunk) {
+	*chunk = entry->size;
+	if (!entry->chunk_table) return 1;
+
+	if (entry->chunk_shift < PAYLOAD_CHUNK_SHIFT_MIN || entry->chunk_shift > PAYLOAD_CHUNK_SHIFT_MAX) {
+		dprintf("Payload %d has chunks of 2^%u bytes, the XBE is bad\n",
+			entry->type, entry->chunk_shift);
+		return 0;
+	}
+	*chunk = 1 << entry->chunk_shift;
+	return 1;
+}
+
+/* Checks all stored bytes of a payload, returns 0 if they are damaged */
+int BootPayloadVerify(struct payload_entry *entry) {
+	BYTE *data = (BYTE *)(XBE_BASE + entry->offset);
+	unsigned int chunk;
+	unsigned int pos, length;
+
+	if (!BootPayloadChunk(entry, &chunk)) return 0;
+	for (pos = 0; pos < entry->size; pos += length) {
+		length = entry->size - pos < chunk ? entry->size - pos : chunk;
+		if (!BootPayloadCheck(entry, pos, data + pos, length)) return 0;
+	}
+
+	return 1;
+}
+
+/* Copies or decompresses a payload into buffer, returns its size once
+   decompressed or -1 if it does not fit or is damaged.  Every chunk is
+   checked before it is used, while it is still in the cache. */
+int BootPayloadLoad(struct payload_entry *entry, void *buffer, unsigned int size) {
+	BYTE *data = (BYTE *)(XBE_BASE + entry->offset);
+	unsigned int chunk;
+	unsigned int pos, length;
+	struct lz4_stream s;
+
+	if (!BootPayloadChunk(entry, &chunk)) return -1;
+
+	switch (entry->compression) {
+	case PAYLOAD_COMP_NONE:
+		if (entry->size > size) return -1;
+		break;
+	case PAYLOAD_COMP_LZ4:
+		BootLz4StreamInit(&s, data, buffer, size);
+		break;
+	default:
+		dprintf("Unknown payload compression %d\n", entry->compression);
+		return -1;
+	}
+
+	for (pos = 0; pos < entry->size; pos += length) {
+		length = entry->size - pos < chunk ? entry->size - pos : chunk;
+		if (!BootPayloadCheck(entry, pos, data + pos, length)) return -1;
+
+		if (entry->compression == PAYLOAD_COMP_NONE)
+			xbememcpy((BYTE *)buffer + pos, data + pos, length);
+		else if (BootLz4StreamDecompress(&s, pos + length) < 0)
+			return -1;
+	}
+
+	if (entry->compression == PAYLOAD_COMP_NONE) return entry->size;
+	if (!s.done) return -1;
+	return s.out;
+}
+
+/* Returns a payload where it is in the XBE if it can be used from there,
+   NULL if it has to be loaded into a buffer.  It must be RESIDENT and its
+   load_size bytes physically contiguous between lowest and MAX_KERNEL,
+   the escape code and the kernel see physical addresses only. */
+void *BootPayloadResident(struct payload_entry *entry, unsigned int lowest) {
+	BYTE *data = (BYTE *)(XBE_BASE + entry->offset);
+	PHYSICAL_ADDRESS Phys;
+	unsigned int i;
+
+	if (!(entry->flags & PAYLOAD_FLAG_RESIDENT) || entry->compression != PAYLOAD_COMP_NONE)
+		return NULL;
+	if ((unsigned int)data & (PAGE_SIZE - 1)) return NULL;
+
+	Phys = MmGetPhysicalAddress(data);
+	if (Phys < lowest || Phys + entry->load_size > MAX_KERNEL) return NULL;
+
+	for (i = PAGE_SIZE; i < entry->load_size; i += PAGE_SIZE) {
+		if (MmGetPhysicalAddress(data + i) != Phys + i) {
+			dprintf("Payload %d is not contiguous, copying it\n", entry->type);
+			return NULL;
+		}
+	}
+
+	return data;
+}
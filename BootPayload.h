@@ -0,0 +1,95 @@
+#ifndef _BootPayload_H_
+#define _BootPayload_H_
+
+/*
+ * Payload directory of an XBE built by imagebld.
+ *
+ * The directory header sits at file offset 0x1080 (header.S).  It points
+ * to a table of entries that imagebld writes behind the last payload, one
+ * per payload embedded in the image.  Offsets are file offsets, the XBE
+ * is mapped at its base address 0x10000 so the loader adds that.
+ *
+ * Readers must use entry_size to step through the table; fields added in
+ * later versions go at the end of an entry.  The version only changes if
+ * existing fields change meaning.
+ *
+ * imagebld includes this header too, so only plain C types are used here.
+ */
+
+#define PAYLOAD_DIR_OFFSET		0x1080
+#define PAYLOAD_DIR_MAGIC		0x44504258	/* "XBPD" */
+#define PAYLOAD_DIR_VERSION		1
+
+/* directory flags */
+#define PAYLOAD_DIR_PAGE_ALIGNED	0x00000001	/* payloads start on 4 KB pages */
+
+/* entry types */
+#define PAYLOAD_KERNEL			1
+#define PAYLOAD_INITRD			2
+#define PAYLOAD_CONFIG			3
+
+/*
+ * entry flags
+ *
+ * RESIDENT: stored uncompressed on a page boundary and followed by its
+ * padding, load_size bytes in all, so the loader can hand it on where it
+ * is instead of copying it.
+ */
+#define PAYLOAD_FLAG_RESIDENT		0x00000001
+
+/* compression of the stored bytes */
+#define PAYLOAD_COMP_NONE		0
+#define PAYLOAD_COMP_LZ4		1	/* LZ4 frame, BootLZ4.h */
+
+/* digest of the stored bytes */
+#define PAYLOAD_DIGEST_NONE		0
+#define PAYLOAD_DIGEST_SHA1		1
+
+#define PAYLOAD_DIGEST_SIZE		20
+
+/*
+ * Chunk digests: if chunk_table is set, it is the file offset of one
+ * PAYLOAD_DIGEST_SIZE SHA-1 per 1 << chunk_shift bytes of the stored
+ * bytes, the last chunk being what is left.  chunk_root is the SHA-1 of
+ * those digests one after the other.  The tables are in the section,
+ * behind the entry table.  chunk_shift is 16 as imagebld writes it, the
+ * loader takes 4 KB to 16 MB chunks.
+ */
+
+#define PAYLOAD_CHUNK_SHIFT_MIN		12
+#define PAYLOAD_CHUNK_SHIFT_MAX		24
+
+struct payload_dir {
+	unsigned int magic;
+	unsigned short version;
+	unsigned short header_size;	/* sizeof(struct payload_dir) */
+	unsigned short entry_size;	/* sizeof(struct payload_entry) */
+	unsigned short count;		/* number of entries */
+	unsigned int table;		/* file offset of the first entry */
+	unsigned int flags;
+	unsigned int reserved[3];
+};
+
+struct payload_entry {
+	unsigned int type;		/* PAYLOAD_KERNEL, ... */
+	unsigned int flags;
+	unsigned int compression;	/* PAYLOAD_COMP_ */
+	unsigned int digest_type;	/* PAYLOAD_DIGEST_ */
+	unsigned int offset;		/* file offset of the stored bytes */
+	unsigned int size;		/* stored bytes */
+	unsigned int raw_size;		/* size once decompressed */
+	unsigned int load_addr;		/* lowest physical address to load to, 0 = any */
+	unsigned int load_size;		/* buffer size to load into, >= raw_size */
+	unsigned char digest[PAYLOAD_DIGEST_SIZE];
+	unsigned int reserved[2];
+	unsigned int chunk_table;	/* file offset of the chunk digests, 0 = none */
+	unsigned int chunk_shift;
+	unsigned char chunk_root[PAYLOAD_DIGEST_SIZE];
+};
+
+struct payload_entry *BootPayloadFind(unsigned int type);
+int BootPayloadVerify(struct payload_entry *entry);
+int BootPayloadLoad(struct payload_entry *entry, void *buffer, unsigned int size);
+void *BootPayloadResident(struct payload_entry *entry, unsigned int lowest);
+
+#endif // _BootPayload_H_
@@ -0,0 +1,242 @@
+/*
+   Chunked, double-buffered file reads, see BootRead.h
+*/
+
+#include "consts.h"
+#include "xboxkrnl.h"
+#include "xbox.h"
+#include "boot.h"
+#include "BootRead.h"
+
+/* devices we remember a chunk size for */
+#define READ_DEVICES		4
+#define READ_DEVICE_NAME	16
+/* chunks measured at one size before it is compared with the best */
+#define READ_TUNE_SAMPLES	4
+
+/*
+ * A device is what the path starts with, up to and with the colon,
+ * "\??\E:" for the files next to the XBE.  Tuning doubles the chunk size
+ * while that makes reading at least 1/16 faster, then stays with the
+ * fastest size for every later file on the device.
+ */
+typedef struct _READ_DEVICE {
+	char Name[READ_DEVICE_NAME];
+	ULONG Chunk;		/* chunk size to queue */
+	ULONG Best;		/* fastest chunk size so far, 0 = none measured */
+	ULONGLONG BestBytes, BestTicks;
+	ULONGLONG Bytes, Ticks;	/* measured at Chunk */
+	ULONGLONG Landed;	/* performance counter at the last landing */
+	int Samples;
+	int Tuned;
+} READ_DEVICE;
+
+static READ_DEVICE Devices[READ_DEVICES];
+static ULONG Sequence;
+
+static READ_DEVICE *BootReadDevice(PCSZ Name) {
+	READ_DEVICE *Device;
+	int i, j, Length;
+
+	for (Length = 0; Name[Length] && Name[Length] != ':'; Length++);
+	if (Name[Length] == ':') Length++;
+	if (Length >= READ_DEVICE_NAME) Length = READ_DEVICE_NAME - 1;
+
+	for (i = 0; i < READ_DEVICES; i++) {
+		Device = &Devices[i];
+		if (!Device->Chunk) break;
+		for (j = 0; j < Length && Device->Name[j] == Name[j]; j++);
+		if (j == Length && !Device->Name[Length]) return Device;
+	}
+	// Out of room, the last one is shared
+	if (i == READ_DEVICES) return &Devices[READ_DEVICES - 1];
+
+	xbememcpy(Device->Name, Name, Length);
+	Device->Name[Length] = 0;
+	Device->Chunk = READ_CHUNK_SIZE;
+	return Device;
+}
+
+/* Counts a landed chunk towards its device's chunk size */
+static void BootReadTune(READ_STREAM *Stream, ULONG Length) {
+	READ_DEVICE *Device = Stream->Device;
+	ULONGLONG Now = KeQueryPerformanceCounter();
+	ULONGLONG Ticks = Now - Device->Landed;
+
+	// With reads of other files queued in between this is still the
+	// time the disk took for this one
+	Device->Landed = Now;
+	// The first chunk of a file pays for the seek to it
+	if (Device->Tuned || Stream->Done == 0 || Length != Device->Chunk) return;
+
+	Device->Bytes += Length;
+	Device->Ticks += Ticks;
+	if (++Device->Samples < READ_TUNE_SAMPLES) return;
+
+	// Bytes / Ticks > BestBytes / BestTicks * 17 / 16, without a 64 bit division
+	if (!Device->Best || Device->Bytes * Device->BestTicks * 16 >
+			Device->BestBytes * Device->Ticks * 17) {
+		Device->Best = Device->Chunk;
+		Device->BestBytes = Device->Bytes;
+		Device->BestTicks = Device->Ticks;
+		if (Device->Chunk < READ_CHUNK_MAX) Device->Chunk *= 2;
+		else Device->Tuned = 1;
+	} else {
+		Device->Chunk = Device->Best;
+		Device->Tuned = 1;
+	}
+	Device->Bytes = Device->Ticks = 0;
+	Device->Samples = 0;
+}
+
+/* Queues the next chunk of the stream into Slot, if there is one left */
+static int BootReadQueue(READ_STREAM *Stream, READ_SLOT *Slot) {
+	LARGE_INTEGER Offset;
+	ULONG Length = Stream->Device->Chunk;
+
+	if (Stream->Queued == Stream->Size) return 1;
+	if (Length > Stream->Size - Stream->Queued) Length = Stream->Size - Stream->Queued;
+
+	Slot->Offset = Stream->Queued;
+	Slot->Length = Length;
+	Slot->Sequence = Sequence++;
+	// Only the last chunk is not a whole number of sectors
+	if (Stream->Align) Length = (Length + Stream->Align - 1) & ~(Stream->Align - 1);
+	Offset.QuadPart = Slot->Offset;
+	Slot->Status = NtReadFile(Stream->File, Slot->Event, NULL, NULL, &Slot->IoStatus,
+			Stream->Buffer + Slot->Offset, Length, &Offset);
+	if (!NT_SUCCESS(Slot->Status)) {
+		dprintf("Error %08x reading %s at %u\n", Slot->Status, Stream->Name, Slot->Offset);
+		Slot->Length = 0;
+		return 0;
+	}
+	Stream->Queued += Slot->Length;
+
+	return 1;
+}
+
+/* Waits for the read in Slot, returns 0 if it failed or came up short */
+static int BootReadWait(READ_STREAM *Stream, READ_SLOT *Slot) {
+	ULONG Length = Slot->Length;
+
+	Slot->Length = 0;
+	if (Slot->Status == STATUS_PENDING)
+		NtWaitForSingleObject(Slot->Event, FALSE, NULL);
+
+	// A rounded up read stops at the end of the file
+	if (!NT_SUCCESS(Slot->IoStatus.Status) || Slot->IoStatus.Information < Length) {
+		dprintf("Error %08x reading %s at %u\n", Slot->IoStatus.Status,
+			Stream->Name, Slot->Offset);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Reads the first Length bytes of File into Buffer and waits for them,
+   for a look at a file header before a stream is set up.  Returns the
+   bytes read, less at the end of the file, or -1. */
+int BootReadPeek(HANDLE File, BYTE *Buffer, ULONG Length) {
+	READ_SLOT Slot;
+	LARGE_INTEGER Offset;
+
+	if (!NT_SUCCESS(NtCreateEvent(&Slot.Event, NULL, NotificationEvent, FALSE)))
+		return -1;
+
+	Offset.QuadPart = 0;
+	Slot.Status = NtReadFile(File, Slot.Event, NULL, NULL, &Slot.IoStatus,
+			Buffer, Length, &Offset);
+	if (Slot.Status == STATUS_PENDING)
+		NtWaitForSingleObject(Slot.Event, FALSE, NULL);
+	NtClose(Slot.Event);
+
+	if (!NT_SUCCESS(Slot.Status) || !NT_SUCCESS(Slot.IoStatus.Status)) return -1;
+
+	return Slot.IoStatus.Information;
+}
+
+/* Sets up a stream reading Size bytes of File into Buffer */
+int BootReadOpen(READ_STREAM *Stream, HANDLE File, PCSZ Name, BYTE *Buffer, ULONG Size) {
+	int i;
+
+	xbememset(Stream, 0, sizeof(READ_STREAM));
+	Stream->File = File;
+	Stream->Name = Name;
+	Stream->Buffer = Buffer;
+	Stream->Size = Size;
+	Stream->Device = BootReadDevice(Name);
+
+	for (i = 0; i < READ_SLOTS; i++) {
+		if (!NT_SUCCESS(NtCreateEvent(&Stream->Slot[i].Event, NULL, NotificationEvent, FALSE))) {
+			BootReadClose(Stream);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Reads Count streams at once, returns 0 on a read error or if a Process
+   says so */
+int BootReadRun(READ_STREAM **Streams, int Count) {
+	READ_STREAM *Stream;
+	READ_SLOT *Slot;
+	BYTE *Data;
+	ULONG Length;
+	int i, j;
+
+	for (i = 0; i < Count; i++)
+		Streams[i]->Device->Landed = KeQueryPerformanceCounter();
+	for (i = 0; i < Count; i++)
+		for (j = 0; j < READ_SLOTS; j++)
+			if (!BootReadQueue(Streams[i], &Streams[i]->Slot[j])) return 0;
+
+	for (;;) {
+		// The oldest read in flight, chunks of a stream land in file order
+		Stream = NULL;
+		Slot = NULL;
+		for (i = 0; i < Count; i++) {
+			for (j = 0; j < READ_SLOTS; j++) {
+				if (!Streams[i]->Slot[j].Length) continue;
+				if (Slot && (LONG)(Streams[i]->Slot[j].Sequence - Slot->Sequence) >= 0)
+					continue;
+				Stream = Streams[i];
+				Slot = &Stream->Slot[j];
+			}
+		}
+		if (!Slot) break;
+
+		Data = Stream->Buffer + Slot->Offset;
+		Length = Slot->Length;
+		if (!BootReadWait(Stream, Slot)) return 0;
+		BootReadTune(Stream, Length);
+
+		// Keep the disk busy while this chunk is processed
+		if (!BootReadQueue(Stream, Slot)) return 0;
+
+		Stream->Done += Length;
+		if (Stream->Process && !Stream->Process(Stream, Data, Length)) return 0;
+	}
+
+	return 1;
+}
+
+/* Waits for reads still in flight and frees the events, not the file */
+void BootReadClose(READ_STREAM *Stream) {
+	READ_SLOT *Slot;
+	int i;
+
+	for (i = 0; i < READ_SLOTS; i++) {
+		Slot = &Stream->Slot[i];
+		if (Slot->Length && Slot->Status == STATUS_PENDING)
+			NtWaitForSingleObject(Slot->Event, FALSE, NULL);
+		Slot->Length = 0;
+		if (Slot->Event) NtClose(Slot->Event);
+		Slot->Event = NULL;
+	}
+}
+
+/* The chunk size the stream's device settled on, or is trying */
+ULONG BootReadChunk(READ_STREAM *Stream) {
+	return Stream->Device->Chunk;
+}
@@ -0,0 +1,68 @@
+#ifndef _BootRead_H_
+#define _BootRead_H_
+
+/*
+ * Chunked file reads into one contiguous buffer.
+ *
+ * A stream keeps READ_SLOTS reads in flight, each straight into its place
+ * in the final buffer.  When the oldest one lands, the next chunk is
+ * queued before the landed one is handed to Process, so the disk works on
+ * the following chunks while the CPU works on this one.
+ *
+ * BootReadRun takes several streams and keeps the reads of all of them
+ * queued, so the disk does not go idle between one file and the next.
+ * Reads are waited for in the order they were queued, with the event
+ * NtReadFile sets.  Only kernel calls through xboxkrnl.h are used, a host
+ * build can point those at stubs.
+ *
+ * The file must be opened without FILE_SYNCHRONOUS_IO_NONALERT.  The
+ * chunk size starts at READ_CHUNK_SIZE and is tuned per device from the
+ * measured throughput, up to READ_CHUNK_MAX.
+ *
+ * A file opened with FILE_NO_INTERMEDIATE_BUFFERING goes from the disk
+ * into the buffer without a copy through the file cache, but buffer,
+ * offsets and lengths must then be sector aligned.  Set Align to
+ * READ_ALIGN for such a file: chunks are multiples of it anyway, and the
+ * last one is rounded up, so the buffer needs READ_ALIGN bytes of room
+ * behind Size.  What lands there is undefined.
+ */
+
+#define READ_SLOTS		2
+/* a page is a whole number of 512 byte HDD and 2048 byte DVD sectors */
+#define READ_ALIGN		PAGE_SIZE
+
+typedef struct _READ_STREAM READ_STREAM;
+
+/* called for every chunk in file order, returns 0 to stop the read */
+typedef int (*READ_PROCESS)(READ_STREAM *Stream, BYTE *Data, ULONG Length);
+
+typedef struct _READ_SLOT {
+	HANDLE Event;
+	IO_STATUS_BLOCK IoStatus;
+	NTSTATUS Status;	/* what NtReadFile returned */
+	ULONG Offset;		/* file offset of the chunk */
+	ULONG Length;		/* 0 = nothing in flight */
+	ULONG Sequence;		/* order it was queued in */
+} READ_SLOT;
+
+struct _READ_STREAM {
+	HANDLE File;
+	PCSZ Name;
+	BYTE *Buffer;		/* the file goes here */
+	ULONG Size;		/* bytes to read */
+	ULONG Align;		/* 0 or READ_ALIGN, reads rounded up to it */
+	ULONG Queued;		/* bytes asked for so far */
+	ULONG Done;		/* bytes landed and processed */
+	READ_PROCESS Process;
+	PVOID Context;
+	struct _READ_DEVICE *Device;
+	READ_SLOT Slot[READ_SLOTS];
+};
+
+int BootReadPeek(HANDLE File, BYTE *Buffer, ULONG Length);
+int BootReadOpen(READ_STREAM *Stream, HANDLE File, PCSZ Name, BYTE *Buffer, ULONG Size);
+int BootReadRun(READ_STREAM **Streams, int Count);
+void BootReadClose(READ_STREAM *Stream);
+ULONG BootReadChunk(READ_STREAM *Stream);
+
+#endif // _BootRead_H_
@@ -0,0 +1,292 @@
+/*
+ *  readtest.c
+ *
+ *  Description:
+ *      Runs BootRead.c on the host against a simulated disk.  The kernel
+ *      calls it makes are stubs: NtReadFile queues the read and returns
+ *      STATUS_PENDING, the disk does one read at a time in the order they
+ *      were queued, each taking a seek plus its length over the transfer
+ *      rate, and NtWaitForSingleObject moves the clock on to when the read
+ *      it waits for lands.  KeQueryPerformanceCounter is that clock.
+ *      Processing a chunk costs CPU time as hashing it would.
+ *
+ *      Two files are read as two streams in one BootReadRun, one of them
+ *      with READ_ALIGN, and it checks that
+ *
+ *      - every stream that has bytes left keeps READ_SLOTS reads queued,
+ *        so the disk never waits between one file and the next,
+ *      - the chunks of each stream are processed in file order and hold
+ *        the bytes of the file,
+ *      - a file shorter than the stream fails the run.
+ *
+ *      Prints what it found and exits with 0 if it is all right.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "../consts.h"
+#include "../xboxkrnl.h"
+#include "../xbox.h"
+#include "../boot.h"
+#include "../BootRead.h"
+
+#define FILES		2
+#define REQUESTS	16
+/* disk and CPU time, in counter ticks */
+#define SEEK_TICKS	2000
+#define DISK_BYTES_PER_TICK	64
+#define CPU_BYTES_PER_TICK	256
+
+struct request {
+	int used;		/* until its event is waited for */
+	int landed;
+	int file;
+	HANDLE event;
+	PIO_STATUS_BLOCK io;
+	BYTE *buffer;
+	ULONG offset, length;
+	ULONGLONG lands;	/* clock when the disk is done with it */
+};
+
+static const ULONG sizes[FILES] = { 3000000, 5000001 };
+static BYTE *files[FILES];
+
+static struct request queue[REQUESTS];
+static ULONGLONG now, disk_free, disk_idle;
+static int events;
+static READ_STREAM *running[FILES];
+static int errors;
+
+static void fail(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	errors++;
+}
+
+int printk(const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vprintf(fmt, ap);
+	va_end(ap);
+	return n;
+}
+
+void *xbememcpy(void *dest, const void *src, SIZE_T size)
+{
+	return memcpy(dest, src, size);
+}
+
+void *xbememset(void *dest, int data, SIZE_T size)
+{
+	return memset(dest, data, size);
+}
+
+/* Finishes every read the disk is done with by now */
+static void land(void)
+{
+	struct request *r;
+	ULONG length;
+	int i;
+
+	for (i = 0; i < REQUESTS; i++) {
+		r = &queue[i];
+		if (!r->used || r->landed || r->lands > now) continue;
+
+		// Reads past the end stop there, as on a real file
+		length = r->length;
+		if (r->offset >= sizes[r->file]) length = 0;
+		else if (length > sizes[r->file] - r->offset) length = sizes[r->file] - r->offset;
+		memcpy(r->buffer, files[r->file] + r->offset, length);
+		r->io->Status = 0;
+		r->io->Information = length;
+		r->landed = 1;
+	}
+}
+
+static NTSTATUS __attribute__((__stdcall__)) StubReadFile(HANDLE File, HANDLE Event,
+		PIO_APC_ROUTINE ApcRoutine, PVOID ApcContext, PIO_STATUS_BLOCK IoStatusBlock,
+		PVOID Buffer, ULONG Length, PLARGE_INTEGER ByteOffset)
+{
+	struct request *r;
+	int i;
+
+	for (i = 0; i < REQUESTS && queue[i].used; i++);
+	if (i == REQUESTS) {
+		fail("more than %d reads queued\n", REQUESTS);
+		return 0xC0000001;
+	}
+	r = &queue[i];
+
+	// The disk waited for this one if it was done with the last
+	if (disk_free && now > disk_free) disk_idle += now - disk_free;
+	if (disk_free < now) disk_free = now;
+	disk_free += SEEK_TICKS + Length / DISK_BYTES_PER_TICK;
+
+	r->used = 1;
+	r->landed = 0;
+	r->file = (int)(long)File - 1;
+	r->event = Event;
+	r->io = IoStatusBlock;
+	r->buffer = Buffer;
+	r->offset = ByteOffset->QuadPart;
+	r->length = Length;
+	r->lands = disk_free;
+	IoStatusBlock->Status = STATUS_PENDING;
+
+	return STATUS_PENDING;
+}
+
+/* Counts the reads of file not waited for yet */
+static int queued(int file)
+{
+	int i, n = 0;
+
+	for (i = 0; i < REQUESTS; i++)
+		if (queue[i].used && queue[i].file == file) n++;
+	return n;
+}
+
+/* Every stream of the run that has bytes left keeps all its slots busy */
+static void check_queued(const char *where)
+{
+	int i;
+
+	for (i = 0; i < FILES; i++) {
+		if (running[i] == NULL || running[i]->Queued == running[i]->Size) continue;
+		if (queued(i) != READ_SLOTS)
+			fail("file %d has %d reads queued %s at %lu, not %d\n", i, queued(i),
+			     where, running[i]->Queued, READ_SLOTS);
+	}
+}
+
+static NTSTATUS __attribute__((__stdcall__)) StubWaitForSingleObject(HANDLE Handle,
+		BOOLEAN Alertable, PLARGE_INTEGER Timeout)
+{
+	int i;
+
+	check_queued("in a wait");
+	for (i = 0; i < REQUESTS; i++)
+		if (queue[i].used && queue[i].event == Handle && queue[i].lands > now)
+			now = queue[i].lands;
+	land();
+	for (i = 0; i < REQUESTS; i++)
+		if (queue[i].used && queue[i].event == Handle) queue[i].used = 0;
+
+	return 0;
+}
+
+static NTSTATUS __attribute__((__stdcall__)) StubCreateEvent(PHANDLE EventHandle,
+		POBJECT_ATTRIBUTES ObjectAttributes, EVENT_TYPE EventType, BOOLEAN InitialState)
+{
+	*EventHandle = (HANDLE)(long)++events;
+	return 0;
+}
+
+static NTSTATUS __attribute__((__stdcall__)) StubClose(HANDLE Handle)
+{
+	return 0;
+}
+
+static ULONGLONG __attribute__((__stdcall__)) StubQueryPerformanceCounter(VOID)
+{
+	return now;
+}
+
+NTSTATUS __attribute__((__stdcall__)) (*NtReadFile)(HANDLE, HANDLE, PIO_APC_ROUTINE, PVOID,
+		PIO_STATUS_BLOCK, PVOID, ULONG, PLARGE_INTEGER) = StubReadFile;
+NTSTATUS __attribute__((__stdcall__)) (*NtWaitForSingleObject)(HANDLE, BOOLEAN,
+		PLARGE_INTEGER) = StubWaitForSingleObject;
+NTSTATUS __attribute__((__stdcall__)) (*NtCreateEvent)(PHANDLE, POBJECT_ATTRIBUTES, EVENT_TYPE,
+		BOOLEAN) = StubCreateEvent;
+NTSTATUS __attribute__((__stdcall__)) (*NtClose)(HANDLE) = StubClose;
+ULONGLONG __attribute__((__stdcall__)) (*KeQueryPerformanceCounter)(VOID) =
+		StubQueryPerformanceCounter;
+
+/* Chunks have to come in file order and hold what the file does */
+static int Process(READ_STREAM *Stream, BYTE *Data, ULONG Length)
+{
+	int file = (int)(long)Stream->Context;
+
+	check_queued("while processing");
+	if (Data != Stream->Buffer + Stream->Done - Length)
+		fail("file %d: chunk at %ld out of order, %lu done\n", file,
+		     (long)(Data - Stream->Buffer), Stream->Done);
+	else if (memcmp(Data, files[file] + (Data - Stream->Buffer), Length))
+		fail("file %d: wrong bytes at %ld\n", file, (long)(Data - Stream->Buffer));
+	now += Length / CPU_BYTES_PER_TICK;
+	return 1;
+}
+
+/* Reads size[i] bytes of each file at once, returns 0 if the run failed */
+static int run(BYTE **buffers, ULONG *size)
+{
+	READ_STREAM streams[FILES];
+	int i, ok;
+
+	for (i = 0; i < FILES; i++) {
+		if (!BootReadOpen(&streams[i], (HANDLE)(long)(i + 1), i ? "\\??\\E:\\initrd" :
+				  "\\??\\E:\\vmlinuz", buffers[i], size[i])) {
+			fail("BootReadOpen failed\n");
+			return 0;
+		}
+		streams[i].Process = Process;
+		streams[i].Context = (PVOID)(long)i;
+		running[i] = &streams[i];
+	}
+	streams[1].Align = READ_ALIGN;
+
+	ok = BootReadRun(running, FILES);
+	for (i = 0; i < FILES; i++) {
+		running[i] = NULL;
+		BootReadClose(&streams[i]);
+		if (queued(i)) fail("file %d still has reads queued after the close\n", i);
+	}
+	if (ok) {
+		for (i = 0; i < FILES; i++)
+			if (streams[i].Done != size[i])
+				fail("file %d: %lu of %lu bytes\n", i, streams[i].Done, size[i]);
+		printf("chunk size %lu\n", BootReadChunk(&streams[0]));
+	}
+
+	return ok;
+}
+
+int main(void)
+{
+	BYTE *buffers[FILES];
+	ULONG size[FILES];
+	ULONG i;
+	int f;
+
+	srand(1);
+	for (f = 0; f < FILES; f++) {
+		files[f] = malloc(sizes[f]);
+		buffers[f] = malloc(sizes[f] + 2 * READ_ALIGN);
+		if (files[f] == NULL || buffers[f] == NULL) return 1;
+		for (i = 0; i < sizes[f]; i++) files[f][i] = rand();
+		size[f] = sizes[f];
+	}
+
+	if (!run(buffers, size)) fail("reading both files failed\n");
+	for (f = 0; f < FILES; f++)
+		if (memcmp(buffers[f], files[f], sizes[f])) fail("file %d read wrong\n", f);
+	printf("%llu ticks, the disk waited %llu of them\n", now, disk_idle);
+	if (disk_idle) fail("the disk waited between reads\n");
+
+	// One more page than the file has
+	size[1] = sizes[1] + PAGE_SIZE;
+	if (run(buffers, size)) fail("reading past the end did not fail\n");
+
+	printf(errors ? "FAILED\n" : "OK\n");
+	return errors != 0;
+}
@@ -0,0 +1,314 @@
+/*
+ *  bench.c
+ *
+ *  Description:
+ *      Throughput of the imagebld command line tool over payload sizes.
+ *      For every size it writes a synthetic kernel and initrd of that
+ *      many MB and a small config, then times -build, -extract, -verify
+ *      (the hashing) and -replace of the initrd with a bigger one, one at
+ *      a time in a child process, for plain, LZ4 and page aligned images.
+ *      The replaced image has to come out byte for byte the same as a
+ *      fresh build with the bigger initrd, ImageSize and all.
+ *      wait4() gives the CPU time and the
+ *      peak RSS of each, /proc/<pid>/io of the not yet reaped child its
+ *      read and write system calls.
+ *
+ *      One tab separated line per phase goes to stdout, the fastest of
+ *      the runs:
+ *
+ *      phase mode mb bytes seconds mb_s cpu_s max_rss_kb io_syscalls
+ *
+ *      bytes is what went into the image, MB/s is taken over that.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define MB		(1024 * 1024)
+#define CONFIG_SIZE	4096
+/* what the initrd grows by for -replace, not a whole number of chunks */
+#define REPLACE_GROWTH	(MB + 12345)
+
+struct sample {
+	double seconds;
+	double cpu;
+	long max_rss;		/* KB */
+	unsigned long long syscalls;
+};
+
+static const char *modes[] = { "plain", "-lz4", "-page" };
+
+static unsigned long long rng = 0x9e3779b97f4a7c15ULL;
+
+static unsigned long long xorshift(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng;
+}
+
+/*
+ * Writes size bytes to name.  A kernel is incompressible like a real
+ * bzImage; every other 4 KB of an initrd repeats text, so LZ4 gets about
+ * half of it.
+ */
+static int generate(const char *name, unsigned int size, int compressible)
+{
+	static const char text[] = "usr/lib/modules/kernel/drivers/net/ethernet/ ";
+	unsigned char *buf;
+	unsigned int i, n;
+	FILE *f;
+	int error = 0;
+
+	f = fopen(name, "wb");
+	if (f == NULL) return 1;
+	buf = malloc(MB);
+	if (buf == NULL) {
+		fclose(f);
+		return 1;
+	}
+
+	while (!error && size) {
+		n = size < MB ? size : MB;
+		for (i = 0; i < n; i += 8) {
+			unsigned long long r = xorshift();
+			memcpy(buf + i, &r, n - i < 8 ? n - i : 8);
+		}
+		if (compressible)
+			for (i = 0; i < n; i++)
+				if (i & 0x1000) buf[i] = text[i % (sizeof(text) - 1)];
+		error = fwrite(buf, 1, n, f) != n;
+		size -= n;
+	}
+
+	free(buf);
+	return fclose(f) || error;
+}
+
+/* 0 if the files a and b hold the same bytes */
+static int compare(const char *a, const char *b)
+{
+	FILE *fa, *fb;
+	int ca, cb;
+
+	fa = fopen(a, "rb");
+	fb = fopen(b, "rb");
+	if (fa == NULL || fb == NULL) {
+		if (fa != NULL) fclose(fa);
+		if (fb != NULL) fclose(fb);
+		return 1;
+	}
+	do {
+		ca = getc(fa);
+		cb = getc(fb);
+	} while (ca == cb && ca != EOF);
+	fclose(fa);
+	fclose(fb);
+	return ca != cb;
+}
+
+static unsigned long long proc_syscalls(pid_t pid)
+{
+	char name[64], line[128];
+	unsigned long long n, total = 0;
+	FILE *f;
+
+	sprintf(name, "/proc/%d/io", (int)pid);
+	f = fopen(name, "r");
+	if (f == NULL) return 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "syscr: %llu", &n) == 1 || sscanf(line, "syscw: %llu", &n) == 1)
+			total += n;
+	}
+	fclose(f);
+	return total;
+}
+
+/* Runs argv with its output thrown away, returns 0 if it exited with 0 */
+static int run(char **argv, struct sample *s)
+{
+	struct timespec t0, t1;
+	struct rusage ru;
+	siginfo_t info;
+	pid_t pid;
+	int status, fd;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	pid = fork();
+	if (pid < 0) return 1;
+	if (pid == 0) {
+		fd = open("/dev/null", O_WRONLY);
+		if (fd >= 0) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+		}
+		execv(argv[0], argv);
+		_exit(127);
+	}
+
+	// Left a zombie for a moment, so its counters can still be read
+	if (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) < 0) return 1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	s->syscalls = proc_syscalls(pid);
+	if (wait4(pid, &status, 0, &ru) < 0) return 1;
+
+	s->seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	s->cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		 ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+	s->max_rss = ru.ru_maxrss;
+
+	return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+/* The fastest of runs runs */
+static int best(char **argv, unsigned int runs, struct sample *s)
+{
+	struct sample one;
+	unsigned int i;
+
+	for (i = 0; i < runs; i++) {
+		if (run(argv, &one)) return 1;
+		if (i == 0 || one.seconds < s->seconds) *s = one;
+	}
+	return 0;
+}
+
+static void report(const char *phase, const char *mode, unsigned int mb,
+		   unsigned long long bytes, const struct sample *s)
+{
+	printf("%s\t%s\t%u\t%llu\t%.4f\t%.1f\t%.4f\t%ld\t%llu\n", phase, mode, mb, bytes,
+	       s->seconds, s->seconds > 0 ? bytes / (double)MB / s->seconds : 0, s->cpu,
+	       s->max_rss, s->syscalls);
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	char kernel[4096], initrd[4096], config[4096], xbe[4096];
+	char xkernel[4096], xinitrd[4096], xconfig[4096];
+	char rinitrd[4096], fresh[4096];
+	char *image, *loader, *dir;
+	unsigned int runs = 3, mb, m;
+	unsigned long long bytes;
+	struct sample s;
+	int a = 1, error = 0;
+
+	if (argc > 2 && !strcmp(argv[1], "-r")) {
+		runs = atoi(argv[2]);
+		if (runs < 1) runs = 1;
+		a = 3;
+	}
+	if (argc - a < 4) {
+		fprintf(stderr, "usage: bench [-r runs] image loader directory mb ...\n");
+		return 1;
+	}
+	image = argv[a];
+	loader = argv[a + 1];
+	dir = argv[a + 2];
+	mkdir(dir, 0755);
+
+	snprintf(kernel, sizeof(kernel), "%s/kernel", dir);
+	snprintf(initrd, sizeof(initrd), "%s/initrd", dir);
+	snprintf(config, sizeof(config), "%s/config", dir);
+	snprintf(xbe, sizeof(xbe), "%s/bench.xbe", dir);
+	snprintf(xkernel, sizeof(xkernel), "%s/kernel.out", dir);
+	snprintf(xinitrd, sizeof(xinitrd), "%s/initrd.out", dir);
+	snprintf(xconfig, sizeof(xconfig), "%s/config.out", dir);
+	snprintf(rinitrd, sizeof(rinitrd), "%s/initrd.replace", dir);
+	snprintf(fresh, sizeof(fresh), "%s/fresh.xbe", dir);
+
+	printf("# phase\tmode\tmb\tbytes\tseconds\tmb_s\tcpu_s\tmax_rss_kb\tio_syscalls\n");
+
+	for (a += 3; !error && a < argc; a++) {
+		mb = atoi(argv[a]);
+		if (mb < 1 || mb > 1024) {
+			fprintf(stderr, "bad size %s\n", argv[a]);
+			error = 1;
+			break;
+		}
+		if (generate(kernel, mb * MB, 0) || generate(initrd, mb * MB, 1) ||
+		    generate(config, CONFIG_SIZE, 1) || generate(rinitrd, mb * MB + REPLACE_GROWTH, 1)) {
+			fprintf(stderr, "Error writing the inputs to %s\n", dir);
+			error = 1;
+			break;
+		}
+		bytes = 2ULL * mb * MB + CONFIG_SIZE;
+
+		for (m = 0; !error && m < sizeof(modes) / sizeof(modes[0]); m++) {
+			char *flag = m ? (char *)modes[m] : NULL;
+			char *build[] = { image, "-build", "-o", xbe, loader, kernel, initrd, config, NULL, NULL };
+			char *extract[] = { image, "-extract", xbe, "kernel", xkernel, "initrd", xinitrd,
+					    "config", xconfig, NULL };
+			char *verify[] = { image, "-verify", xbe, NULL };
+			char *replace[] = { image, "-replace", xbe, "initrd", rinitrd, NULL };
+			char *rebuild[] = { image, "-build", "-o", fresh, loader, kernel, rinitrd, config, NULL, NULL };
+
+			// The mode goes in front of the file names
+			if (flag != NULL) {
+				memmove(&build[3], &build[2], 6 * sizeof(char *));
+				build[2] = flag;
+				memmove(&rebuild[3], &rebuild[2], 6 * sizeof(char *));
+				rebuild[2] = flag;
+			}
+
+			if (best(build, runs, &s)) {
+				fprintf(stderr, "-build %s failed\n", modes[m]);
+				error = 1;
+				break;
+			}
+			report("build", modes[m], mb, bytes, &s);
+
+			if (best(extract, runs, &s)) {
+				fprintf(stderr, "-extract %s failed\n", modes[m]);
+				error = 1;
+				break;
+			}
+			report("extract", modes[m], mb, bytes, &s);
+
+			if (best(verify, runs, &s)) {
+				fprintf(stderr, "-verify %s failed\n", modes[m]);
+				error = 1;
+				break;
+			}
+			report("hash", modes[m], mb, bytes, &s);
+
+			// Runs after the first put the same initrd in again
+			if (best(replace, runs, &s)) {
+				fprintf(stderr, "-replace %s failed\n", modes[m]);
+				error = 1;
+				break;
+			}
+			report("replace", modes[m], mb, mb * MB + REPLACE_GROWTH, &s);
+
+			if (run(rebuild, &s) || compare(xbe, fresh)) {
+				fprintf(stderr, "-replace %s differs from a fresh build\n", modes[m]);
+				error = 1;
+				break;
+			}
+		}
+	}
+
+	unlink(kernel);
+	unlink(initrd);
+	unlink(config);
+	unlink(xbe);
+	unlink(xkernel);
+	unlink(xinitrd);
+	unlink(xconfig);
+	unlink(rinitrd);
+	unlink(fresh);
+	rmdir(dir);
+
+	return error;
+}
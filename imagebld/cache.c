@@ -0,0 +1,71 @@
+/*
+ *  cache.c
+ *
+ *  Description:
+ *      Reads and writes the build cache and compares inputs against it.
+ *      An input whose inode, size and mtime are what they were is taken
+ *      to be unchanged; for anything else the caller compares digests.
+ *      The SHA-1 midstates are saved with their partial block, so the
+ *      section hash can pick up at any byte.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <unistd.h>
+#include "cache.h"
+
+int cache_read(int fd, struct build_cache *c)
+{
+	if (pread(fd, c, sizeof(*c), 0) != sizeof(*c)) return 1;
+	if (c->magic != CACHE_MAGIC || c->version != CACHE_VERSION) return 1;
+	if (c->count > CACHE_PAYLOADS) return 1;
+
+	return 0;
+}
+
+int cache_write(int fd, const struct build_cache *c)
+{
+	if (pwrite(fd, c, sizeof(*c), 0) != sizeof(*c)) return 1;
+
+	return ftruncate(fd, sizeof(*c)) < 0;
+}
+
+void cache_input_stat(struct cache_input *in, const struct stat *st)
+{
+	memset(in, 0, sizeof(*in));
+	in->dev = st->st_dev;
+	in->ino = st->st_ino;
+	in->mtime_sec = st->st_mtim.tv_sec;
+	in->mtime_nsec = st->st_mtim.tv_nsec;
+	in->size = st->st_size;
+	if (S_ISREG(st->st_mode)) in->flags = CACHE_INPUT_STAT;
+}
+
+/* Same file, same size, not touched since */
+int cache_input_same(const struct cache_input *a, const struct cache_input *b)
+{
+	return (a->flags & CACHE_INPUT_STAT) && (b->flags & CACHE_INPUT_STAT) &&
+	       a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+	       a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec;
+}
+
+void cache_sha1_save(struct cache_sha1 *s, const SHA1Context *context)
+{
+	memset(s, 0, sizeof(*s));
+	memcpy(s->hash, context->Intermediate_Hash, sizeof(s->hash));
+	s->length_low = context->Length_Low;
+	s->length_high = context->Length_High;
+	s->index = context->Message_Block_Index;
+	memcpy(s->block, context->Message_Block, s->index);
+}
+
+void cache_sha1_load(SHA1Context *context, const struct cache_sha1 *s)
+{
+	SHA1Reset(context);
+	memcpy(context->Intermediate_Hash, s->hash, sizeof(s->hash));
+	context->Length_Low = s->length_low;
+	context->Length_High = s->length_high;
+	context->Message_Block_Index = s->index & 63;
+	memcpy(context->Message_Block, s->block, context->Message_Block_Index);
+}
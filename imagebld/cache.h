@@ -0,0 +1,74 @@
+/*
+ *  cache.h
+ *
+ *  The build cache of imagebld -build -cache: what the last build was
+ *  made from and where it put things, so the next build only redoes what
+ *  changed.  It is a local file, written in host byte order.
+ */
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <sys/stat.h>
+#include "sha1.h"
+#include "../BootPayload.h"
+
+#define CACHE_MAGIC		0x43424958	/* "XIBC" */
+#define CACHE_VERSION		2
+
+#define CACHE_PAYLOADS		3
+
+/* build_cache flags, the options the image was built with */
+#define CACHE_LZ4		0x00000001
+#define CACHE_PAGE		0x00000002
+#define CACHE_SECTIONS		0x00000004
+
+/* cache_input flags */
+#define CACHE_INPUT_STAT	0x00000001	/* a regular file, the stat fields count */
+#define CACHE_INPUT_DIGEST	0x00000002	/* digest is known, not for pipes */
+
+/* An input file as it was seen */
+struct cache_input {
+	unsigned long long dev;
+	unsigned long long ino;
+	long long mtime_sec;
+	long long mtime_nsec;
+	unsigned int size;
+	unsigned int flags;		/* CACHE_INPUT_ */
+	unsigned char digest[SHA1HashSize];
+};
+
+/* A SHA-1 midstate */
+struct cache_sha1 {
+	unsigned int hash[SHA1HashSize / 4];
+	unsigned int length_low;
+	unsigned int length_high;
+	unsigned int index;
+	unsigned char block[64];
+};
+
+struct build_cache {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int flags;
+	unsigned int count;
+	unsigned int table_start;
+	unsigned int section_size;
+	struct cache_input loader;
+	struct cache_input output;	/* the image right after the build */
+	struct cache_input inputs[CACHE_PAYLOADS];
+	struct payload_entry entries[CACHE_PAYLOADS];
+	struct cache_sha1 mid[CACHE_PAYLOADS];	/* section hash at each payload */
+	unsigned char section_hash[SHA1HashSize];
+};
+
+int cache_read(int fd, struct build_cache *c);
+int cache_write(int fd, const struct build_cache *c);
+
+void cache_input_stat(struct cache_input *in, const struct stat *st);
+int cache_input_same(const struct cache_input *a, const struct cache_input *b);
+
+void cache_sha1_save(struct cache_sha1 *s, const SHA1Context *context);
+void cache_sha1_load(SHA1Context *context, const struct cache_sha1 *s);
+
+#endif /* _CACHE_H_ */
@@ -0,0 +1,138 @@
+/*
+ *  chunk.c
+ *
+ *  Description:
+ *      Hashes payloads in fixed-size chunks on a worker pool.  The chunks
+ *      of all ranges are numbered through and handed out one at a time,
+ *      so a big initrd spreads over all the threads just like a batch of
+ *      small payloads does.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "chunk.h"
+
+struct chunk_pool {
+	int fd;
+	const unsigned char *map;
+	struct chunk_range *ranges;
+	unsigned int count;
+	unsigned int shift;
+	unsigned int next;	/* next chunk to hand to a worker, over all ranges */
+	unsigned int total;
+	pthread_mutex_t lock;
+	int error;
+};
+
+unsigned int chunk_count(unsigned int size, unsigned int shift)
+{
+	return (unsigned int)(((unsigned long long)size + (1U << shift) - 1) >> shift);
+}
+
+static int chunk_one(struct chunk_pool *p, unsigned int n, unsigned char *buf)
+{
+	struct chunk_range *r = p->ranges;
+	const unsigned char *data;
+	unsigned int chunks, ofs, len;
+	SHA1Context context;
+
+	// Find the range chunk n is in
+	while ((chunks = chunk_count(r->size, p->shift)) <= n) {
+		n -= chunks;
+		r++;
+	}
+	ofs = n << p->shift;
+	len = r->size - ofs < (1U << p->shift) ? r->size - ofs : 1U << p->shift;
+
+	if (p->map != NULL) {
+		data = p->map + r->offset + ofs;
+	} else {
+		if (pread(p->fd, buf, len, r->offset + ofs) != len) return 1;
+		data = buf;
+	}
+	SHA1Reset(&context);
+	SHA1Input(&context, data, len);
+	SHA1Result(&context, r->digests + n * SHA1HashSize);
+
+	return 0;
+}
+
+static void *chunk_worker(void *arg)
+{
+	struct chunk_pool *p = arg;
+	unsigned char *buf = NULL;
+	unsigned int n;
+	int error;
+
+	if (p->map == NULL) {
+		buf = malloc(1U << p->shift);
+		if (buf == NULL) {
+			pthread_mutex_lock(&p->lock);
+			p->error = 1;
+			pthread_mutex_unlock(&p->lock);
+			return NULL;
+		}
+	}
+
+	pthread_mutex_lock(&p->lock);
+	while (!p->error && p->next < p->total) {
+		n = p->next++;
+		pthread_mutex_unlock(&p->lock);
+
+		error = chunk_one(p, n, buf);
+
+		pthread_mutex_lock(&p->lock);
+		if (error) p->error = 1;
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	free(buf);
+	return NULL;
+}
+
+int chunk_hash(int fd, const unsigned char *map, struct chunk_range *ranges,
+	       unsigned int count, unsigned int shift, unsigned int threads)
+{
+	struct chunk_pool p;
+	pthread_t *workers;
+	unsigned int i, nworkers;
+
+	memset(&p, 0, sizeof(p));
+	p.fd = fd;
+	p.map = map;
+	p.ranges = ranges;
+	p.count = count;
+	p.shift = shift;
+	for (i = 0; i < count; i++) p.total += chunk_count(ranges[i].size, shift);
+	if (p.total == 0) return 0;
+	pthread_mutex_init(&p.lock, NULL);
+
+	nworkers = threads ? threads : 1;
+	if (nworkers > p.total) nworkers = p.total;
+	workers = calloc(nworkers, sizeof(pthread_t));
+	i = 0;
+	if (workers != NULL && nworkers > 1)
+		for (; i < nworkers; i++)
+			if (pthread_create(&workers[i], NULL, chunk_worker, &p)) break;
+	// Whatever did not get a thread is done here
+	if (i == 0) chunk_worker(&p);
+	nworkers = i;
+	for (i = 0; i < nworkers; i++) pthread_join(workers[i], NULL);
+	free(workers);
+	pthread_mutex_destroy(&p.lock);
+
+	return p.error;
+}
+
+void chunk_root(const unsigned char *digests, unsigned int chunks, unsigned char *root)
+{
+	SHA1Context context;
+
+	SHA1Reset(&context);
+	SHA1Input(&context, digests, chunks * SHA1HashSize);
+	SHA1Result(&context, root);
+}
@@ -0,0 +1,37 @@
+/*
+ *  chunk.h
+ *
+ *  Chunk digests of payloads: the SHA-1 of every 1 << shift bytes of a
+ *  payload, and a root digest over those.  They are hashed on a pool of
+ *  threads, from a mapping of the image or from its fd, so a payload can
+ *  be checked in parallel and a bad one narrowed down to a chunk.
+ */
+
+#ifndef _CHUNK_H_
+#define _CHUNK_H_
+
+#include "sha1.h"
+
+/* 64 KB chunks */
+#define CHUNK_SHIFT		16
+
+/* A payload to hash, size bytes at offset, into chunk_count() digests */
+struct chunk_range {
+	unsigned int offset;
+	unsigned int size;
+	unsigned char *digests;
+};
+
+unsigned int chunk_count(unsigned int size, unsigned int shift);
+
+/*
+ * Hashes the chunks of every range on up to threads threads.  With map
+ * set the bytes are taken from there, else they are read from fd.
+ */
+int chunk_hash(int fd, const unsigned char *map, struct chunk_range *ranges,
+	       unsigned int count, unsigned int shift, unsigned int threads);
+
+/* The SHA-1 of the chunk digests, one after the other */
+void chunk_root(const unsigned char *digests, unsigned int chunks, unsigned char *root);
+
+#endif /* _CHUNK_H_ */
@@ -0,0 +1,289 @@
+/*
+ *  cpio.c
+ *
+ *  Description:
+ *      Builds an initramfs from a directory, the way
+ *          cd dir && find . | cpio -o -H newc
+ *      would, without the external tools and the temporary file.
+ *
+ *      The tree is walked and sorted by path first, so the archive does
+ *      not depend on the order readdir returns things in, and the place
+ *      of every file in the archive is known before anything is read.
+ *      The file contents are then read straight into their places by a
+ *      pool of threads.  Owners are set to root, inode numbers are
+ *      handed out in archive order and hard links are stored as separate
+ *      files, so the same tree always gives the same archive.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include "cpio.h"
+
+#define CPIO_HEADER_SIZE	110
+#define CPIO_TRAILER		"TRAILER!!!"
+
+#define PAD4(x)			(((x) + 3) & ~3U)
+
+struct cpio_entry {
+	char *path;		/* on the host */
+	char *name;		/* in the archive, relative to the top */
+	struct stat st;
+	char *link;		/* symlink target */
+	unsigned int filesize;	/* bytes of data in the archive */
+	unsigned int offset;	/* of the header in the archive */
+};
+
+struct cpio_tree {
+	struct cpio_entry *entries;
+	unsigned int count;
+
+	// Reading the files in
+	unsigned char *data;
+	unsigned int next;	/* next entry to hand to a worker */
+	pthread_mutex_t lock;
+	int error;
+};
+
+static int cpio_add(struct cpio_tree *t, const char *path, const char *name)
+{
+	struct cpio_entry *e;
+	ssize_t n;
+
+	e = realloc(t->entries, (t->count + 1) * sizeof(struct cpio_entry));
+	if (e == NULL) return 1;
+	t->entries = e;
+	e = &t->entries[t->count];
+	memset(e, 0, sizeof(*e));
+
+	if (lstat(path, &e->st) < 0) {
+		printf("%s: cannot stat\n", path);
+		return 1;
+	}
+	e->path = strdup(path);
+	e->name = strdup(name);
+	if (e->path == NULL || e->name == NULL) return 1;
+
+	if (S_ISREG(e->st.st_mode)) {
+		if (e->st.st_size > 0x7fffffff) {
+			printf("%s: too big for an initrd\n", path);
+			return 1;
+		}
+		e->filesize = e->st.st_size;
+	} else if (S_ISLNK(e->st.st_mode)) {
+		e->link = malloc(e->st.st_size + 1);
+		if (e->link == NULL) return 1;
+		n = readlink(path, e->link, e->st.st_size + 1);
+		if (n < 0 || n > e->st.st_size) {
+			printf("%s: cannot read link\n", path);
+			return 1;
+		}
+		e->link[n] = 0;
+		e->filesize = n;
+	} else if (!S_ISDIR(e->st.st_mode) && !S_ISCHR(e->st.st_mode) && !S_ISBLK(e->st.st_mode) &&
+		   !S_ISFIFO(e->st.st_mode) && !S_ISSOCK(e->st.st_mode)) {
+		printf("%s: unknown file type, skipped\n", path);
+		free(e->path);
+		free(e->name);
+		return 0;
+	}
+
+	t->count++;
+	return 0;
+}
+
+/* Adds everything below path, name being where path is in the archive */
+static int cpio_scan(struct cpio_tree *t, const char *path, const char *name)
+{
+	DIR *d;
+	struct dirent *de;
+	char *subpath, *subname;
+	unsigned int n;
+	int error = 0;
+
+	d = opendir(path);
+	if (d == NULL) {
+		printf("%s: cannot read directory\n", path);
+		return 1;
+	}
+
+	while (!error && (de = readdir(d)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+
+		subpath = malloc(strlen(path) + strlen(de->d_name) + 2);
+		subname = malloc(strlen(name) + strlen(de->d_name) + 2);
+		if (subpath == NULL || subname == NULL) {
+			error = 1;
+		} else {
+			sprintf(subpath, "%s/%s", path, de->d_name);
+			sprintf(subname, "%s%s%s", name, name[0] ? "/" : "", de->d_name);
+			n = t->count;
+			error = cpio_add(t, subpath, subname);
+			if (!error && t->count > n && S_ISDIR(t->entries[n].st.st_mode))
+				error = cpio_scan(t, subpath, subname);
+		}
+		free(subpath);
+		free(subname);
+	}
+	closedir(d);
+
+	return error;
+}
+
+static int cpio_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct cpio_entry *)a)->name, ((const struct cpio_entry *)b)->name);
+}
+
+/* Writes a header and the name, returns the size of both with padding */
+static unsigned int cpio_header(unsigned char *p, unsigned int ino, unsigned int mode,
+				unsigned int nlink, unsigned int mtime, unsigned int filesize,
+				unsigned int rdev_major, unsigned int rdev_minor, const char *name)
+{
+	unsigned int namesize = strlen(name) + 1;
+	char hdr[CPIO_HEADER_SIZE + 1];
+	unsigned int len = PAD4(CPIO_HEADER_SIZE + namesize);
+
+	snprintf(hdr, sizeof(hdr), "070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X",
+		 ino, mode, 0, 0, nlink, mtime, filesize, 0, 0, rdev_major, rdev_minor, namesize, 0);
+	memcpy(p, hdr, CPIO_HEADER_SIZE);
+	memcpy(p + CPIO_HEADER_SIZE, name, namesize);
+	memset(p + CPIO_HEADER_SIZE + namesize, 0, len - CPIO_HEADER_SIZE - namesize);
+
+	return len;
+}
+
+static void *cpio_worker(void *arg)
+{
+	struct cpio_tree *t = arg;
+	struct cpio_entry *e;
+	unsigned char *p;
+	unsigned int done;
+	ssize_t n;
+	int fd;
+
+	pthread_mutex_lock(&t->lock);
+	while (!t->error && t->next < t->count) {
+		e = &t->entries[t->next++];
+		pthread_mutex_unlock(&t->lock);
+
+		if (S_ISREG(e->st.st_mode) && e->filesize) {
+			p = t->data + e->offset + PAD4(CPIO_HEADER_SIZE + strlen(e->name) + 1);
+			done = 0;
+			fd = open(e->path, O_RDONLY);
+			if (fd >= 0) {
+				while (done < e->filesize) {
+					n = read(fd, p + done, e->filesize - done);
+					if (n <= 0) break;
+					done += n;
+				}
+				close(fd);
+			}
+			if (done != e->filesize) {
+				printf("%s: cannot read, or it changed\n", e->path);
+				pthread_mutex_lock(&t->lock);
+				t->error = 1;
+				continue;
+			}
+		}
+		pthread_mutex_lock(&t->lock);
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	return NULL;
+}
+
+/*
+ *  cpio_build
+ *
+ *  Description:
+ *      Packs everything below dir into a newc archive, with threads
+ *      threads reading the files.  The archive is an anonymous mapping
+ *      of *size bytes, for munmap() once done with.
+ *
+ *  Returns:
+ *      0 on success.
+ *
+ */
+int cpio_build(const char *dir, unsigned char **data, unsigned int *size, unsigned int threads)
+{
+	struct cpio_tree t;
+	struct cpio_entry *e;
+	pthread_t *workers = NULL;
+	unsigned long long total = 0;
+	unsigned int pos, i;
+	int error = 1;
+
+	memset(&t, 0, sizeof(t));
+	pthread_mutex_init(&t.lock, NULL);
+
+	if (cpio_scan(&t, dir, "")) goto out;
+	qsort(t.entries, t.count, sizeof(struct cpio_entry), cpio_cmp);
+
+	// Everything gets its place before anything is read
+	for (i = 0; i < t.count; i++) {
+		e = &t.entries[i];
+		e->offset = total;
+		total += PAD4(CPIO_HEADER_SIZE + strlen(e->name) + 1) + PAD4(e->filesize);
+	}
+	total += PAD4(CPIO_HEADER_SIZE + sizeof(CPIO_TRAILER));
+	if (total > 0xffffff00) {
+		printf("%s: too big for an initrd\n", dir);
+		goto out;
+	}
+
+	t.data = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (t.data == MAP_FAILED) {
+		t.data = NULL;
+		goto out;
+	}
+
+	for (i = 0; i < t.count; i++) {
+		e = &t.entries[i];
+		pos = e->offset + cpio_header(t.data + e->offset, i + 1, e->st.st_mode,
+					      S_ISDIR(e->st.st_mode) ? 2 : 1, e->st.st_mtime, e->filesize,
+					      major(e->st.st_rdev), minor(e->st.st_rdev), e->name);
+		if (e->link != NULL) memcpy(t.data + pos, e->link, e->filesize);
+		// The mapping starts out zeroed, that is the padding done
+	}
+	cpio_header(t.data + total - PAD4(CPIO_HEADER_SIZE + sizeof(CPIO_TRAILER)),
+		    0, 0, 1, 0, 0, 0, 0, CPIO_TRAILER);
+
+	if (threads > t.count) threads = t.count;
+	if (threads < 1) threads = 1;
+	workers = calloc(threads, sizeof(pthread_t));
+	if (workers == NULL) goto out;
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&workers[i], NULL, cpio_worker, &t)) break;
+	if (i == 0) cpio_worker(&t);
+	threads = i;
+	for (i = 0; i < threads; i++) pthread_join(workers[i], NULL);
+	if (t.error) goto out;
+
+	*data = t.data;
+	*size = total;
+	t.data = NULL;
+	error = 0;
+out:
+	if (t.data != NULL) munmap(t.data, total);
+	for (i = 0; i < t.count; i++) {
+		free(t.entries[i].path);
+		free(t.entries[i].name);
+		free(t.entries[i].link);
+	}
+	free(t.entries);
+	free(workers);
+	pthread_mutex_destroy(&t.lock);
+
+	return error;
+}
@@ -0,0 +1,13 @@
+/*
+ *  cpio.h
+ *
+ *  Packs a directory tree into a cpio archive in the "newc" format the
+ *  kernel unpacks as initramfs.
+ */
+
+#ifndef _CPIO_H_
+#define _CPIO_H_
+
+int cpio_build(const char *dir, unsigned char **data, unsigned int *size, unsigned int threads);
+
+#endif /* _CPIO_H_ */
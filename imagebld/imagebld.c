@@ -1,386 +1,447 @@
-#include <errno.h>
+/*
+ *  imagebld.c
+ *
+ *  Description:
+ *      Command line front end to libimagebld: parses the arguments, sets
+ *      up a struct imagebld and prints what comes back.
+ */
+
+#define _GNU_SOURCE
+
 #include <stdio.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <sys/ioctl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <time.h>
 
-// #include <linux/hdreg.h>
 #include <string.h>
 
 #include <stdarg.h>
 #include <stdlib.h>
-#include "sha1.h"
-#include "xbe-header.h"
-#include "../config.h"
+#include "libimagebld.h"
 
 
-#define debug
+/* Payload kinds as they are named on the command line */
+struct payload_kind {
+	const char *kind;
+	unsigned int type;
+	const char *what;
+	const char *filename;	/* what -extract calls it */
+};
 
-#define ValueDumps	0x1000
+static const struct payload_kind payload_kinds[] = {
+	{ "kernel", PAYLOAD_KERNEL, "Kernel", "kernel" },
+	{ "initrd", PAYLOAD_INITRD, "Ramdisk", "ramdisk" },
+	{ "config", PAYLOAD_CONFIG, "Config", "config.cfg" },
+};
 
+static const struct payload_kind *payload_kind(const char *kind)
+{
+	unsigned int i;
 
-struct Checksumstruct {
-	unsigned char Checksum[20];	
-	unsigned int Size_ramcopy;
-	unsigned int compressed_image_start;
-	unsigned int compressed_image_size;
-	unsigned int Biossize_type;
-}Checksumstruct;
+	for (i = 0; i < sizeof(payload_kinds) / sizeof(payload_kinds[0]); i++)
+		if (!strcmp(kind, payload_kinds[i].kind)) return &payload_kinds[i];
+	return NULL;
+}
 
-void shax(unsigned char *result, unsigned char *data, unsigned int len)
+static const struct payload_kind *payload_kind_of(unsigned int type)
 {
-	struct SHA1Context context;
-	SHA1Reset(&context);
-	SHA1Input(&context, (unsigned char *)&len, 4);
-	SHA1Input(&context, data, len);
-	SHA1Result(&context,result);	
+	unsigned int i;
+
+	for (i = 0; i < sizeof(payload_kinds) / sizeof(payload_kinds[0]); i++)
+		if (payload_kinds[i].type == type) return &payload_kinds[i];
+	return NULL;
 }
 
+/* Messages go to the FILE the io arg points to */
+static void log_file(void *arg, const char *fmt, va_list ap)
+{
+	vfprintf(arg, fmt, ap);
+}
 
 
-int xbebuild (	unsigned char * xbeimage,
-		unsigned char * vmlinuzname,
-		unsigned char * initrdname,
-		unsigned char * configname
-		)
+/*
+ * Writes payloads of an image out as they are stored.  With no arguments
+ * every payload goes to its usual name (kernel, ramdisk, config.cfg),
+ * otherwise args are pairs of a payload kind and a file name, "-" being
+ * stdout.
+ */
+int xbeextract (	struct imagebld *ib,
+			const char * xbeimage,
+			const char ** args,
+			int nargs
+			)
+{
+	// Messages go to stderr if a payload goes to stdout
+	FILE *msg = stdout;
+
+	struct imagebld_result res;
+	struct payload_entry entry;
+	const struct payload_kind *kind;
+	const char *filename;
+	unsigned int i;
+	int a, out, found;
+
+	if (nargs % 2) {
+		fprintf(stderr, "-extract: expected kernel|initrd|config and a file name\n");
+		return 1;
+	}
+	for (a = 1; a < nargs; a += 2)
+		if (!strcmp(args[a], "-")) msg = stderr;
+	for (a = 0; a < nargs; a += 2) {
+		if (payload_kind(args[a]) == NULL) {
+			fprintf(msg, "Unknown payload %s, expected kernel, initrd or config\n", args[a]);
+			return 1;
+		}
+	}
+	ib->io.arg = msg;
+
+	if (imagebld_list(ib, xbeimage, &res)) return 1;
+
+	fprintf(msg, "Linked Sections\n");
+	for (i = 0; i < res.count; i++) {
+		fprintf(msg, "Payload %d type %d       : 0x%08X, 0x%08X bytes%s\n", i, res.entries[i].type,
+			res.entries[i].offset, res.entries[i].size,
+			res.entries[i].compression == PAYLOAD_COMP_LZ4 ? ", LZ4" : "");
+	}
+	fprintf(msg, "----------------\n");
+
+	for (a = 0; a < (nargs ? nargs : 1); a += 2) {
+		found = 0;
+		for (i = 0; i < res.count; i++) {
+			kind = payload_kind_of(res.entries[i].type);
+			if (kind == NULL) continue;
+			if (nargs && strcmp(args[a], kind->kind)) continue;
+			filename = nargs ? args[a + 1] : kind->filename;
+			found = 1;
+
+			fprintf(msg, "Extracting %s", kind->what);
+			if (!strcmp(filename, "-")) {
+				out = STDOUT_FILENO;
+			} else {
+				out = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			}
+			if (out < 0 || imagebld_extract(ib, xbeimage, kind->type, out, &entry)) {
+				fprintf(msg, " .. Error writing %s\n", filename);
+				if (out > STDOUT_FILENO) close(out);
+				return 1;
+			}
+			if (out != STDOUT_FILENO) close(out);
+			fprintf(msg, " .. Done \n");
+		}
+		if (nargs && !found) {
+			fprintf(msg, "No %s in %s\n", args[a], xbeimage);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/* One image to verify and what came out */
+struct verify_image {
+	char *name;
+	const char *status;	/* NULL = OK */
+	unsigned int bad_offset;	/* of the bad chunk, 0 = not known */
+};
+
+struct verify {
+	struct imagebld ib;	/* with the threads each image gets */
+	struct verify_image *images;
+	unsigned int count;
+	unsigned int next;	/* next image to hand to a worker */
+	pthread_mutex_t lock;
+	unsigned long long hashed;
+};
+
+static void *verify_worker(void *arg)
+{
+	struct verify *v = arg;
+	struct verify_image *img;
+	struct imagebld_result res;
+
+	pthread_mutex_lock(&v->lock);
+	while (v->next < v->count) {
+		img = &v->images[v->next++];
+		pthread_mutex_unlock(&v->lock);
+
+		imagebld_verify(&v->ib, img->name, &res, &img->status);
+		img->bad_offset = res.bad_offset;
+
+		pthread_mutex_lock(&v->lock);
+		v->hashed += res.hashed;
+	}
+	pthread_mutex_unlock(&v->lock);
+
+	return NULL;
+}
+
+static int verify_add(struct verify *v, const char *name)
+{
+	struct verify_image *img;
+
+	img = realloc(v->images, (v->count + 1) * sizeof(struct verify_image));
+	if (img == NULL) return 1;
+	v->images = img;
+	img = &v->images[v->count++];
+	img->name = strdup(name);
+	img->status = NULL;
+	img->bad_offset = 0;
+	return img->name == NULL;
+}
+
+/* Adds path if it is a file, or every *.xbe below it if it is a directory */
+static int verify_collect(struct verify *v, const char *path, int top)
 {
-	FILE *f;
-	
-    int a;
-	unsigned char sha_Message_Digest[SHA1HashSize];
-
-    unsigned char *xbe;
-    unsigned int xbesize = 0;
-
-    unsigned char *vmlinuz;
-    unsigned int vmlinux_size = 0;
-    unsigned int vmlinux_start=0;
-        
-    unsigned char *initrd;         
-    unsigned int initrd_size = 0;
-	unsigned int initrd_start = 0;
-
-    unsigned char *config;         
-    unsigned int config_size = 0;
-	unsigned int config_start = 0;
-
-	unsigned int FileSize = 0;
-
-    unsigned int xbeloader_size=0;
-	
-	unsigned int temp;
-		 
-	XBE_HEADER *header;
- 	XBE_SECTION *sechdr;
-
-    printf("ImageBLD Hasher by XBL Project (c) hamtitampti\n");
-    printf("XBEBOOT Modus\n\n");
-
-#ifdef LOADXBE	
-	f = fopen(vmlinuzname, "rb");
-	if (f!=NULL) 
-    	{    
- 		fseek(f, 0, SEEK_END); 
-         	vmlinux_size	 = ftell(f);        
-         	fseek(f, 0, SEEK_SET);
-    		vmlinuz = malloc(vmlinux_size);
-    		memset(vmlinuz,0xff,sizeof(vmlinuz));
-    		fread(vmlinuz, 1, vmlinux_size, f);
-    		fclose(f);
-    		printf("VMLinuz found, linking it in\n");
-    	} else  {
-    		printf("VMLinuz not found ----> ERROR \n");
-    		return 1;
-    		}
-#endif
-#ifdef LOADHDD_CFGFALLBACK
-	f = fopen(configname, "rb");
-	if (f!=NULL) 
-    	{    
- 		fseek(f, 0, SEEK_END); 
-         	config_size	 = ftell(f);        
-         	fseek(f, 0, SEEK_SET);
-    		config = malloc(config_size);
-    		fread(config, 1, config_size, f);
-    		fclose(f);
-		printf("Linuxboot.cfg Existing, Linking it in\n");
-    	} else  {
-    		printf("Linuxboot.cfg not Existing ---> ERROR \n");
-    		return 1;
-    		}
-#endif
-#ifdef LOADXBE
-	f = fopen(initrdname, "rb");
-	if (f!=NULL) 
-    	{    
- 		fseek(f, 0, SEEK_END); 
-         	initrd_size	 = ftell(f);        
-         	fseek(f, 0, SEEK_SET);
-    		initrd = malloc(initrd_size);
-    		fread(initrd, 1, initrd_size, f);
-   		printf("Initrd Existing, Linking it in\n");
-    	} else  {
-    		printf("Initrd not Existing   ---> ERROR \n");
-    		return 1;
-    		}
-#endif    	
-	f = fopen(xbeimage, "rb");
-    	if (f!=NULL) 
-    	{   
-  		fseek(f, 0, SEEK_END); 
-         	xbesize	 = ftell(f); 
-		FileSize = xbesize;
-         	fseek(f, 0, SEEK_SET);
-           	  
-           	
-//           	xbe = malloc(xbesize+vmlinux_size+1024*1024);
-           	xbe = malloc(xbesize+vmlinux_size+3*1024*1024+initrd_size+config_size);
-           	    		
-    		memset(xbe,0x00,sizeof(xbesize+vmlinux_size+3*1024*1024+initrd_size+config_size));
-    		fread(xbe, 1, xbesize, f);
-    		fclose(f);
-	      
-	      	//printf("xxx:     : 0x%08X\n", (unsigned int)xbesize);
-	        
-	       	// We make some Allignment
-	       	xbesize = (xbesize & 0xffffff00) + 0x100;
-	        	      
-	        //vmlinux_size = (vmlinux_size & 0xfffff800 ) + 0x400;
-	        
-#ifdef LOADXBE
-	        vmlinux_start = xbesize;
-	        memcpy(&xbe[ValueDumps + 0x80],&vmlinux_start,4);
-		memcpy(&xbe[ValueDumps + 0x84],&vmlinux_size,4);
-
-	        memcpy(&xbe[vmlinux_start],vmlinuz,vmlinux_size);
-	        		
-		// We tell the XBEBOOT loader, that the Paramter he should pass to the Kernel = 2MB for the Size
-		
-		//temp= 2*1024*1024;
-		
-		temp = vmlinux_size;
-		temp = (temp & 0xffff0000) + 0xffff + 0xffff;
-		memcpy(&xbe[ValueDumps + 0x88],&temp,4);		
-		
-		xbesize = xbesize + vmlinux_size;
-		FileSize += vmlinux_size;
-		// Ok, we allign again
-		xbesize = (xbesize & 0xffffff00) + 0x100;
-
-#endif
-		
-#ifdef LOADXBE		
-		initrd_start = xbesize;
-		memcpy(&xbe[ValueDumps + 0x8C],&initrd_start,4);
-		memcpy(&xbe[ValueDumps + 0x90],&initrd_size,4);
-		
-		memcpy(&xbe[initrd_start],initrd,initrd_size);
-		
-		xbesize = xbesize + initrd_size;	
-		FileSize += initrd_size;
-                xbesize = (xbesize & 0xffffff00) + 0x100;
-#endif                
-
-#ifdef LOADHDD_CFGFALLBACK
-               	config_start = xbesize;
-		memcpy(&xbe[ValueDumps + 0x94],&config_start,4);
-		memcpy(&xbe[ValueDumps + 0x98],&config_size,4);               	
-		
-		memcpy(&xbe[config_start],config,config_size);               	
-
-		xbesize = xbesize + config_size;	
-		FileSize += config_size;
-                xbesize = (xbesize & 0xffffff00) + 0x100;
-#endif
-                			        
-		#ifdef debug
-	 	printf("Linking Section\n");
-	 	#ifdef LOADXBE	
-	 	printf("Start of Linux Kernel    : 0x%08X\n", vmlinux_start);
-	 	printf("Size of Linux Kernel     : 0x%08X\n", vmlinux_size);
-		printf("Start of InitRD          : 0x%08X\n", initrd_start);
-	 	printf("Size of Initrd           : 0x%08X\n", initrd_size);
-		#endif		
-		#ifdef LOADHDD_CFGFALLBACK
-		printf("Start of Config          : 0x%08X\n", config_start);
-	 	printf("Size of config           : 0x%08X\n", config_size);
-	 	#endif
-		printf("----------------\n");
-		#endif	      
-	      
-	      
-	      	  
-	        header = (XBE_HEADER*) xbe;
-	        
-		// We calculate a new Size of the overall XBE, we allign too		
-		
-		xbeloader_size = xbesize - 0x1000;
-		
-		xbesize = (xbesize & 0xffffff00) + 0x100;
-		
-	        header->ImageSize = FileSize; 
-		
-		//printf("%08x",sechdr->FileSize);                    
-		
-	        
-	  	#ifdef debug
-	 	printf("Size of all headers:     : 0x%08X\n", (unsigned int)header->HeaderSize);
-         	printf("Size of entire image     : 0x%08X\n", (unsigned int)header->ImageSize);
-		#endif
-
-		// This selects the first section, we only have one
-		sechdr = (XBE_SECTION *)(((char *)xbe) + (int)header->Sections - (int)header->BaseAddress);
-
-		sechdr->FileSize = xbeloader_size;
-		sechdr->VirtualSize = xbeloader_size;
-			        
-        	shax(&sha_Message_Digest[0], ((unsigned char *)xbe)+(int)sechdr->FileAddress ,sechdr->FileSize);
-	  	memcpy(&sechdr->ShaHash[0],&sha_Message_Digest[0],20);
-	  	
-	  	#ifdef debug
-		
-		printf("S0: Virtual address      : 0x%08X\n", (unsigned int)sechdr->VirtualAddress);
-         	printf("S0: Virtual size         : 0x%08X\n", (unsigned int)sechdr->VirtualSize);
-         	printf("S0: File address         : 0x%08X\n", (unsigned int)sechdr->FileAddress);
-         	printf("S0: File size            : 0x%08X\n", (unsigned int)sechdr->FileSize);
-
-		printf("Section 0 Hash XBE       : ");
-		for(a=0; a<SHA1HashSize; a++) {
-			printf("%02x",sha_Message_Digest[a]);
+	struct stat st;
+	struct dirent *de;
+	DIR *d;
+	char *name;
+	size_t len;
+	int error = 0;
+
+	if (stat(path, &st) < 0) {
+		printf("%s not found ----> ERROR \n", path);
+		return 1;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		len = strlen(path);
+		// Named on the command line it is checked whatever it is called
+		if (top || (len > 4 && !strcasecmp(path + len - 4, ".xbe")))
+			return verify_add(v, path);
+		return 0;
+	}
+
+	d = opendir(path);
+	if (d == NULL) return 1;
+	while (!error && (de = readdir(d)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+		name = malloc(strlen(path) + strlen(de->d_name) + 2);
+		if (name == NULL) {
+			error = 1;
+			break;
 		}
-	      	printf("\n");
-	      	#endif
-
-
-
-
-	      	
-		// Write back the Image to Disk
-		f = fopen(xbeimage, "wb");
-    		if (f!=NULL) 
-    		{   
-		 fwrite(xbe, 1, xbesize, f);
-        	 fclose(f);			
-		}	  	
-	        
-	        printf("\nXbeboot.xbe Created    : %s\n",xbeimage);
-	      	
-		#ifdef LOADXBE
-		free(initrd);         
-		#endif
-        	
-        	#ifdef LOADHDD_CFGFALLBACK
-        	free(config);   
-        	#endif
-           	
-           	#ifdef LOADXBE	
-                free(vmlinuz);  
-           	#endif
-                free(xbe);
-              
-	} else return 1;
-
-
-        
-	return 0;	
+		sprintf(name, "%s/%s", path, de->d_name);
+		error = verify_collect(v, name, 0);
+		free(name);
+	}
+	closedir(d);
+
+	return error;
 }
 
+static int verify_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct verify_image *)a)->name, ((const struct verify_image *)b)->name);
+}
 
-int xbeextract (	unsigned char * xbeimage ) 
+/*
+ * Checks images on ib->threads threads and lists them in name order.
+ * Returns 0 if all of them are fine.
+ */
+int xbeverify (	struct imagebld *ib,
+		const char ** paths,
+		int npaths
+		)
 {
-	FILE *f;
-
-        unsigned char *xbe;
-        unsigned int xbesize = 0;
-    	
-    	unsigned char *vmlinuz;
-    	unsigned int vmlinux_size = 0;
-        unsigned int vmlinux_start=0;
-        
-        unsigned char *initrd;         
-        unsigned int initrd_size = 0;
-	unsigned int initrd_start = 0;
-
-        unsigned char *config;         
-        unsigned int config_size = 0;
-	unsigned int config_start = 0;
-
-
-
-	f = fopen(xbeimage, "rb");
-    	if (f!=NULL) 
-    	{   
-  		fseek(f, 0, SEEK_END); 
-         	xbesize	 = ftell(f); 
-         	fseek(f, 0, SEEK_SET);
-           	xbe = malloc(xbesize);
-    		fread(xbe, 1, xbesize, f);
-    		fclose(f);
-
-		memcpy(&initrd_start, &xbe[ValueDumps + 0x8C],4);
-		memcpy(&initrd_size,  &xbe[ValueDumps + 0x90],4);
-	    memcpy(&vmlinux_start,&xbe[ValueDumps + 0x80],4);
-		memcpy(&vmlinux_size, &xbe[ValueDumps + 0x84],4);
-		memcpy(&config_start, &xbe[ValueDumps + 0x94],4);
-		memcpy(&config_size,  &xbe[ValueDumps + 0x98],4);         		
-
-	 	printf("Linked Sections\n");
-	 	printf("Start of Linux Kernel    : 0x%08X\n", vmlinux_start);
-	 	printf("Size of Linux Kernel     : 0x%08X\n", vmlinux_size);
-		printf("Start of InitRD          : 0x%08X\n", initrd_start);
-	 	printf("Size of Initrd           : 0x%08X\n", initrd_size);
-		printf("Start of Config          : 0x%08X\n", config_start);
-	 	printf("Size of config           : 0x%08X\n", config_size);
-		printf("----------------\n");
-
-
-		printf("Extracting Kernel");
-		f = fopen("kernel", "wb");
-    		if (f!=NULL) 
-    		{   
-		 fwrite(&xbe[vmlinux_start], 1, vmlinux_size, f);
-        	 fclose(f);			
-		}	  
-		printf(" .. Done \n");
-
-
-		printf("Extracting Ramdisk");
-		f = fopen("ramdisk", "wb");
-    		if (f!=NULL) 
-    		{   
-		 fwrite(&xbe[initrd_start], 1, initrd_size, f);
-        	 fclose(f);			
-		}	  
-		printf(" .. Done \n");
-
-		printf("Extracting Config");
-		f = fopen("config.cfg", "wb");
-    		if (f!=NULL) 
-    		{   
-		 fwrite(&xbe[config_start], 1, config_size, f);
-        	 fclose(f);			
-		}	  
-		printf(" .. Done \n");
-    		
-    		free(xbe);
-    	}        
-	return 0;	
+	struct verify v;
+	pthread_t *workers;
+	unsigned int nworkers = ib->threads;
+	unsigned int i, bad = 0;
+	struct timespec t0, t1;
+	double seconds;
+	int error = 0;
+
+	memset(&v, 0, sizeof(v));
+	pthread_mutex_init(&v.lock, NULL);
+	v.ib = *ib;
+
+	for (i = 0; i < (unsigned int)npaths; i++)
+		error |= verify_collect(&v, paths[i], 1);
+	if (v.count == 0) {
+		printf("No images to verify\n");
+		return 1;
+	}
+	qsort(v.images, v.count, sizeof(struct verify_image), verify_cmp);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	if (nworkers > v.count) nworkers = v.count;
+	// What the images leave over goes into their chunks
+	v.ib.threads = nworkers ? ib->threads / nworkers : 1;
+	workers = calloc(nworkers, sizeof(pthread_t));
+	if (workers == NULL) return 1;
+	for (i = 0; i < nworkers; i++)
+		if (pthread_create(&workers[i], NULL, verify_worker, &v)) break;
+	if (i == 0) verify_worker(&v);
+	nworkers = i;
+	for (i = 0; i < nworkers; i++) pthread_join(workers[i], NULL);
+	free(workers);
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	for (i = 0; i < v.count; i++) {
+		if (v.images[i].status != NULL) bad++;
+		printf("%-4s %s%s%s", v.images[i].status ? "BAD" : "OK", v.images[i].name,
+			v.images[i].status ? ": " : "", v.images[i].status ? v.images[i].status : "");
+		if (v.images[i].bad_offset) printf(" at 0x%08X", v.images[i].bad_offset);
+		printf("\n");
+		free(v.images[i].name);
+	}
+	printf("----------------\n");
+	printf("%u images, %u bad, %.1f MB hashed in %.2f s, %.1f MB/s\n", v.count, bad,
+		v.hashed / 1048576.0, seconds, seconds > 0 ? v.hashed / 1048576.0 / seconds : 0);
+
+	free(v.images);
+	return error || bad;
+}
+
+
+/* Options, and which command takes which */
+#define OPT_LZ4		0x01
+#define OPT_PAGE	0x02
+#define OPT_SECTIONS	0x04
+#define OPT_J		0x08
+#define OPT_O		0x10
+#define OPT_CACHE	0x20
+#define OPT_STORE	0x40
+
+struct command {
+	const char *name;
+	unsigned int options;
+	const char *usage;
+};
+
+static const struct command commands[] = {
+	{ "-build", OPT_LZ4 | OPT_PAGE | OPT_SECTIONS | OPT_J | OPT_O | OPT_CACHE | OPT_STORE,
+	  "[-lz4] [-page] [-sections] [-j N] [-o out [-cache file]] [-store dir] xbe vmlinuz initrd config" },
+	{ "-batch", OPT_LZ4 | OPT_PAGE | OPT_J, "[-lz4] [-page] [-j N] loader.xbe vmlinuz manifest" },
+	{ "-replace", OPT_J, "[-j N] xbe kernel|initrd|config file" },
+	{ "-verify", OPT_J, "[-j N] xbe|directory ..." },
+	{ "-iso", OPT_J, "[-j N] out.iso|- file ..." },
+	{ "-extract", 0, "xbe [kernel|initrd|config file|- ...]" },
+};
+
+#define COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+/* Prints how to call command, or every command if it is NULL */
+static int usage(const struct command *command)
+{
+	unsigned int i;
+
+	for (i = 0; i < COMMANDS; i++)
+		if (command == NULL || command == &commands[i])
+			fprintf(stderr, "usage: imagebld %s %s\n", commands[i].name, commands[i].usage);
+	return 1;
 }
 
 int main (int argc, const char * argv[])
 {
+	struct imagebld ib;
+	const struct command *command = NULL;
+	const struct payload_kind *kind;
+	unsigned int option, i;
 	int error=0;
-	
+	int a;
+
+	for (i = 0; argc >= 2 && i < COMMANDS; i++)
+		if (strcmp(argv[1], commands[i].name) == 0) command = &commands[i];
+	if (command == NULL) return usage(NULL);
+
+	imagebld_init(&ib);
+	ib.io.arg = stdout;
+	ib.io.log = log_file;
+	ib.threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	// Options come first, -j N is the number of worker threads
+	for (a = 2; a < argc && argv[a][0] == '-' && argv[a][1]; a++) {
+		if (strcmp(argv[a],"-lz4")==0) option = OPT_LZ4;
+		else if (strcmp(argv[a],"-page")==0) option = OPT_PAGE;
+		else if (strcmp(argv[a],"-sections")==0) option = OPT_SECTIONS;
+		else if (strcmp(argv[a],"-j")==0) option = OPT_J;
+		else if (strcmp(argv[a],"-o")==0) option = OPT_O;
+		else if (strcmp(argv[a],"-cache")==0) option = OPT_CACHE;
+		else if (strcmp(argv[a],"-store")==0) option = OPT_STORE;
+		else option = 0;
+
+		if (!(command->options & option)) {
+			fprintf(stderr, "%s does not take %s\n", command->name, argv[a]);
+			return usage(command);
+		}
+		if ((option & (OPT_J | OPT_O | OPT_CACHE | OPT_STORE)) && a + 1 >= argc) {
+			fprintf(stderr, "%s needs an argument\n", argv[a]);
+			return usage(command);
+		}
+
+		if (option == OPT_LZ4) ib.compress = 1;
+		if (option == OPT_PAGE) ib.page_align = 1;
+		if (option == OPT_SECTIONS) ib.sections = 1;
+		if (option == OPT_J) ib.threads = atoi(argv[++a]);
+		if (option == OPT_O) ib.output = argv[++a];
+		if (option == OPT_CACHE) ib.cache = argv[++a];
+		if (option == OPT_STORE) ib.store = argv[++a];
+	}
+	if ((int)ib.threads < 1) ib.threads = 1;
+	if (ib.cache != NULL && ib.output == NULL) {
+		fprintf(stderr, "-cache only goes with -o\n");
+		return usage(command);
+	}
+
+	// -build [-lz4] [-page] [-sections] [-j N] [-o out [-cache file]] [-store dir] xbe vmlinuz initrd config,
+	// any payload may be "-" or a pipe.  With -o the image goes to out and
+	// xbe is left alone, else xbe is patched in place.  -sections puts every
+	// payload into an XBE section of its own.  -store takes the payloads
+	// from a store shared by many images, -sections and -page make that
+	// cheapest.
 	if (strcmp(argv[1],"-build")==0) {
-	error = xbebuild((unsigned char*)argv[2],(unsigned char*)argv[3],(unsigned char*)argv[4],(unsigned char*)argv[5]);
+		if (argc - a < 4) return usage(command);
+		error = imagebld_build(&ib,argv[a],argv[a+1],argv[a+2],argv[a+3],NULL);
+	}
+
+	// -batch [-lz4] [-page] [-j N] loader.xbe vmlinuz manifest
+	if (strcmp(argv[1],"-batch")==0) {
+		if (argc - a < 3) return usage(command);
+		error = imagebld_batch(&ib,argv[a],argv[a+1],argv[a+2]);
+	}
+
+	// -replace [-j N] xbe kernel|initrd|config file, the image keeps its
+	// own layout and compression
+	if (strcmp(argv[1],"-replace")==0) {
+		if (argc - a < 3) return usage(command);
+		kind = payload_kind(argv[a+1]);
+		if (kind == NULL) {
+			printf("Unknown payload %s, expected kernel, initrd or config\n", argv[a+1]);
+			return 1;
+		}
+		error = imagebld_replace(&ib,argv[a],kind->type,argv[a+2],NULL);
+		if (!error) printf("%s replaced in %s\n", kind->kind, argv[a]);
+	}
+
+	// -verify [-j N] xbe|directory ...
+	if (strcmp(argv[1],"-verify")==0) {
+		if (argc - a < 1) return usage(command);
+		error = xbeverify(&ib,&argv[a],argc - a);
+	}
+
+	// -iso [-j N] out.iso|- file ..., the files go on in the order the loader reads them
+	if (strcmp(argv[1],"-iso")==0) {
+		if (argc - a < 2) return usage(command);
+		// With the image on stdout the file list goes to stderr
+		if (!strcmp(argv[a],"-")) ib.io.arg = stderr;
+		error = imagebld_iso(&ib,argv[a],&argv[a+1],argc - a - 1);
 	}
 
+	// -extract xbe [kernel|initrd|config file|- ...]
 	if (strcmp(argv[1],"-extract")==0) {
-	error = xbeextract((unsigned char*)argv[2]);
+		if (argc - a < 1) return usage(command);
+		error = xbeextract(&ib,argv[a],&argv[a+1],argc - a - 1);
 	}
 
-	return error;	
+	return error;
 }
@@ -0,0 +1,608 @@
+/*
+ *  iso.c
+ *
+ *  Description:
+ *      Writes the disc image linux.iso was made with mkisofs -udf for,
+ *      without the external tool.  Both file systems are laid out from
+ *      the file sizes before anything is written, so the image comes out
+ *      in a single pass from the first sector to the last and the file
+ *      data goes from the inputs straight to the image.
+ *
+ *      Sectors:
+ *          16          ISO 9660 primary volume descriptor
+ *          17          ISO 9660 descriptor set terminator
+ *          18-20       UDF volume recognition sequence
+ *          21-23       ISO 9660 path tables and root directory
+ *          32-47       UDF main volume descriptor sequence
+ *          48-63       UDF reserve volume descriptor sequence
+ *          64-65       UDF logical volume integrity sequence
+ *          256         UDF anchor
+ *          257-        UDF partition: file set descriptor, root
+ *                      directory, file entries, then the file data
+ *          last        UDF anchor
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "iso.h"
+
+#define ISO_PVD			16
+#define ISO_TERMINATOR		17
+#define UDF_VRS			18	/* BEA01, NSR02, TEA01 */
+#define ISO_PATH_L		21
+#define ISO_PATH_M		22
+#define ISO_ROOT		23
+#define UDF_MAIN_VDS		32
+#define UDF_RESERVE_VDS		48
+#define UDF_VDS_LENGTH		16
+#define UDF_LVID		64
+#define UDF_ANCHOR		256
+#define UDF_PARTITION		257
+
+/* Blocks in the partition */
+#define UDF_FSD			0
+#define UDF_FSD_TERMINATOR	1
+#define UDF_ROOT_FE		2
+#define UDF_ROOT_DIR		3
+#define UDF_FILE_FE		4	/* one per file, the data follows */
+
+/* Descriptor tags */
+#define TAG_PVD			1
+#define TAG_ANCHOR		2
+#define TAG_IUVD		4
+#define TAG_PD			5
+#define TAG_LVD			6
+#define TAG_USD			7
+#define TAG_TERMINATOR		8
+#define TAG_LVID		9
+#define TAG_FSD			256
+#define TAG_FID			257
+#define TAG_FE			261
+
+#define UDF_REVISION		0x0102
+/* Longest extent a short_ad can describe, in whole sectors */
+#define UDF_MAX_EXTENT		0x3ffff800
+
+/* Unique ids 1 to 15 are reserved, the root directory is 0 */
+#define UDF_FIRST_ID		16
+
+#define SECTORS(x)		(((x) + ISO_SECTOR - 1) / ISO_SECTOR)
+
+static void le16(unsigned char *p, unsigned int v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void le32(unsigned char *p, unsigned int v)
+{
+	le16(p, v);
+	le16(p + 2, v >> 16);
+}
+
+static void le64(unsigned char *p, unsigned long long v)
+{
+	le32(p, v);
+	le32(p + 4, v >> 32);
+}
+
+static void be16(unsigned char *p, unsigned int v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void be32(unsigned char *p, unsigned int v)
+{
+	be16(p, v >> 16);
+	be16(p + 2, v);
+}
+
+/* ISO 9660 both-byte-order fields */
+static void both16(unsigned char *p, unsigned int v)
+{
+	le16(p, v);
+	be16(p + 2, v);
+}
+
+static void both32(unsigned char *p, unsigned int v)
+{
+	le32(p, v);
+	be32(p + 4, v);
+}
+
+/* CRC-CCITT, polynomial 0x1021, as the UDF descriptor tags use */
+static unsigned int crc_ccitt(const unsigned char *p, unsigned int len)
+{
+	unsigned int crc = 0;
+	int i;
+
+	while (len--) {
+		crc ^= *p++ << 8;
+		for (i = 0; i < 8; i++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc & 0xffff;
+}
+
+/* Fills in the tag of a UDF descriptor of len bytes, once the rest is done */
+static void udf_tag(unsigned char *p, unsigned int id, unsigned int location, unsigned int len)
+{
+	unsigned int sum = 0;
+	int i;
+
+	le16(p, id);
+	le16(p + 2, 2);			// descriptor version, NSR02
+	le16(p + 6, 1);			// serial number
+	le16(p + 8, crc_ccitt(p + 16, len - 16));
+	le16(p + 10, len - 16);
+	le32(p + 12, location);
+	for (i = 0; i < 16; i++)
+		if (i != 4) sum += p[i];
+	p[4] = sum;
+}
+
+/* d-string of len bytes, 8 bit compressed unicode */
+static void udf_dstring(unsigned char *p, unsigned int len, const char *s)
+{
+	unsigned int n = strlen(s);
+
+	if (n > len - 2) n = len - 2;
+	memset(p, 0, len);
+	if (n == 0) return;
+	p[0] = 8;
+	memcpy(p + 1, s, n);
+	p[len - 1] = n + 1;
+}
+
+static void udf_charspec(unsigned char *p)
+{
+	p[0] = 0;			// CS0
+	strcpy((char *)p + 1, "OSTA Compressed Unicode");
+}
+
+static void udf_regid(unsigned char *p, const char *id, int udf_suffix)
+{
+	p[0] = 0;
+	memcpy(p + 1, id, strlen(id));
+	if (udf_suffix) le16(p + 24, UDF_REVISION);
+}
+
+static void udf_time(unsigned char *p, time_t t)
+{
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+	le16(p, 1 << 12);		// local time, UTC
+	le16(p + 2, tm.tm_year + 1900);
+	p[4] = tm.tm_mon + 1;
+	p[5] = tm.tm_mday;
+	p[6] = tm.tm_hour;
+	p[7] = tm.tm_min;
+	p[8] = tm.tm_sec;
+}
+
+/* long_ad of a block in the partition */
+static void udf_long_ad(unsigned char *p, unsigned int len, unsigned int block)
+{
+	le32(p, len);
+	le32(p + 4, block);
+	le16(p + 8, 0);
+}
+
+static void iso_time7(unsigned char *p, time_t t)
+{
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+	p[0] = tm.tm_year;
+	p[1] = tm.tm_mon + 1;
+	p[2] = tm.tm_mday;
+	p[3] = tm.tm_hour;
+	p[4] = tm.tm_min;
+	p[5] = tm.tm_sec;
+	p[6] = 0;
+}
+
+static void iso_time17(unsigned char *p, time_t t)
+{
+	struct tm tm;
+	char s[64];
+
+	if (t == 0) {
+		memset(p, '0', 16);
+		p[16] = 0;
+		return;
+	}
+	gmtime_r(&t, &tm);
+	snprintf(s, sizeof(s), "%04d%02d%02d%02d%02d%02d00", tm.tm_year + 1900, tm.tm_mon + 1,
+		 tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+	memcpy(p, s, 16);
+	p[16] = 0;
+}
+
+/* Space padded a-characters */
+static void iso_string(unsigned char *p, unsigned int len, const char *s)
+{
+	unsigned int n = strlen(s);
+
+	memset(p, ' ', len);
+	memcpy(p, s, n < len ? n : len);
+}
+
+/* ISO 9660 name of a file: upper case, one dot, ";1" */
+static unsigned int iso_name(char *id, const char *name)
+{
+	const char *dot = strrchr(name, '.');
+	unsigned int n = 0;
+	char c;
+
+	for (; *name; name++) {
+		c = *name;
+		if (c >= 'a' && c <= 'z') c -= 'a' - 'A';
+		if (name != dot && !((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_'))
+			c = '_';
+		id[n++] = c;
+	}
+	if (dot == NULL) id[n++] = '.';
+	id[n++] = ';';
+	id[n++] = '1';
+	id[n] = 0;
+	return n;
+}
+
+static unsigned int iso_record(unsigned char *p, unsigned int sector, unsigned int size,
+			       time_t t, int dir, const char *id, unsigned int idlen)
+{
+	unsigned int len = (33 + idlen + 1) & ~1U;
+
+	memset(p, 0, len);
+	p[0] = len;
+	both32(p + 2, sector);
+	both32(p + 10, size);
+	iso_time7(p + 18, t);
+	p[25] = dir ? 2 : 0;
+	both16(p + 28, 1);
+	p[32] = idlen;
+	memcpy(p + 33, id, idlen);
+	return len;
+}
+
+struct iso_sort {
+	char id[ISO_MAX_NAME + 4];
+	unsigned int len;
+	struct iso_file *file;
+};
+
+static int iso_sort_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct iso_sort *)a)->id, ((const struct iso_sort *)b)->id);
+}
+
+static void iso_volume(unsigned char *image, struct iso_file *files, unsigned int count,
+		       const char *volume, unsigned int sectors, time_t t)
+{
+	unsigned char *p = image + ISO_PVD * ISO_SECTOR;
+	struct iso_sort sorted[ISO_MAX_FILES];
+	unsigned int i, ofs;
+	char vol[33];
+
+	// Volume identifiers are d-characters, the same mapping as names
+	iso_name(vol, volume);
+	vol[strcspn(vol, ".;")] = 0;
+
+	p[0] = 1;
+	memcpy(p + 1, "CD001", 5);
+	p[6] = 1;
+	iso_string(p + 8, 32, "");
+	iso_string(p + 40, 32, vol);
+	both32(p + 80, sectors);
+	both16(p + 120, 1);
+	both16(p + 124, 1);
+	both16(p + 128, ISO_SECTOR);
+	both32(p + 132, 10);
+	le32(p + 140, ISO_PATH_L);
+	be32(p + 148, ISO_PATH_M);
+	iso_record(p + 156, ISO_ROOT, ISO_SECTOR, t, 1, "", 1);
+	iso_string(p + 190, 128, "");
+	iso_string(p + 318, 128, "");
+	iso_string(p + 446, 128, "");
+	iso_string(p + 574, 128, "IMAGEBLD");
+	iso_string(p + 702, 37 * 3, "");
+	iso_time17(p + 813, t);
+	iso_time17(p + 830, t);
+	iso_time17(p + 847, 0);
+	iso_time17(p + 864, t);
+	p[881] = 1;
+
+	p = image + ISO_TERMINATOR * ISO_SECTOR;
+	p[0] = 255;
+	memcpy(p + 1, "CD001", 5);
+	p[6] = 1;
+
+	// Path tables, just the root
+	p = image + ISO_PATH_L * ISO_SECTOR;
+	p[0] = 1;
+	le32(p + 2, ISO_ROOT);
+	le16(p + 6, 1);
+	p = image + ISO_PATH_M * ISO_SECTOR;
+	p[0] = 1;
+	be32(p + 2, ISO_ROOT);
+	be16(p + 6, 1);
+
+	// The root directory, records sorted by name as ISO 9660 wants them
+	for (i = 0; i < count; i++) {
+		sorted[i].len = iso_name(sorted[i].id, files[i].name);
+		sorted[i].file = &files[i];
+	}
+	qsort(sorted, count, sizeof(sorted[0]), iso_sort_cmp);
+
+	p = image + ISO_ROOT * ISO_SECTOR;
+	ofs = iso_record(p, ISO_ROOT, ISO_SECTOR, t, 1, "\0", 1);
+	ofs += iso_record(p + ofs, ISO_ROOT, ISO_SECTOR, t, 1, "\1", 1);
+	for (i = 0; i < count; i++) {
+		ofs += iso_record(p + ofs, sorted[i].file->size ? sorted[i].file->sector : 0,
+				  sorted[i].file->size, sorted[i].file->mtime, 0,
+				  sorted[i].id, sorted[i].len);
+	}
+}
+
+/* The main and reserve volume descriptor sequences are the same but for the tags */
+static void udf_vds(unsigned char *image, unsigned int start, const char *volume,
+		    unsigned int partition_size, time_t t)
+{
+	unsigned char *p;
+	unsigned int s = start;
+
+	p = image + s * ISO_SECTOR;
+	le32(p + 16, 0);		// sequence number
+	udf_dstring(p + 24, 32, volume);
+	le16(p + 56, 1);
+	le16(p + 58, 1);
+	le16(p + 60, 2);
+	le16(p + 62, 2);
+	le32(p + 64, 1);
+	le32(p + 68, 1);
+	udf_dstring(p + 72, 128, volume);
+	udf_charspec(p + 200);
+	udf_charspec(p + 264);
+	udf_time(p + 376, t);
+	udf_regid(p + 388, "*imagebld", 0);
+	udf_tag(p, TAG_PVD, s++, 512);
+
+	p = image + s * ISO_SECTOR;
+	le32(p + 16, 1);
+	udf_regid(p + 20, "*UDF LV Info", 1);
+	udf_charspec(p + 52);
+	udf_dstring(p + 116, 128, volume);
+	udf_regid(p + 352, "*imagebld", 0);
+	udf_tag(p, TAG_IUVD, s++, 512);
+
+	p = image + s * ISO_SECTOR;
+	le32(p + 16, 2);
+	le16(p + 20, 1);		// allocated
+	le16(p + 22, 0);		// partition number
+	udf_regid(p + 24, "+NSR02", 0);
+	le32(p + 184, 1);		// read only
+	le32(p + 188, UDF_PARTITION);
+	le32(p + 192, partition_size);
+	udf_regid(p + 196, "*imagebld", 0);
+	udf_tag(p, TAG_PD, s++, 512);
+
+	p = image + s * ISO_SECTOR;
+	le32(p + 16, 3);
+	udf_charspec(p + 20);
+	udf_dstring(p + 84, 128, volume);
+	le32(p + 212, ISO_SECTOR);
+	udf_regid(p + 216, "*OSTA UDF Compliant", 1);
+	udf_long_ad(p + 248, ISO_SECTOR, UDF_FSD);
+	le32(p + 264, 6);		// one type 1 partition map
+	le32(p + 268, 1);
+	udf_regid(p + 272, "*imagebld", 0);
+	le32(p + 432, 2 * ISO_SECTOR);
+	le32(p + 436, UDF_LVID);
+	p[440] = 1;
+	p[441] = 6;
+	le16(p + 442, 1);
+	le16(p + 444, 0);
+	udf_tag(p, TAG_LVD, s++, 446);
+
+	p = image + s * ISO_SECTOR;
+	le32(p + 16, 4);
+	udf_tag(p, TAG_USD, s++, 24);
+
+	p = image + s * ISO_SECTOR;
+	udf_tag(p, TAG_TERMINATOR, s, 512);
+}
+
+static void udf_anchor(unsigned char *p, unsigned int sector)
+{
+	memset(p, 0, ISO_SECTOR);
+	le32(p + 16, UDF_VDS_LENGTH * ISO_SECTOR);
+	le32(p + 20, UDF_MAIN_VDS);
+	le32(p + 24, UDF_VDS_LENGTH * ISO_SECTOR);
+	le32(p + 28, UDF_RESERVE_VDS);
+	udf_tag(p, TAG_ANCHOR, sector, 512);
+}
+
+/* A file entry, its data as short_ads of at most UDF_MAX_EXTENT bytes */
+static void udf_file_entry(unsigned char *p, unsigned int block, int dir,
+			   unsigned long long unique, unsigned int size,
+			   unsigned int data, time_t t)
+{
+	unsigned int ads = 0, n, left = size;
+
+	le16(p + 16 + 4, 4);		// strategy 4
+	le16(p + 16 + 8, 1);
+	p[16 + 11] = dir ? 4 : 5;
+	le16(p + 16 + 18, 0);		// short_ad
+	le32(p + 36, 0xffffffff);	// uid and gid not set
+	le32(p + 40, 0xffffffff);
+	// read and execute for owner, group and others
+	le32(p + 44, 0x2529);
+	le16(p + 48, 1);
+	le64(p + 56, size);
+	le64(p + 64, SECTORS(size));
+	udf_time(p + 72, t);
+	udf_time(p + 84, t);
+	udf_time(p + 96, t);
+	le32(p + 108, 1);
+	udf_regid(p + 128, "*imagebld", 0);
+	le64(p + 160, unique);
+	while (left) {
+		n = left < UDF_MAX_EXTENT ? left : UDF_MAX_EXTENT;
+		le32(p + 176 + ads * 8, n);
+		le32(p + 176 + ads * 8 + 4, data);
+		data += SECTORS(n);
+		left -= n;
+		ads++;
+	}
+	le32(p + 172, ads * 8);
+	udf_tag(p, TAG_FE, block, 176 + ads * 8);
+}
+
+static unsigned int udf_fid(unsigned char *p, unsigned int block, int characteristics,
+			    unsigned int icb, const char *name)
+{
+	unsigned int namelen = *name ? strlen(name) + 1 : 0;
+	unsigned int len = (38 + namelen + 3) & ~3U;
+
+	le16(p + 16, 1);
+	p[18] = characteristics;
+	p[19] = namelen;
+	udf_long_ad(p + 20, ISO_SECTOR, icb);
+	if (namelen) {
+		p[38] = 8;
+		memcpy(p + 39, name, namelen - 1);
+	}
+	udf_tag(p, TAG_FID, block, len);
+	return len;
+}
+
+static void udf_files(unsigned char *image, struct iso_file *files, unsigned int count,
+		      const char *volume, unsigned int partition_size, time_t t)
+{
+	unsigned char *part = image + UDF_PARTITION * ISO_SECTOR;
+	unsigned char *p;
+	unsigned int i, dirsize;
+
+	p = image + UDF_LVID * ISO_SECTOR;
+	udf_time(p + 16, t);
+	le32(p + 28, 1);		// closed
+	le64(p + 40, UDF_FIRST_ID + count);
+	le32(p + 72, 1);
+	le32(p + 76, 46);
+	le32(p + 80, 0);		// free space
+	le32(p + 84, partition_size);
+	udf_regid(p + 88, "*imagebld", 0);
+	le32(p + 120, count);
+	le32(p + 124, 1);
+	le16(p + 128, UDF_REVISION);
+	le16(p + 130, UDF_REVISION);
+	le16(p + 132, UDF_REVISION);
+	udf_tag(p, TAG_LVID, UDF_LVID, 134);
+	udf_tag(p + ISO_SECTOR, TAG_TERMINATOR, UDF_LVID + 1, 512);
+
+	p = part + UDF_FSD * ISO_SECTOR;
+	udf_time(p + 16, t);
+	le16(p + 28, 3);
+	le16(p + 30, 3);
+	le32(p + 32, 1);
+	le32(p + 36, 1);
+	udf_charspec(p + 48);
+	udf_dstring(p + 112, 128, volume);
+	udf_charspec(p + 240);
+	udf_dstring(p + 304, 32, volume);
+	udf_long_ad(p + 400, ISO_SECTOR, UDF_ROOT_FE);
+	udf_regid(p + 416, "*OSTA UDF Compliant", 1);
+	udf_tag(p, TAG_FSD, UDF_FSD, 512);
+	udf_tag(part + UDF_FSD_TERMINATOR * ISO_SECTOR, TAG_TERMINATOR, UDF_FSD_TERMINATOR, 512);
+
+	// The root directory, in the order the files are on the disc
+	p = part + UDF_ROOT_DIR * ISO_SECTOR;
+	dirsize = udf_fid(p, UDF_ROOT_DIR, 0x0a, UDF_ROOT_FE, "");
+	for (i = 0; i < count; i++)
+		dirsize += udf_fid(p + dirsize, UDF_ROOT_DIR, 0, UDF_FILE_FE + i, files[i].name);
+	udf_file_entry(part + UDF_ROOT_FE * ISO_SECTOR, UDF_ROOT_FE, 1, 0, dirsize,
+		       UDF_ROOT_DIR, t);
+
+	for (i = 0; i < count; i++) {
+		udf_file_entry(part + (UDF_FILE_FE + i) * ISO_SECTOR, UDF_FILE_FE + i, 0,
+			       UDF_FIRST_ID + i, files[i].size, files[i].sector - UDF_PARTITION,
+			       files[i].mtime);
+	}
+}
+
+static int write_full(int out, const unsigned char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(out, buf, len);
+		if (n <= 0) return 1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int iso_write(int out, struct iso_file *files, unsigned int count, const char *volume,
+	      int (*data)(void *arg, unsigned int file, int out), void *arg)
+{
+	static const unsigned char zero[ISO_SECTOR];
+	unsigned char *image;
+	unsigned int i, sector, head, partition_size, sectors;
+	time_t t = 0;
+	int error = 0;
+
+	if (count > ISO_MAX_FILES) return 1;
+	for (i = 0; i < count; i++)
+		if (strlen(files[i].name) > ISO_MAX_NAME || !*files[i].name) return 1;
+
+	// Lay the files out back to back behind their file entries
+	head = UDF_PARTITION + UDF_FILE_FE + count;
+	sector = head;
+	for (i = 0; i < count; i++) {
+		files[i].sector = sector;
+		if (SECTORS(files[i].size) > 0xffffffffU - sector - 1) return 1;
+		sector += SECTORS(files[i].size);
+		if (files[i].mtime > t) t = files[i].mtime;
+	}
+	partition_size = sector - UDF_PARTITION;
+	sectors = sector + 1;
+
+	image = calloc(head, ISO_SECTOR);
+	if (image == NULL) return 1;
+
+	iso_volume(image, files, count, volume, sectors, t);
+	memcpy(image + UDF_VRS * ISO_SECTOR + 1, "BEA01", 5);
+	memcpy(image + (UDF_VRS + 1) * ISO_SECTOR + 1, "NSR02", 5);
+	memcpy(image + (UDF_VRS + 2) * ISO_SECTOR + 1, "TEA01", 5);
+	for (i = 0; i < 3; i++) image[(UDF_VRS + i) * ISO_SECTOR + 6] = 1;
+	udf_vds(image, UDF_MAIN_VDS, volume, partition_size, t);
+	udf_vds(image, UDF_RESERVE_VDS, volume, partition_size, t);
+	udf_anchor(image + UDF_ANCHOR * ISO_SECTOR, UDF_ANCHOR);
+	udf_files(image, files, count, volume, partition_size, t);
+
+	error = write_full(out, image, head * ISO_SECTOR);
+
+	for (i = 0; !error && i < count; i++) {
+		error = data(arg, i, out);
+		if (!error && files[i].size % ISO_SECTOR)
+			error = write_full(out, zero, ISO_SECTOR - files[i].size % ISO_SECTOR);
+	}
+
+	// The second anchor goes in the last sector
+	if (!error) {
+		udf_anchor(image, sectors - 1);
+		error = write_full(out, image, ISO_SECTOR);
+	}
+
+	free(image);
+	return error;
+}
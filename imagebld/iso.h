@@ -0,0 +1,37 @@
+/*
+ *  iso.h
+ *
+ *  Writes a disc image with an ISO 9660 and a UDF 1.02 file system over
+ *  the same files, the bridge format mkisofs -udf makes.  The files are
+ *  all in the root directory and their data is laid out back to back in
+ *  the order they are given, each on a 2048-byte sector, so the order the
+ *  loader reads them in is the order they are on the disc.
+ */
+
+#ifndef _ISO_H_
+#define _ISO_H_
+
+#include <time.h>
+
+#define ISO_SECTOR		2048
+
+/* Files the root directory sector has room for under both file systems */
+#define ISO_MAX_FILES		24
+#define ISO_MAX_NAME		30
+
+struct iso_file {
+	const char *name;	/* as it is on the disc */
+	unsigned int size;
+	time_t mtime;
+	unsigned int sector;	/* set by iso_write */
+};
+
+/*
+ * Writes the image to out front to back, so out may be a pipe.  The
+ * metadata goes first, then data() is called for every file in turn to
+ * write its size bytes to out; iso_write pads it to the sector.
+ */
+int iso_write(int out, struct iso_file *files, unsigned int count, const char *volume,
+	      int (*data)(void *arg, unsigned int file, int out), void *arg);
+
+#endif /* _ISO_H_ */
@@ -0,0 +1,2596 @@
+/*
+ *  libimagebld.c
+ *
+ *  Description:
+ *      Links the kernel, initrd and config into the XBEBOOT loader and
+ *      fixes up its headers and section hash, and takes such images apart
+ *      again.  The imagebld tool is a command line front end to this, see
+ *      libimagebld.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <time.h>
+
+// #include <linux/hdreg.h>
+#include <string.h>
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include "sha1.h"
+#include "lz4.h"
+#include "cpio.h"
+#include "libimagebld.h"
+#include "cache.h"
+#include "iso.h"
+#include "../BootPayload.h"
+#include "xbe.h"
+#include "chunk.h"
+#include "store.h"
+#include "../config.h"
+
+
+// Payloads are copied and hashed in pieces of this size
+#define STREAM_CHUNK	(1024*1024)
+
+#define PAD_PAGE(x)	(((x) + 0xfff) & ~0xfff)
+
+// Entries of images from before the chunk digests end here
+#define ENTRY_MIN_SIZE	offsetof(struct payload_entry, chunk_table)
+
+
+void imagebld_init(struct imagebld *ib)
+{
+	memset(ib, 0, sizeof(*ib));
+	ib->threads = 1;
+}
+
+static unsigned int ib_threads(const struct imagebld *ib)
+{
+	return ib->threads ? ib->threads : 1;
+}
+
+static void imagebld_log(struct imagebld *ib, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (ib->io.log == NULL) return;
+	va_start(ap, fmt);
+	ib->io.log(ib->io.arg, fmt, ap);
+	va_end(ap);
+}
+
+static int imagebld_open(struct imagebld *ib, const char *name, int flags, int mode)
+{
+	if (ib->io.open != NULL) return ib->io.open(ib->io.arg, name, flags, mode);
+	return open(name, flags, mode);
+}
+
+/*
+ * A payload file, mapped read-only for the duration of a build.  A
+ * directory is packed into a cpio archive in memory, with no fd.  A pipe
+ * ("-" is stdin) is either read into memory the same way or, if stream
+ * is set, left to be copied into the image as it comes; its size is only
+ * known afterwards then.
+ */
+struct payload_file {
+	int fd;
+	unsigned char *data;
+	unsigned int size;
+	int stream;
+	struct stat st;
+};
+
+/* A payload embedded in the image, with its directory entry */
+struct payload {
+	const char *name;
+	const char *what;
+	int compress;
+	struct payload_file file;
+	struct payload_entry entry;
+	SHA1Context digest;	/* of the stored bytes, goes into the entry */
+	int stored;		/* linked in from the store, with its digests */
+	unsigned char *chunks;	/* chunk digests from the store */
+	unsigned char section_digest[SHA1HashSize];	/* as a section, from the store */
+};
+
+/* Reads a pipe into an anonymous mapping that grows as it fills */
+static int payload_spool(struct payload_file *p)
+{
+	unsigned int room = STREAM_CHUNK;
+	unsigned char *data;
+	ssize_t n;
+
+	p->data = mmap(NULL, room, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p->data == MAP_FAILED) {
+		p->data = NULL;
+		return 1;
+	}
+
+	while ((n = read(p->fd, p->data + p->size, room - p->size)) > 0) {
+		p->size += n;
+		if (p->size < room) continue;
+		// Far more than an Xbox holds, and room * 2 stays a valid size
+		if (room > 0x7fffffff / 2) goto fail;
+		data = mremap(p->data, room, room * 2, MREMAP_MAYMOVE);
+		if (data == MAP_FAILED) goto fail;
+		p->data = data;
+		room *= 2;
+	}
+	if (n < 0) goto fail;
+
+	// Keep just what is used, payload_close unmaps size bytes
+	if (p->size == 0) {
+		munmap(p->data, room);
+		p->data = NULL;
+	} else if (PAD_PAGE(p->size) < room) {
+		munmap(p->data + PAD_PAGE(p->size), room - PAD_PAGE(p->size));
+	}
+	if (p->fd != STDIN_FILENO) close(p->fd);
+	p->fd = -1;
+
+	return 0;
+
+fail:
+	// payload_close would only unmap size bytes of it
+	munmap(p->data, room);
+	p->data = NULL;
+	p->size = 0;
+	return 1;
+}
+
+/*
+ * Opens a payload.  With can_stream set a pipe is left open to be copied
+ * into the image with payload_link(), else it is read into memory.
+ * stdin_taken is the caller's, one per operation, and set once "-" is used.
+ */
+static int payload_open(struct imagebld *ib, struct payload_file *p, const char *name,
+			int can_stream, int *stdin_taken)
+{
+	struct stat *st = &p->st;
+
+	p->data = NULL;
+	p->size = 0;
+	p->stream = 0;
+
+	if (strcmp(name, "-") == 0) {
+		// There is only one stdin to go round
+		if ((*stdin_taken)++) {
+			imagebld_log(ib, "stdin used twice\n");
+			return 1;
+		}
+		p->fd = STDIN_FILENO;
+	} else {
+		p->fd = imagebld_open(ib, name, O_RDONLY, 0);
+	}
+	if (p->fd < 0) return 1;
+
+	if (fstat(p->fd, st) < 0) {
+		close(p->fd);
+		p->fd = -1;
+		return 1;
+	}
+	if (S_ISDIR(st->st_mode)) {
+		close(p->fd);
+		p->fd = -1;
+		return cpio_build(name, &p->data, &p->size, ib_threads(ib));
+	}
+	if (!S_ISREG(st->st_mode)) {
+		if (!can_stream) return payload_spool(p);
+		p->stream = 1;
+		return 0;
+	}
+	p->size = st->st_size;
+	if (p->size == 0) return 0;
+
+	p->data = mmap(NULL, p->size, PROT_READ, MAP_SHARED, p->fd, 0);
+	if (p->data == MAP_FAILED) {
+		p->data = NULL;
+		close(p->fd);
+		p->fd = -1;
+		return 1;
+	}
+	madvise(p->data, p->size, MADV_SEQUENTIAL);
+
+	return 0;
+}
+
+static void payload_close(struct payload_file *p)
+{
+	if (p->data != NULL) munmap(p->data, p->size);
+	if (p->fd > STDIN_FILENO) close(p->fd);
+}
+
+static void hash_zeros(SHA1Context *context, unsigned int len)
+{
+	static const unsigned char zero[0x100];
+	unsigned int n;
+
+	while (context != NULL && len) {
+		n = len < sizeof(zero) ? len : sizeof(zero);
+		SHA1Input(context, zero, n);
+		len -= n;
+	}
+}
+
+/* Bytes a payload takes up in the image, its padding included */
+static unsigned int payload_span(const struct payload_entry *entry)
+{
+	if (entry->flags & PAYLOAD_FLAG_RESIDENT) return entry->load_size;
+	return entry->size;
+}
+
+/*
+ * Writes the 0xff padding behind a resident payload, up to its load_size,
+ * and feeds it to the section hash.  *pos is the end of the payload.
+ */
+static int payload_pad(int out, unsigned int *pos, struct payload *pl, SHA1Context *context)
+{
+	unsigned char ff[0x1000];
+	unsigned int end = pl->entry.offset + payload_span(&pl->entry);
+	unsigned int n;
+
+	if (*pos < end) memset(ff, 0xff, sizeof(ff));
+
+	while (*pos < end) {
+		n = end - *pos < sizeof(ff) ? end - *pos : sizeof(ff);
+		if (pwrite(out, ff, n, *pos) != n) return 1;
+		if (context != NULL) SHA1Input(context, ff, n);
+		*pos += n;
+	}
+	return 0;
+}
+
+/* pwrite()s all of buf, short writes are carried on */
+static int write_all(int fd, const unsigned char *buf, unsigned int len, off_t ofs)
+{
+	ssize_t n;
+
+	while (len) {
+		n = pwrite(fd, buf, len, ofs);
+		if (n <= 0) return 1;
+		buf += n;
+		len -= n;
+		ofs += n;
+	}
+	return 0;
+}
+
+/* Sizes of an entry for size bytes stored uncompressed */
+static void payload_sizes(struct payload *pl, unsigned int size)
+{
+	pl->entry.size = size;
+	pl->entry.raw_size = size;
+	pl->entry.load_size = size;
+
+	// We tell the XBEBOOT loader, that the Paramter he should pass to the Kernel = 2MB for the Size
+	if (pl->entry.type == PAYLOAD_KERNEL)
+		pl->entry.load_size = (size & 0xffff0000) + 0xffff + 0xffff;
+}
+
+/*
+ * Copies a pipe to the payload's offset as it is read; the sizes of the
+ * entry are filled in from what came through.
+ */
+static int payload_stream(int out, struct payload *pl, SHA1Context *context)
+{
+	struct payload_file *p = &pl->file;
+	unsigned int start = pl->entry.offset;
+	unsigned char *buf;
+	ssize_t n;
+	int err = 0;
+
+	buf = malloc(STREAM_CHUNK);
+	if (buf == NULL) return 1;
+
+	p->size = 0;
+	while ((n = read(p->fd, buf, STREAM_CHUNK)) > 0) {
+		if (p->size + (unsigned int)n < p->size ||
+		    write_all(out, buf, n, start + p->size)) {
+			err = 1;
+			break;
+		}
+		if (context != NULL) SHA1Input(context, buf, n);
+		SHA1Input(&pl->digest, buf, n);
+		p->size += n;
+	}
+	if (n < 0) err = 1;
+	free(buf);
+
+	payload_sizes(pl, p->size);
+	return err;
+}
+
+/*
+ * Copies a payload to its place in the output and feeds it to the section
+ * hash and its own digest on the way.  The copy itself is left to the kernel
+ * (copy_file_range), the hashes read the same pages through the mapping
+ * while they are still hot.  *pos is the end of what has been hashed so far;
+ * the gap up to the payload is the zero alignment padding.  With a NULL
+ * context the section hash is left alone.
+ */
+static int payload_link(int out, unsigned int *pos, struct payload *pl, SHA1Context *context)
+{
+	struct payload_file *p = &pl->file;
+	unsigned int start = pl->entry.offset;
+	unsigned int done = 0;
+	unsigned int len;
+	int kernel_copy = p->fd >= 0;
+	loff_t in_ofs, out_ofs;
+	ssize_t n;
+
+	hash_zeros(context, start - *pos);
+
+	if (p->stream) {
+		if (payload_stream(out, pl, context)) return 1;
+		*pos = start + p->size;
+		return payload_pad(out, pos, pl, context);
+	}
+
+	while (done < p->size) {
+		len = p->size - done;
+		if (len > STREAM_CHUNK) len = STREAM_CHUNK;
+
+		n = -1;
+		if (kernel_copy) {
+			in_ofs = done;
+			out_ofs = start + done;
+			n = copy_file_range(p->fd, &in_ofs, out, &out_ofs, len, 0);
+		}
+		if (n <= 0) {
+			// Cross-filesystem or an old kernel, write it from the mapping
+			kernel_copy = 0;
+			n = pwrite(out, p->data + done, len, start + done);
+			if (n <= 0) return 1;
+		}
+
+		if (context != NULL) SHA1Input(context, p->data + done, n);
+		SHA1Input(&pl->digest, p->data + done, n);
+		done += n;
+	}
+	*pos = start + p->size;
+
+	// The loader would fill the rest of the buffer with 0xff, a resident
+	// payload has that done here
+	return payload_pad(out, pos, pl, context);
+}
+
+static int write_hashed(int fd, const unsigned char *buf, unsigned int len, off_t ofs,
+			SHA1Context *digest)
+{
+	SHA1Input(digest, buf, len);
+	return write_all(fd, buf, len, ofs);
+}
+
+/* A block of an LZ4 frame in flight between the workers and the writer */
+struct lz4_slot {
+	int done;
+	unsigned int size;	/* compressed size, 0 = store the block raw */
+	unsigned char *buf;	/* block size prefix + compressed data */
+};
+
+struct lz4_job {
+	struct payload_file *p;
+	unsigned int nblocks;
+	unsigned int next;	/* next block to hand to a worker */
+	unsigned int written;	/* blocks the writer is done with */
+	unsigned int nslots;
+	struct lz4_slot *slots;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void *lz4_worker(void *arg)
+{
+	struct lz4_job *job = arg;
+	struct lz4_slot *slot;
+	unsigned int i, len, n;
+
+	pthread_mutex_lock(&job->lock);
+	while (job->next < job->nblocks) {
+		i = job->next;
+		// Block i reuses the slot of block i - nslots, wait until the
+		// writer has got rid of that one
+		if (i >= job->written + job->nslots) {
+			pthread_cond_wait(&job->cond, &job->lock);
+			continue;
+		}
+		job->next++;
+		slot = &job->slots[i % job->nslots];
+		pthread_mutex_unlock(&job->lock);
+
+		len = job->p->size - i * LZ4_BLOCK_SIZE;
+		if (len > LZ4_BLOCK_SIZE) len = LZ4_BLOCK_SIZE;
+		n = lz4_compress_block(job->p->data + i * LZ4_BLOCK_SIZE, len,
+				       slot->buf + 4, LZ4_COMPRESSBOUND(LZ4_BLOCK_SIZE));
+
+		pthread_mutex_lock(&job->lock);
+		slot->size = (n >= len) ? 0 : n;
+		slot->done = 1;
+		pthread_cond_broadcast(&job->cond);
+	}
+	pthread_mutex_unlock(&job->lock);
+
+	return NULL;
+}
+
+/*
+ * Writes a payload as an LZ4 frame at its offset.  The blocks are independent,
+ * up to threads workers compress them while this thread writes them out in
+ * order, so the frame is the same whatever the number of threads.  Blocks
+ * that do not get smaller are stored uncompressed.  Returns the number of
+ * bytes written, 0 on error.
+ */
+static unsigned int payload_compress(int out, struct payload *pl, unsigned int threads)
+{
+	struct payload_file *p = &pl->file;
+	unsigned int start = pl->entry.offset;
+	unsigned char hdr[LZ4_FRAME_HEADER_SIZE];
+	struct lz4_job job;
+	struct lz4_slot *slot;
+	pthread_t *workers;
+	unsigned int nworkers = threads;
+	unsigned int pos = start;
+	unsigned int i, len;
+	int error = 0;
+
+	job.p = p;
+	job.nblocks = (p->size + LZ4_BLOCK_SIZE - 1) / LZ4_BLOCK_SIZE;
+	job.next = 0;
+	job.written = 0;
+	if (nworkers > job.nblocks) nworkers = job.nblocks;
+	if (nworkers < 1) nworkers = 1;
+	job.nslots = 2 * nworkers;
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.cond, NULL);
+
+	job.slots = calloc(job.nslots, sizeof(struct lz4_slot));
+	workers = calloc(nworkers, sizeof(pthread_t));
+	if (job.slots == NULL || workers == NULL) error = 1;
+	for (i = 0; !error && i < job.nslots; i++) {
+		job.slots[i].buf = malloc(4 + LZ4_COMPRESSBOUND(LZ4_BLOCK_SIZE));
+		if (job.slots[i].buf == NULL) error = 1;
+	}
+
+	len = lz4_frame_header(hdr, p->size);
+	if (!error) error = write_hashed(out, hdr, len, pos, &pl->digest);
+	pos += len;
+
+	for (i = 0; !error && i < nworkers; i++)
+		if (pthread_create(&workers[i], NULL, lz4_worker, &job)) break;
+	nworkers = i;
+	if (nworkers == 0) error = 1;
+
+	for (i = 0; !error && i < job.nblocks; i++) {
+		slot = &job.slots[i % job.nslots];
+
+		pthread_mutex_lock(&job.lock);
+		while (!slot->done) pthread_cond_wait(&job.cond, &job.lock);
+		pthread_mutex_unlock(&job.lock);
+
+		len = p->size - i * LZ4_BLOCK_SIZE;
+		if (len > LZ4_BLOCK_SIZE) len = LZ4_BLOCK_SIZE;
+		if (slot->size == 0) {
+			lz4_write32(slot->buf, len | LZ4_BLOCK_UNCOMPRESSED);
+			error = write_hashed(out, slot->buf, 4, pos, &pl->digest) ||
+				write_hashed(out, p->data + i * LZ4_BLOCK_SIZE, len, pos + 4, &pl->digest);
+			pos += len + 4;
+		} else {
+			lz4_write32(slot->buf, slot->size);
+			error = write_hashed(out, slot->buf, slot->size + 4, pos, &pl->digest);
+			pos += slot->size + 4;
+		}
+
+		pthread_mutex_lock(&job.lock);
+		slot->done = 0;
+		job.written++;
+		pthread_cond_broadcast(&job.cond);
+		pthread_mutex_unlock(&job.lock);
+	}
+
+	// Stop the workers early if writing failed
+	pthread_mutex_lock(&job.lock);
+	job.next = job.nblocks;
+	pthread_cond_broadcast(&job.cond);
+	pthread_mutex_unlock(&job.lock);
+	for (i = 0; i < nworkers; i++) pthread_join(workers[i], NULL);
+
+	// End mark
+	lz4_write32(hdr, 0);
+	if (!error) error = write_hashed(out, hdr, 4, pos, &pl->digest);
+	pos += 4;
+
+	for (i = 0; job.slots != NULL && i < job.nslots; i++) free(job.slots[i].buf);
+	free(job.slots);
+	free(workers);
+	pthread_mutex_destroy(&job.lock);
+	pthread_cond_destroy(&job.cond);
+
+	return error ? 0 : pos - start;
+}
+
+/* Feeds len bytes at ofs of the file to context, read through a mapping */
+static int hash_range(int fd, SHA1Context *context, unsigned int ofs, unsigned int len)
+{
+	unsigned int skip = ofs & 0xfff;
+	unsigned char *map;
+
+	if (len == 0) return 0;
+	map = mmap(NULL, skip + len, PROT_READ, MAP_SHARED, fd, ofs - skip);
+	if (map == MAP_FAILED) return 1;
+	madvise(map, skip + len, MADV_SEQUENTIAL);
+	SHA1Input(context, map + skip, len);
+	munmap(map, skip + len);
+
+	return 0;
+}
+
+/*
+ * Checks the payload directory of an image of xbesize bytes and copies its
+ * header to dir.  Returns 0 if there is one and its table is in the image.
+ */
+static int payload_dir_read(const unsigned char *xbe, unsigned int xbesize, struct payload_dir *dir)
+{
+	if (xbesize < PAYLOAD_DIR_OFFSET + sizeof(struct payload_dir)) return 1;
+	memcpy(dir, &xbe[PAYLOAD_DIR_OFFSET], sizeof(struct payload_dir));
+
+	if (dir->magic != PAYLOAD_DIR_MAGIC || dir->version != PAYLOAD_DIR_VERSION) return 1;
+	if (dir->entry_size < ENTRY_MIN_SIZE) return 1;
+	if (dir->table > xbesize || (unsigned long long)dir->count * dir->entry_size > xbesize - dir->table) return 1;
+
+	return 0;
+}
+
+/*
+ * Copies entry i of the table, returns 0 if its payload is in the image.
+ * What an older, shorter entry does not have is 0.
+ */
+static int payload_entry_read(const unsigned char *xbe, unsigned int xbesize,
+			      const struct payload_dir *dir, unsigned int i, struct payload_entry *entry)
+{
+	memset(entry, 0, sizeof(struct payload_entry));
+	memcpy(entry, &xbe[dir->table + i * dir->entry_size],
+	       dir->entry_size < sizeof(struct payload_entry) ? dir->entry_size : sizeof(struct payload_entry));
+
+	if (entry->offset > xbesize || entry->size > xbesize - entry->offset) return 1;
+
+	return 0;
+}
+
+/* Bytes the chunk digests of a payload take */
+static unsigned int chunk_table_size(const struct payload_entry *entry)
+{
+	return chunk_count(entry->size, CHUNK_SHIFT) * SHA1HashSize;
+}
+
+/* Whether the chunk table of an entry read from an image is all there,
+   between the entry table and the end of the section */
+static int chunk_table_found(const struct payload_entry *entry, unsigned int table_end,
+			     unsigned int section_end)
+{
+	return entry->chunk_table >= table_end && entry->chunk_table <= section_end &&
+	       entry->chunk_shift == CHUNK_SHIFT &&
+	       chunk_table_size(entry) <= section_end - entry->chunk_table;
+}
+
+/* Puts the chunk tables of count entries one after the other from offset on */
+static unsigned int chunk_layout(struct payload_entry *table, unsigned int count, unsigned int offset)
+{
+	unsigned int i, pos = offset;
+
+	for (i = 0; i < count; i++) {
+		table[i].chunk_table = pos;
+		table[i].chunk_shift = CHUNK_SHIFT;
+		pos += chunk_table_size(&table[i]);
+	}
+	return pos - offset;
+}
+
+/*
+ * Hashes the chunks of the entries that are dirty (all with dirty NULL),
+ * from map or else from fd, into tables, which holds what is at file
+ * offset base on; the entries have been laid out.  Then fills in every
+ * chunk root, so the digests of the others have to be in tables already.
+ */
+static int chunk_tables(int fd, const unsigned char *map, struct payload_entry *table,
+			unsigned int count, const char *dirty, unsigned char *tables,
+			unsigned int base, unsigned int threads)
+{
+	struct chunk_range *ranges;
+	unsigned int i, n = 0;
+	int error;
+
+	ranges = calloc(count ? count : 1, sizeof(struct chunk_range));
+	if (ranges == NULL) return 1;
+	for (i = 0; i < count; i++) {
+		if (dirty != NULL && !dirty[i]) continue;
+		ranges[n].offset = table[i].offset;
+		ranges[n].size = table[i].size;
+		ranges[n].digests = tables + table[i].chunk_table - base;
+		n++;
+	}
+	error = chunk_hash(fd, map, ranges, n, CHUNK_SHIFT, threads);
+	free(ranges);
+
+	for (i = 0; !error && i < count; i++)
+		chunk_root(tables + table[i].chunk_table - base, chunk_count(table[i].size, CHUNK_SHIFT),
+			   table[i].chunk_root);
+	return error;
+}
+
+/* Fills in the entry of a payload stored uncompressed at offset */
+static void payload_place(struct imagebld *ib, struct payload *pl, unsigned int offset)
+{
+	SHA1Reset(&pl->digest);
+	pl->entry.offset = offset;
+	pl->entry.digest_type = PAYLOAD_DIGEST_SHA1;
+	payload_sizes(pl, pl->file.size);
+
+	pl->entry.flags &= ~PAYLOAD_FLAG_RESIDENT;
+	if (ib->page_align && !pl->compress) pl->entry.flags |= PAYLOAD_FLAG_RESIDENT;
+}
+
+/*
+ * Aligns behind a payload, to the next 0x100 bytes and always by at least
+ * one, or with -page to the next page
+ */
+static unsigned int payload_align(const struct imagebld *ib, unsigned int x)
+{
+	if (ib->page_align) return (x + 0xfff) & ~0xfff;
+	return (x & 0xffffff00) + 0x100;
+}
+
+/*
+ * Finds the section the payloads are linked into, the one that holds the
+ * payload directory.  The payloads make it grow, so it has to be the last
+ * one in the file.  Returns NULL if there is one, or what is wrong.
+ */
+static const char *payload_section(const struct xbe *x, unsigned int *s)
+{
+	struct xbe_section sec, other;
+	unsigned int i;
+	int found;
+
+	found = xbe_section_at(x, PAYLOAD_DIR_OFFSET);
+	if (found < 0) return "no section holds the payload directory";
+	xbe_section(x, found, &sec);
+	for (i = 0; i < x->sections; i++) {
+		xbe_section(x, i, &other);
+		if (other.file_size && other.file_address > sec.file_address)
+			return "payload section is not the last in the file";
+	}
+	*s = found;
+	return NULL;
+}
+
+/*
+ * Finds the payloads of a built image.  They run from the section that
+ * holds the payload directory to the end of the last section in the file;
+ * built with -sections, every payload and the entry table are in sections
+ * of their own behind it.  Returns NULL if there is one, or what is wrong.
+ */
+static const char *payload_area(const struct xbe *x, unsigned int *s, unsigned int *end)
+{
+	struct xbe_section sec;
+	unsigned int i, start;
+	int found;
+
+	found = xbe_section_at(x, PAYLOAD_DIR_OFFSET);
+	if (found < 0) return "no section holds the payload directory";
+	xbe_section(x, found, &sec);
+	start = sec.file_address;
+	*end = sec.file_address + sec.file_size;
+	for (i = 0; i < x->sections; i++) {
+		xbe_section(x, i, &sec);
+		if (sec.file_size && sec.file_address > start && sec.file_address + sec.file_size > *end)
+			*end = sec.file_address + sec.file_size;
+	}
+	*s = found;
+	return NULL;
+}
+
+/* Sections hashed on a pool of threads, the biggest first */
+struct section_pool {
+	const struct xbe *x;
+	unsigned int *order;
+	unsigned int count;		/* sections in order */
+	unsigned int next;		/* next of order to hand to a worker */
+	unsigned char *digests;		/* one per section of x */
+	pthread_mutex_t lock;
+};
+
+static void *section_worker(void *arg)
+{
+	struct section_pool *pool = arg;
+	unsigned int i;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->next < pool->count) {
+		i = pool->order[pool->next++];
+		pthread_mutex_unlock(&pool->lock);
+
+		xbe_section_hash(pool->x, i, pool->digests + i * SHA1HashSize);
+
+		pthread_mutex_lock(&pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+/*
+ * Hashes every section of x into digests, on up to threads threads, but
+ * for those that are known (with known NULL, none) and already in there.
+ * The sections are independent, so hashing takes about as long as the
+ * biggest of them.
+ */
+static int section_hashes(const struct xbe *x, unsigned char *digests, const char *known,
+			  unsigned int threads)
+{
+	struct section_pool pool;
+	struct xbe_section a, b;
+	pthread_t *workers;
+	unsigned int nworkers = threads;
+	unsigned int i, k, t;
+
+	pool.x = x;
+	pool.count = 0;
+	pool.next = 0;
+	pool.digests = digests;
+	pool.order = calloc(x->sections, sizeof(unsigned int));
+	if (nworkers > x->sections) nworkers = x->sections;
+	if (nworkers < 1) nworkers = 1;
+	workers = calloc(nworkers, sizeof(pthread_t));
+	if (pool.order == NULL || workers == NULL) {
+		free(pool.order);
+		free(workers);
+		return 1;
+	}
+
+	// There are only a few, sorting them by insertion does
+	for (i = 0; i < x->sections; i++) {
+		if (known != NULL && known[i]) continue;
+		xbe_section(x, i, &a);
+		for (k = pool.count; k > 0; k--) {
+			xbe_section(x, pool.order[k - 1], &b);
+			if (b.file_size >= a.file_size) break;
+			pool.order[k] = pool.order[k - 1];
+		}
+		pool.order[k] = i;
+		pool.count++;
+	}
+
+	pthread_mutex_init(&pool.lock, NULL);
+	for (t = 0; t < nworkers; t++)
+		if (pthread_create(&workers[t], NULL, section_worker, &pool)) break;
+	// Whatever did not get a thread is done here
+	if (t == 0) section_worker(&pool);
+	for (i = 0; i < t; i++) pthread_join(workers[i], NULL);
+	pthread_mutex_destroy(&pool.lock);
+
+	free(pool.order);
+	free(workers);
+	return 0;
+}
+
+/*
+ * Splits the payload section s of an image of xbesize bytes, whose
+ * payloads and entry table have been written, into a section for the
+ * loader, one per payload and one for the entry table with the chunk
+ * digests, and fills in the hashes of all sections; those of payloads
+ * from the store are taken from there.  Every section keeps its place in
+ * memory and reaches up to the next, so the image is laid out in memory
+ * as if it were one section.
+ */
+static int section_split(struct xbe *x, unsigned int s, unsigned int loadersize,
+			 const struct payload *payloads, unsigned int count,
+			 unsigned int table_start, unsigned int table_end, unsigned int threads)
+{
+	static const char *names[] = { "", ".kernel", ".initrd", ".config" };
+	struct xbe_section sec, *sections;
+	unsigned char *digests;
+	char *known;
+	unsigned int n = 0, i, start, next;
+	int error = 1;
+
+	sections = calloc(x->sections + count + 1, sizeof(struct xbe_section));
+	digests = calloc(x->sections + count + 1, SHA1HashSize);
+	known = calloc(x->sections + count + 1, 1);
+	if (sections == NULL || digests == NULL || known == NULL) goto out;
+
+	for (i = 0; i < x->sections; i++)
+		if (i != s) xbe_section(x, i, &sections[n++]);
+	xbe_section(x, s, &sec);
+
+	// The loader as it is, then what follows it in the same order
+	start = sec.file_address;
+	for (i = 0; i <= count; i++) {
+		next = i < count ? payloads[i].entry.offset : table_start;
+		if (i == 0) {
+			sections[n] = sec;
+			sections[n].file_size = loadersize - start;
+		} else {
+			const struct payload_entry *entry = &payloads[i - 1].entry;
+
+			sections[n].flags = XBE_SEC_WRITABLE | XBE_SEC_PRELOAD;
+			sections[n].file_address = start;
+			sections[n].file_size = payload_span(entry);
+			sections[n].name = entry->type < sizeof(names) / sizeof(names[0]) ?
+					   names[entry->type] : "";
+			if (payloads[i - 1].stored) {
+				memcpy(digests + n * SHA1HashSize, payloads[i - 1].section_digest, SHA1HashSize);
+				known[n] = 1;
+			}
+		}
+		sections[n].virtual_address = sec.virtual_address + start - sec.file_address;
+		sections[n].virtual_size = next - start;
+		n++;
+		start = next;
+	}
+	sections[n].flags = XBE_SEC_WRITABLE | XBE_SEC_PRELOAD;
+	sections[n].file_address = table_start;
+	sections[n].file_size = table_end - table_start;
+	sections[n].virtual_address = sec.virtual_address + table_start - sec.file_address;
+	sections[n].virtual_size = sec.file_address + sec.virtual_size - table_start;
+	sections[n].name = ".payload";
+	n++;
+
+	if (xbe_set_sections(x, sections, n)) goto out;
+	if (section_hashes(x, digests, known, threads)) goto out;
+	for (i = 0; i < x->sections; i++) xbe_set_section_digest(x, i, digests + i * SHA1HashSize);
+	error = 0;
+out:
+	free(sections);
+	free(digests);
+	free(known);
+	return error;
+}
+
+/*
+ * Tells if an input is what the last build was made from, and fills in
+ * its digest for the next one.  Unless it is the same file, untouched, the
+ * bytes are compared; a pipe never is the same.
+ */
+static int input_same(struct cache_input *now, const struct cache_input *was,
+		      const struct payload_file *p)
+{
+	SHA1Context context;
+
+	if (cache_input_same(now, was)) {
+		memcpy(now->digest, was->digest, SHA1HashSize);
+		now->flags |= CACHE_INPUT_DIGEST;
+		return 1;
+	}
+	if (p->stream) return 0;
+
+	SHA1Reset(&context);
+	if (p->size) SHA1Input(&context, p->data, p->size);
+	SHA1Result(&context, now->digest);
+	now->flags |= CACHE_INPUT_DIGEST;
+
+	return (was->flags & CACHE_INPUT_DIGEST) && !memcmp(now->digest, was->digest, SHA1HashSize);
+}
+
+/*
+ * Compares the inputs with the last build.  Returns the first payload that
+ * changed, count if none did, or 0 if the image cannot be built on; *valid
+ * is cleared then.
+ */
+static int cache_compare(struct build_cache *cache, const struct build_cache *old, int *valid,
+			 struct payload_file *loader, struct payload *payloads, int count)
+{
+	int first = count;
+	int i;
+
+	if (!input_same(&cache->loader, &old->loader, loader)) *valid = 0;
+	for (i = 0; i < count; i++) {
+		if (!input_same(&cache->inputs[i], &old->inputs[i], &payloads[i].file) ||
+		    old->entries[i].type != payloads[i].entry.type) {
+			if (i < first) first = i;
+		}
+	}
+
+	return *valid ? first : 0;
+}
+
+/*
+ * Stores a payload at offset in out, compressed or as it is, and fills in
+ * its entry.  Nothing goes into the section hash.
+ */
+static int payload_store(struct imagebld *ib, int out, struct payload *pl, unsigned int offset,
+			 unsigned int threads)
+{
+	unsigned int pos = offset;
+
+	payload_place(ib, pl, offset);
+	if (!pl->compress) return payload_link(out, &pos, pl, NULL);
+
+	pl->entry.size = payload_compress(out, pl, threads);
+	pl->entry.compression = PAYLOAD_COMP_LZ4;
+	return pl->entry.size == 0;
+}
+
+/* name in the store directory with suffix, malloc'd */
+static char *store_path(const struct imagebld *ib, const char *name, const char *suffix)
+{
+	char *path = malloc(strlen(ib->store) + strlen(name) + strlen(suffix) + 2);
+
+	if (path != NULL) sprintf(path, "%s/%s%s", ib->store, name, suffix);
+	return path;
+}
+
+/*
+ * Adds a payload to the store as blob and meta, open under names of their
+ * own, and fills in its entry, *meta and its chunk digests.
+ */
+static int store_add(struct imagebld *ib, struct payload *pl, int blob, int metafd,
+		     struct store_meta *meta)
+{
+	struct chunk_range range;
+	SHA1Context context;
+
+	if (payload_store(ib, blob, pl, 0, ib_threads(ib))) return 1;
+	SHA1Result(&pl->digest, pl->entry.digest);
+
+	memset(meta, 0, sizeof(*meta));
+	meta->magic = STORE_MAGIC;
+	meta->version = STORE_VERSION;
+	meta->span = payload_span(&pl->entry);
+	meta->chunks = chunk_count(pl->entry.size, CHUNK_SHIFT);
+
+	pl->chunks = malloc(meta->chunks ? meta->chunks * SHA1HashSize : 1);
+	if (pl->chunks == NULL) return 1;
+	range.offset = 0;
+	range.size = pl->entry.size;
+	range.digests = pl->chunks;
+	if (chunk_hash(blob, NULL, &range, 1, CHUNK_SHIFT, ib_threads(ib))) return 1;
+
+	meta->entry = pl->entry;
+	meta->entry.chunk_shift = CHUNK_SHIFT;
+	chunk_root(pl->chunks, meta->chunks, meta->entry.chunk_root);
+
+	// What a -sections build takes for its section hash
+	SHA1Reset(&context);
+	xbe_hash_size(&context, meta->span);
+	if (hash_range(blob, &context, 0, meta->span)) return 1;
+	SHA1Result(&context, meta->section_digest);
+
+	return store_meta_write(metafd, meta, pl->chunks);
+}
+
+/*
+ * Links a payload in from the store at the offset payload_place() gave
+ * it, adding it to the store first if it is not in there yet.  The entry,
+ * the chunk digests and the section digest come from the store as well,
+ * so a payload that is in there is neither compressed nor hashed again.
+ * input is the digest of the input if it is known, else NULL.
+ */
+static int store_link(struct imagebld *ib, int out, struct payload *pl, const unsigned char *input)
+{
+	unsigned int offset = pl->entry.offset;
+	unsigned char digest[SHA1HashSize];
+	char name[STORE_NAME_SIZE], suffix[64];
+	char *blobname, *metaname, *tmpname = NULL, *tmpmeta = NULL;
+	struct store_meta meta;
+	SHA1Context context;
+	struct stat st;
+	int blob = -1, metafd = -1;
+	int error = 1;
+
+	if (input == NULL) {
+		SHA1Reset(&context);
+		if (pl->file.size) SHA1Input(&context, pl->file.data, pl->file.size);
+		SHA1Result(&context, digest);
+		input = digest;
+	}
+	store_name(name, input, pl->entry.type, pl->compress ? "lz4" :
+		   (pl->entry.flags & PAYLOAD_FLAG_RESIDENT) ? "page" : "raw");
+	blobname = store_path(ib, name, "");
+	metaname = store_path(ib, name, ".meta");
+	if (blobname == NULL || metaname == NULL) goto out;
+
+	blob = imagebld_open(ib, blobname, O_RDONLY, 0);
+	if (blob >= 0) metafd = imagebld_open(ib, metaname, O_RDONLY, 0);
+	if (metafd >= 0 && store_meta_read(metafd, &meta, &pl->chunks) == 0 &&
+	    fstat(blob, &st) == 0 && st.st_size == meta.span) {
+		imagebld_log(ib, "%s is in the store\n", pl->name);
+	} else {
+		if (blob >= 0) close(blob);
+		if (metafd >= 0) close(metafd);
+		free(pl->chunks);
+		pl->chunks = NULL;
+
+		// Written under names of their own and renamed once complete,
+		// the meta last, so builds side by side never see half a blob
+		mkdir(ib->store, 0755);
+		snprintf(suffix, sizeof(suffix), ".%d.%lx", (int)getpid(), (unsigned long)pthread_self());
+		tmpname = store_path(ib, name, suffix);
+		snprintf(suffix, sizeof(suffix), ".meta.%d.%lx", (int)getpid(), (unsigned long)pthread_self());
+		tmpmeta = store_path(ib, name, suffix);
+		if (tmpname == NULL || tmpmeta == NULL) goto out;
+		blob = imagebld_open(ib, tmpname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		metafd = imagebld_open(ib, tmpmeta, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (blob < 0 || metafd < 0 || store_add(ib, pl, blob, metafd, &meta) ||
+		    rename(tmpname, blobname) < 0 || rename(tmpmeta, metaname) < 0) {
+			imagebld_log(ib, "Error adding %s to %s\n", pl->name, ib->store);
+			unlink(tmpname);
+			unlink(tmpmeta);
+			goto out;
+		}
+		imagebld_log(ib, "%s added to the store\n", pl->name);
+	}
+
+	if (store_copy(blob, out, offset, meta.span)) {
+		imagebld_log(ib, "Error copying %s from %s\n", pl->name, ib->store);
+		goto out;
+	}
+	pl->entry = meta.entry;
+	pl->entry.offset = offset;
+	memcpy(pl->section_digest, meta.section_digest, SHA1HashSize);
+	pl->stored = 1;
+	error = 0;
+out:
+	if (blob >= 0) close(blob);
+	if (metafd >= 0) close(metafd);
+	free(blobname);
+	free(metaname);
+	free(tmpname);
+	free(tmpmeta);
+	return error;
+}
+
+/*
+ * Links the payloads in behind the loader xbe, patches its headers and
+ * fills in the section hash.
+ *
+ * With ib->output the image goes there and xbe is left alone.  With a
+ * build cache as well, the image the last build left there is built on:
+ * payloads in front of the first one that changed are neither read nor
+ * written again, and if the directory stays where it was, the section hash
+ * picks up from its state at that payload.
+ */
+int imagebld_build(struct imagebld *ib, const char *xbeimage, const char *vmlinuzname,
+		   const char *initrdname, const char *configname, struct imagebld_result *res)
+{
+	const char *outname = ib->output != NULL ? ib->output : xbeimage;
+	int xbefd = -1;
+	int cachefd = -1;
+	struct stat st;
+	SHA1Context context;
+
+	int a;
+	unsigned char sha_Message_Digest[SHA1HashSize];
+
+	struct payload_file loader;
+	unsigned char *xbe = MAP_FAILED;
+	unsigned int xbesize = 0;
+	unsigned int loadersize = 0;
+	unsigned int mapsize = 0;
+	unsigned int pos;
+
+	struct payload payloads[IMAGEBLD_MAX_PAYLOADS];
+	struct payload *pl;
+	int count = 0;
+	int late = ib->compress;
+	int opened = 0;
+	int stdin_taken = 0;
+	int error = 1;
+	int i;
+
+	struct build_cache old, cache;
+	int valid = 0;
+	int first = 0;		/* first payload to be written */
+	int resume = 0;		/* the section hash picks up at payload first */
+
+	struct payload_dir dir;
+	struct payload_entry table[IMAGEBLD_MAX_PAYLOADS];
+	char dirty[IMAGEBLD_MAX_PAYLOADS];
+	unsigned int table_start;
+	unsigned int table_size;
+	unsigned char *chunks = NULL;
+	unsigned int chunks_size;
+
+	unsigned int FileSize = 0;
+
+	unsigned int xbeloader_size=0;
+
+	struct xbe x;
+	struct xbe_section sec;
+	unsigned int s;
+	const char *bad;
+
+	imagebld_log(ib, "ImageBLD Hasher by XBL Project (c) hamtitampti\n");
+	imagebld_log(ib, "XBEBOOT Modus\n\n");
+
+	loader.fd = -1;
+	loader.data = NULL;
+	loader.size = 0;
+
+	// The payloads in the order they are laid out
+	memset(payloads, 0, sizeof(payloads));
+#ifdef LOADXBE
+	payloads[count].name = vmlinuzname;
+	payloads[count].what = "Linux Kernel";
+	payloads[count].compress = ib->compress;
+	payloads[count].entry.type = PAYLOAD_KERNEL;
+	count++;
+
+	payloads[count].name = initrdname;
+	payloads[count].what = "InitRD";
+	payloads[count].compress = ib->compress;
+	payloads[count].entry.type = PAYLOAD_INITRD;
+	count++;
+#endif
+#ifdef LOADHDD_CFGFALLBACK
+	payloads[count].name = configname;
+	payloads[count].what = "Config";
+	payloads[count].entry.type = PAYLOAD_CONFIG;
+	count++;
+#endif
+
+	for (opened = 0; opened < count; opened++) {
+		pl = &payloads[opened];
+		if (payload_open(ib, &pl->file, pl->name, !pl->compress && ib->store == NULL, &stdin_taken)) {
+			imagebld_log(ib, "%s not found ----> ERROR \n", pl->name);
+			goto out;
+		}
+		if (pl->file.stream) late = 1;
+		imagebld_log(ib, "%s found, linking it in\n", pl->name);
+	}
+
+	// Only the headers are ever touched through memory.  In place the
+	// loader is patched where it is, else it is copied to the output first.
+	if (ib->output != NULL) {
+		if (payload_open(ib, &loader, xbeimage, 0, &stdin_taken)) {
+			imagebld_log(ib, "%s not found ----> ERROR \n", xbeimage);
+			goto out;
+		}
+		xbefd = imagebld_open(ib, outname, O_RDWR | O_CREAT, 0644);
+	} else {
+		xbefd = imagebld_open(ib, outname, O_RDWR, 0);
+	}
+	if (xbefd < 0 || fstat(xbefd, &st) < 0) {
+		imagebld_log(ib, "Error opening %s\n", outname);
+		goto out;
+	}
+	loadersize = ib->output != NULL ? loader.size : st.st_size;
+
+	memset(&cache, 0, sizeof(cache));
+	cache.magic = CACHE_MAGIC;
+	cache.version = CACHE_VERSION;
+	if (ib->compress) cache.flags |= CACHE_LZ4;
+	if (ib->page_align) cache.flags |= CACHE_PAGE;
+	if (ib->sections) cache.flags |= CACHE_SECTIONS;
+	cache.count = count;
+
+	if (ib->output != NULL && ib->cache != NULL) {
+		cachefd = imagebld_open(ib, ib->cache, O_RDWR | O_CREAT, 0644);
+		if (cachefd < 0) {
+			imagebld_log(ib, "Error opening %s\n", ib->cache);
+			goto out;
+		}
+		cache_input_stat(&cache.output, &st);
+		valid = cache_read(cachefd, &old) == 0 && old.flags == cache.flags &&
+			old.count == cache.count && cache_input_same(&cache.output, &old.output);
+		if (!valid) memset(&old, 0, sizeof(old));
+
+		cache_input_stat(&cache.loader, &loader.st);
+		for (i = 0; i < count; i++)
+			cache_input_stat(&cache.inputs[i], &payloads[i].file.st);
+		first = cache_compare(&cache, &old, &valid, &loader, payloads, count);
+
+		if (valid && first == count) {
+			imagebld_log(ib, "%s is up to date\n", outname);
+			memcpy(cache.entries, old.entries, sizeof(cache.entries));
+			memcpy(cache.mid, old.mid, sizeof(cache.mid));
+			memcpy(cache.section_hash, old.section_hash, SHA1HashSize);
+			cache.table_start = old.table_start;
+			cache.section_size = old.section_size;
+			if (res != NULL) {
+				memset(res, 0, sizeof(*res));
+				res->image_size = st.st_size;
+				res->section_size = old.section_size;
+				memcpy(res->section_hash, old.section_hash, IMAGEBLD_HASH_SIZE);
+				res->count = count;
+				memcpy(res->entries, old.entries, count * sizeof(struct payload_entry));
+			}
+			error = cache_write(cachefd, &cache);
+			goto out;
+		}
+		if (first > 0) imagebld_log(ib, "%s changed, linking from there on\n", payloads[first].name);
+
+		// Better no cache than one that does not match the image
+		if (ftruncate(cachefd, 0) < 0) goto out;
+	}
+
+	// Whatever the last build left from the first changed payload on goes
+	if (ib->output != NULL) {
+		pos = first > 0 ? old.entries[first].offset : 0;
+		if (ftruncate(xbefd, pos) < 0 || (pos < loadersize && ftruncate(xbefd, loadersize) < 0)) {
+			imagebld_log(ib, "Error writing %s\n", outname);
+			goto out;
+		}
+	}
+
+	xbe = mmap(NULL, loadersize, PROT_READ | PROT_WRITE, MAP_SHARED, xbefd, 0);
+	if (xbe == MAP_FAILED) goto out;
+	mapsize = loadersize;
+	if (ib->output != NULL) memcpy(xbe, loader.data, loadersize);
+
+	// The section sizes only cover the loader once it is built
+	bad = xbe_open(&x, xbe, loadersize);
+	if (bad == NULL) bad = payload_section(&x, &s);
+	if (bad != NULL) {
+		imagebld_log(ib, "%s: %s\n", xbeimage, bad);
+		goto out;
+	}
+	xbe_section(&x, s, &sec);
+
+	xbesize = loadersize;
+	FileSize = loadersize;
+
+	// We make some Allignment
+	xbesize = payload_align(ib, xbesize);
+
+	// Uncompressed, all sizes are known up front, so the directory header
+	// at 0x1080 (which is part of the hashed section) can be filled in
+	// before anything is copied.  Compressed and piped payloads are written
+	// first and the section is hashed from the file afterwards.
+	for (i = 0; i < count; i++) {
+		pl = &payloads[i];
+
+		if (i < first) {
+			// Where the last build put it
+			pl->entry = old.entries[i];
+		} else {
+			payload_place(ib, pl, xbesize);
+		}
+
+		if (i >= first && ib->store != NULL) {
+			if (store_link(ib, xbefd, pl, (cache.inputs[i].flags & CACHE_INPUT_DIGEST) ?
+						      cache.inputs[i].digest : NULL))
+				goto out;
+		} else if (i >= first && pl->file.stream) {
+			pos = xbesize;
+			if (payload_link(xbefd, &pos, pl, NULL)) {
+				imagebld_log(ib, "Error reading %s\n", pl->name);
+				goto out;
+			}
+		} else if (i >= first && pl->compress) {
+			pl->entry.size = payload_compress(xbefd, pl, ib_threads(ib));
+			if (pl->entry.size == 0) {
+				imagebld_log(ib, "Error compressing %s\n", pl->name);
+				goto out;
+			}
+			pl->entry.compression = PAYLOAD_COMP_LZ4;
+		}
+
+		xbesize = xbesize + payload_span(&pl->entry);
+		FileSize += payload_span(&pl->entry);
+		// Ok, we allign again
+		xbesize = payload_align(ib, xbesize);
+	}
+
+	// The entries follow the payloads, so their digests can be filled in
+	// once the payloads went past, and the chunk digests follow them
+	table_start = xbesize;
+	table_size = count * sizeof(struct payload_entry);
+	for (i = 0; i < count; i++) table[i] = payloads[i].entry;
+	chunks_size = chunk_layout(table, count, table_start + table_size);
+	xbesize = payload_align(ib, xbesize + table_size + chunks_size);
+	FileSize += table_size + chunks_size;
+
+	// Everything the section hash had seen up to payload first is the same
+	// if the directory header is.  Split into sections, each is hashed
+	// on its own once it is all written.
+	resume = valid && table_start == old.table_start && !ib->sections;
+	if ((first > 0 && !resume) || ib->sections || ib->store != NULL) late = 1;
+
+	memset(&dir, 0, sizeof(dir));
+	dir.magic = PAYLOAD_DIR_MAGIC;
+	dir.version = PAYLOAD_DIR_VERSION;
+	dir.header_size = sizeof(struct payload_dir);
+	dir.entry_size = sizeof(struct payload_entry);
+	dir.count = count;
+	dir.table = table_start;
+	if (ib->page_align) dir.flags |= PAYLOAD_DIR_PAGE_ALIGNED;
+	memcpy(&xbe[PAYLOAD_DIR_OFFSET], &dir, sizeof(dir));
+
+	imagebld_log(ib, "Linking Section\n");
+	for (i = 0; i < count; i++) {
+		pl = &payloads[i];
+		imagebld_log(ib, "Start of %-16s: 0x%08X\n", pl->what, pl->entry.offset);
+		imagebld_log(ib, "Size of %-17s: 0x%08X\n", pl->what, pl->entry.size);
+		if (pl->compress)
+		imagebld_log(ib, "LZ4, unpacked size      : 0x%08X\n", pl->entry.raw_size);
+	}
+	imagebld_log(ib, "Payload directory        : 0x%08X\n", table_start);
+	imagebld_log(ib, "----------------\n");
+
+	// We calculate a new Size of the overall XBE, we allign too
+	xbeloader_size = xbesize - sec.file_address;
+
+	xbesize = payload_align(ib, xbesize);
+
+	xbe_set_image_size(&x, FileSize);
+
+	imagebld_log(ib, "Size of all headers:     : 0x%08X\n", x.header_size);
+	imagebld_log(ib, "Size of entire image     : 0x%08X\n", x.image_size);
+
+	// The payload section runs to the end of the image
+	xbe_set_section_size(&x, s, xbeloader_size, xbeloader_size);
+	xbe_section(&x, s, &sec);
+
+	// Hash the section while the payloads stream in behind the loader
+	if (resume) {
+		cache_sha1_load(&context, &old.mid[first]);
+		pos = payloads[first].entry.offset;
+	} else {
+		SHA1Reset(&context);
+		xbe_hash_size(&context, sec.file_size);
+		SHA1Input(&context, xbe + sec.file_address, loadersize - sec.file_address);
+		pos = loadersize;
+	}
+	memcpy(cache.mid, old.mid, first * sizeof(struct cache_sha1));
+
+	for (i = first; i < count; i++) {
+		pl = &payloads[i];
+		if (!late) {
+			hash_zeros(&context, pl->entry.offset - pos);
+			pos = pl->entry.offset;
+			cache_sha1_save(&cache.mid[i], &context);
+		}
+		if (pl->compress || pl->file.stream || pl->stored) continue;
+		if (payload_link(xbefd, &pos, pl, late ? NULL : &context)) {
+			imagebld_log(ib, "Error writing %s\n", outname);
+			goto out;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		if (i >= first && !payloads[i].stored) SHA1Result(&payloads[i].digest, payloads[i].entry.digest);
+		memcpy(table[i].digest, payloads[i].entry.digest, SHA1HashSize);
+		dirty[i] = !payloads[i].stored;
+	}
+
+	// The chunks are hashed from the file, on all threads at once; those
+	// of payloads from the store are in there
+	chunks = malloc(chunks_size ? chunks_size : 1);
+	for (i = 0; chunks != NULL && i < count; i++)
+		if (payloads[i].stored)
+			memcpy(chunks + table[i].chunk_table - table_start - table_size, payloads[i].chunks,
+			       chunk_table_size(&table[i]));
+	if (chunks == NULL || chunk_tables(xbefd, NULL, table, count, dirty, chunks,
+					   table_start + table_size, ib_threads(ib))) {
+		imagebld_log(ib, "Error hashing %s\n", outname);
+		goto out;
+	}
+	for (i = 0; i < count; i++) payloads[i].entry = table[i];
+
+	if (write_all(xbefd, (unsigned char *)table, table_size, table_start) ||
+	    write_all(xbefd, chunks, chunks_size, table_start + table_size)) {
+		imagebld_log(ib, "Error writing %s\n", outname);
+		goto out;
+	}
+
+	if (ib->sections) goto split;
+
+	if (late) {
+		// The directory only got complete after the payloads were
+		// written, hash them from the file now
+		pos = resume ? payloads[first].entry.offset : loadersize;
+		for (i = resume ? first : 0; i < count; i++) {
+			pl = &payloads[i];
+			hash_zeros(&context, pl->entry.offset - pos);
+			cache_sha1_save(&cache.mid[i], &context);
+			if (hash_range(xbefd, &context, pl->entry.offset, payload_span(&pl->entry))) {
+				imagebld_log(ib, "Error hashing %s\n", outname);
+				goto out;
+			}
+			pos = pl->entry.offset + payload_span(&pl->entry);
+		}
+	}
+	hash_zeros(&context, table_start - pos);
+	SHA1Input(&context, (unsigned char *)table, table_size);
+	SHA1Input(&context, chunks, chunks_size);
+	hash_zeros(&context, sec.file_address + sec.file_size - table_start - table_size - chunks_size);
+	SHA1Result(&context, &sha_Message_Digest[0]);
+	xbe_set_section_digest(&x, s, sha_Message_Digest);
+
+	imagebld_log(ib, "S%u: Virtual address      : 0x%08X\n", s, sec.virtual_address);
+	imagebld_log(ib, "S%u: Virtual size         : 0x%08X\n", s, sec.virtual_size);
+	imagebld_log(ib, "S%u: File address         : 0x%08X\n", s, sec.file_address);
+	imagebld_log(ib, "S%u: File size            : 0x%08X\n", s, sec.file_size);
+
+	imagebld_log(ib, "Section %u Hash XBE       : ", s);
+	for(a=0; a<SHA1HashSize; a++) {
+		imagebld_log(ib, "%02x",sha_Message_Digest[a]);
+	}
+	imagebld_log(ib, "\n");
+
+split:
+	// The padding behind the table is a hole, it reads back as 0
+	if (ftruncate(xbefd, xbesize) < 0) {
+		imagebld_log(ib, "Error writing %s\n", outname);
+		goto out;
+	}
+
+	if (ib->sections) {
+		// The sections are hashed from a mapping of the whole image
+		munmap(xbe, mapsize);
+		xbe = mmap(NULL, xbesize, PROT_READ | PROT_WRITE, MAP_SHARED, xbefd, 0);
+		if (xbe == MAP_FAILED) goto out;
+		mapsize = xbesize;
+		xbe_open(&x, xbe, xbesize);
+		if (section_split(&x, s, loadersize, payloads, count, table_start,
+				  table_start + table_size + chunks_size, ib_threads(ib))) {
+			imagebld_log(ib, "%s: no room for the section headers\n", outname);
+			goto out;
+		}
+
+		for (i = 0; i < (int)x.sections; i++) {
+			xbe_section(&x, i, &sec);
+			imagebld_log(ib, "S%u: %-8s %08X, 0x%08X bytes at 0x%08X, ", i, sec.name,
+				     sec.virtual_address, sec.file_size, sec.file_address);
+			for (a = 0; a < SHA1HashSize; a++) imagebld_log(ib, "%02x", sec.digest[a]);
+			imagebld_log(ib, "\n");
+		}
+
+		// The loader's section is what the result and the cache tell of
+		xbe_section(&x, s, &sec);
+		memcpy(sha_Message_Digest, sec.digest, SHA1HashSize);
+	}
+
+	if (res != NULL) {
+		memset(res, 0, sizeof(*res));
+		res->image_size = xbesize;
+		res->section_size = sec.file_size;
+		memcpy(res->section_hash, sha_Message_Digest, IMAGEBLD_HASH_SIZE);
+		res->count = count;
+		memcpy(res->entries, table, table_size);
+	}
+
+	if (cachefd >= 0) {
+		cache.table_start = table_start;
+		cache.section_size = sec.file_size;
+		memcpy(cache.section_hash, sha_Message_Digest, SHA1HashSize);
+		memcpy(cache.entries, table, table_size);
+		// The headers went through the mapping, the mtime has to be
+		// taken after that
+		munmap(xbe, mapsize);
+		xbe = MAP_FAILED;
+		if (fstat(xbefd, &st) < 0) goto out;
+		cache_input_stat(&cache.output, &st);
+		if (cache_write(cachefd, &cache)) {
+			imagebld_log(ib, "Error writing %s\n", ib->cache);
+			goto out;
+		}
+	}
+
+	imagebld_log(ib, "\nXbeboot.xbe Created    : %s\n",outname);
+	error = 0;
+out:
+	if (xbe != MAP_FAILED) munmap(xbe, mapsize);
+	if (xbefd >= 0) close(xbefd);
+	if (cachefd >= 0) close(cachefd);
+	free(chunks);
+	payload_close(&loader);
+	for (i = 0; i < opened; i++) payload_close(&payloads[i].file);
+	for (i = 0; i < count; i++) free(payloads[i].chunks);
+
+	return error;
+}
+
+
+/* Sends len bytes at ofs of in to out, without copying through user space where it can */
+static int extract_range(int in, unsigned int ofs, unsigned int len, int out)
+{
+	unsigned char buf[0x10000];
+	loff_t in_ofs = ofs;
+	off_t sf_ofs;
+	ssize_t n;
+	int kernel_copy = 1, send = 1;
+
+	while (len) {
+		n = -1;
+		if (kernel_copy) {
+			n = copy_file_range(in, &in_ofs, out, NULL, len, 0);
+			if (n <= 0) kernel_copy = 0;
+		}
+		// copy_file_range does not do pipes, sendfile does
+		if (n <= 0 && send) {
+			sf_ofs = in_ofs;
+			n = sendfile(out, in, &sf_ofs, len);
+			if (n <= 0) send = 0;
+			else in_ofs = sf_ofs;
+		}
+		if (n <= 0) {
+			n = pread(in, buf, len < sizeof(buf) ? len : sizeof(buf), in_ofs);
+			if (n <= 0) return 1;
+			if (write(out, buf, n) != n) return 1;
+			in_ofs += n;
+		}
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Checks the headers of an image of xbesize bytes and that every section is
+ * inside it, and finds the payload section and the end of the payloads.
+ * Returns NULL if all is well, or what is wrong.
+ */
+static const char *xbe_headers(struct xbe *x, unsigned int *s, unsigned int *end,
+			       const unsigned char *xbe, unsigned int xbesize)
+{
+	const char *bad;
+
+	bad = xbe_open(x, xbe, xbesize);
+	if (bad == NULL) bad = xbe_check_sections(x);
+	if (bad == NULL) bad = payload_area(x, s, end);
+	return bad;
+}
+
+/* Fills in res from an image whose headers have been checked */
+static void result_read(const struct xbe *x, unsigned int s, struct imagebld_result *res)
+{
+	const unsigned char *xbe = x->data;
+	unsigned int xbesize = x->size;
+	struct xbe_section sec;
+	struct payload_dir dir;
+	unsigned int i;
+
+	xbe_section(x, s, &sec);
+	res->image_size = xbesize;
+	res->section_size = sec.file_size;
+	memcpy(res->section_hash, sec.digest, IMAGEBLD_HASH_SIZE);
+	res->count = 0;
+
+	if (payload_dir_read(xbe, xbesize, &dir)) return;
+	for (i = 0; i < dir.count && i < IMAGEBLD_MAX_PAYLOADS; i++)
+		payload_entry_read(xbe, xbesize, &dir, i, &res->entries[res->count++]);
+}
+
+/*
+ * Maps an image read-only.  Only the pages that are looked at are read, the
+ * payloads are copied out of the fd.
+ */
+static int xbe_map(struct imagebld *ib, const char *xbeimage, int *fd,
+		   unsigned char **xbe, unsigned int *xbesize)
+{
+	struct stat st;
+
+	*fd = imagebld_open(ib, xbeimage, O_RDONLY, 0);
+	if (*fd < 0 || fstat(*fd, &st) < 0) {
+		imagebld_log(ib, "%s not found ----> ERROR \n", xbeimage);
+		if (*fd >= 0) close(*fd);
+		return 1;
+	}
+	*xbesize = st.st_size;
+	*xbe = mmap(NULL, *xbesize, PROT_READ, MAP_SHARED, *fd, 0);
+	if (*xbe == MAP_FAILED) {
+		imagebld_log(ib, "Error reading %s\n", xbeimage);
+		close(*fd);
+		return 1;
+	}
+	return 0;
+}
+
+int imagebld_list(struct imagebld *ib, const char *xbeimage, struct imagebld_result *res)
+{
+	int xbefd;
+	unsigned char *xbe;
+	unsigned int xbesize = 0;
+	struct payload_dir dir;
+	struct payload_entry entry;
+	struct xbe x;
+	const char *bad;
+	unsigned int i, s, end;
+	int error = 1;
+
+	if (xbe_map(ib, xbeimage, &xbefd, &xbe, &xbesize)) return 1;
+
+	bad = xbe_headers(&x, &s, &end, xbe, xbesize);
+	if (bad != NULL) {
+		imagebld_log(ib, "%s: %s\n", xbeimage, bad);
+		goto out;
+	}
+	if (payload_dir_read(xbe, xbesize, &dir)) {
+		imagebld_log(ib, "No payload directory in %s\n", xbeimage);
+		goto out;
+	}
+	for (i = 0; i < dir.count; i++) {
+		if (payload_entry_read(xbe, xbesize, &dir, i, &entry)) {
+			imagebld_log(ib, "Payload %d is outside the image\n", i);
+			goto out;
+		}
+	}
+
+	memset(res, 0, sizeof(*res));
+	result_read(&x, s, res);
+	error = 0;
+out:
+	munmap(xbe, xbesize);
+	close(xbefd);
+	return error;
+}
+
+/*
+ * Writes the first payload of type out as it is stored.  Only the headers,
+ * the entry table and that payload are read.
+ */
+int imagebld_extract(struct imagebld *ib, const char *xbeimage, unsigned int type, int out,
+		     struct payload_entry *entry)
+{
+	int xbefd;
+	unsigned char *xbe;
+	unsigned int xbesize = 0;
+	struct payload_dir dir;
+	unsigned int i;
+	int error = 1;
+
+	if (xbe_map(ib, xbeimage, &xbefd, &xbe, &xbesize)) return 1;
+
+	if (payload_dir_read(xbe, xbesize, &dir)) {
+		imagebld_log(ib, "No payload directory in %s\n", xbeimage);
+		goto out;
+	}
+	for (i = 0; i < dir.count; i++) {
+		if (payload_entry_read(xbe, xbesize, &dir, i, entry)) {
+			imagebld_log(ib, "Payload %d is outside the image\n", i);
+			goto out;
+		}
+		if (entry->type == type) break;
+	}
+	if (i == dir.count) {
+		imagebld_log(ib, "No payload of type %u in %s\n", type, xbeimage);
+		goto out;
+	}
+
+	error = extract_range(xbefd, entry->offset, entry->size, out);
+out:
+	munmap(xbe, xbesize);
+	close(xbefd);
+	return error;
+}
+
+/* The files of an ISO image, open for iso_write() to take their data from */
+struct iso_input {
+	struct payload_file files[ISO_MAX_FILES];
+};
+
+static int iso_data(void *arg, unsigned int i, int out)
+{
+	struct payload_file *p = &((struct iso_input *)arg)->files[i];
+	unsigned int done = 0;
+	ssize_t n;
+
+	// Files go straight from their fd, only directories and pipes are in memory
+	if (p->fd >= 0) return extract_range(p->fd, 0, p->size, out);
+	while (done < p->size) {
+		n = write(out, p->data + done, p->size - done);
+		if (n <= 0) return 1;
+		done += n;
+	}
+	return 0;
+}
+
+/*
+ * Writes an ISO 9660/UDF image with the files in its root directory, their
+ * data in the order they are named.  "-" as iso is stdout.
+ */
+int imagebld_iso(struct imagebld *ib, const char *iso, const char **names, unsigned int count)
+{
+	struct iso_input in;
+	struct iso_file files[ISO_MAX_FILES];
+	const char *base;
+	unsigned int i, opened = 0;
+	int out = -1, error = 1;
+	int stdin_taken = 0;
+
+	if (count > ISO_MAX_FILES) {
+		imagebld_log(ib, "At most %d files go on an ISO image\n", ISO_MAX_FILES);
+		return 1;
+	}
+	for (i = 0; i < count; i++, opened++) {
+		base = strrchr(names[i], '/');
+		base = base ? base + 1 : names[i];
+		if (strlen(base) == 0 || strlen(base) > ISO_MAX_NAME) {
+			imagebld_log(ib, "%s: name does not fit on the image\n", names[i]);
+			goto out;
+		}
+		if (payload_open(ib, &in.files[i], names[i], 0, &stdin_taken)) {
+			imagebld_log(ib, "Error opening %s\n", names[i]);
+			goto out;
+		}
+		files[i].name = base;
+		files[i].size = in.files[i].size;
+		files[i].mtime = in.files[i].st.st_mtime;
+	}
+
+	if (strcmp(iso, "-") == 0) out = STDOUT_FILENO;
+	else out = imagebld_open(ib, iso, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) {
+		imagebld_log(ib, "Error creating %s\n", iso);
+		goto out;
+	}
+
+	error = iso_write(out, files, count, "LINUXBOOT", iso_data, &in);
+	if (error) {
+		imagebld_log(ib, "Error writing %s\n", iso);
+		goto out;
+	}
+	for (i = 0; i < count; i++)
+		imagebld_log(ib, "%-16s sector %8u, 0x%08X bytes\n", files[i].name,
+			     files[i].sector, files[i].size);
+out:
+	if (out > STDOUT_FILENO) close(out);
+	for (i = 0; i < opened; i++) payload_close(&in.files[i]);
+	return error;
+}
+
+/* Copies len bytes from one file to another */
+static int copy_range(int in, unsigned int from, int out, unsigned int to, unsigned int len)
+{
+	unsigned char buf[0x10000];
+	loff_t in_ofs = from, out_ofs = to;
+	ssize_t n;
+
+	while (len) {
+		n = copy_file_range(in, &in_ofs, out, &out_ofs, len, 0);
+		if (n <= 0) {
+			n = pread(in, buf, len < sizeof(buf) ? len : sizeof(buf), in_ofs);
+			if (n <= 0 || write_all(out, buf, n, out_ofs)) return 1;
+			in_ofs += n;
+			out_ofs += n;
+		}
+		len -= n;
+	}
+	return 0;
+}
+
+/* Entries of a batch image: the kernel, the initrd and the config */
+#define BATCH_PAYLOADS	3
+
+/* One image of a batch build, a line of the manifest */
+struct variant {
+	char *xbename;
+	struct payload initrd;
+	struct payload config;
+	int fd;
+};
+
+/*
+ * A batch build.  All variants share the loader and the kernel and get the
+ * same layout: the initrd and config slots are as big as the biggest of
+ * the batch, smaller ones are followed by zeros.  So the directory header,
+ * the section size and everything up to the initrd are the same in every
+ * image, and the section hash of that prefix is computed once; each
+ * variant carries on from a copy of that SHA-1 midstate.
+ */
+struct batch {
+	struct imagebld *ib;
+	struct variant *variants;
+	unsigned int count;
+	unsigned int next;		/* next variant to hand to a worker */
+	pthread_mutex_t lock;
+	int (*work)(struct batch *, struct variant *);
+	int error;
+
+	unsigned int threads;		/* compression threads per variant */
+
+	unsigned char *loader;		/* patched copy of the loader */
+	unsigned int loadersize;
+	unsigned int sha_offset;	/* file offset of the section hash */
+	struct payload kernel;
+	int kernelfd;			/* output the kernel was stored into */
+
+	unsigned int initrd_start;
+	unsigned int config_start;
+	unsigned int table_start;
+	unsigned int chunks_start;	/* kernel, initrd and config chunk digests */
+	unsigned int chunks_size;	/* room for the biggest of the batch */
+	unsigned char *chunks;		/* with the kernel ones filled in */
+	unsigned int section_end;
+	unsigned int xbesize;
+	SHA1Context prefix;		/* section hash up to initrd_start */
+};
+
+static void *batch_worker(void *arg)
+{
+	struct batch *b = arg;
+	struct variant *v;
+
+	pthread_mutex_lock(&b->lock);
+	while (!b->error && b->next < b->count) {
+		v = &b->variants[b->next++];
+		pthread_mutex_unlock(&b->lock);
+
+		if (b->work(b, v)) {
+			imagebld_log(b->ib, "Error building %s\n", v->xbename);
+			pthread_mutex_lock(&b->lock);
+			b->error = 1;
+			continue;
+		}
+		pthread_mutex_lock(&b->lock);
+	}
+	pthread_mutex_unlock(&b->lock);
+
+	return NULL;
+}
+
+/* Runs work on every variant, ib->threads of them at a time */
+static int batch_run(struct batch *b, int (*work)(struct batch *, struct variant *))
+{
+	pthread_t *workers;
+	unsigned int nworkers = ib_threads(b->ib);
+	unsigned int i;
+
+	if (nworkers > b->count) nworkers = b->count;
+	b->threads = ib_threads(b->ib) / nworkers;
+	b->work = work;
+	b->next = 0;
+
+	workers = calloc(nworkers, sizeof(pthread_t));
+	if (workers == NULL) return 1;
+	for (i = 0; i < nworkers; i++)
+		if (pthread_create(&workers[i], NULL, batch_worker, b)) break;
+	// Whatever did not get a thread is done here
+	if (i == 0) batch_worker(b);
+	nworkers = i;
+	for (i = 0; i < nworkers; i++) pthread_join(workers[i], NULL);
+	free(workers);
+
+	return b->error;
+}
+
+static int batch_store_initrd(struct batch *b, struct variant *v)
+{
+	return payload_store(b->ib, v->fd, &v->initrd, b->initrd_start, b->threads);
+}
+
+static int batch_finish(struct batch *b, struct variant *v)
+{
+	struct payload *payloads[IMAGEBLD_MAX_PAYLOADS];
+	struct payload_entry table[IMAGEBLD_MAX_PAYLOADS];
+	char dirty[IMAGEBLD_MAX_PAYLOADS];
+	unsigned int count = 0;
+	SHA1Context context;
+	unsigned char sha_Message_Digest[SHA1HashSize];
+	unsigned char *map, *chunks;
+	unsigned char field[4];
+	unsigned int size, i;
+	int error;
+
+	if (v->fd != b->kernelfd &&
+	    copy_range(b->kernelfd, b->kernel.entry.offset, v->fd, b->kernel.entry.offset,
+		       payload_span(&b->kernel.entry)))
+		return 1;
+	if (payload_store(b->ib, v->fd, &v->config, b->config_start, 1)) return 1;
+
+	SHA1Result(&v->initrd.digest, v->initrd.entry.digest);
+	SHA1Result(&v->config.digest, v->config.entry.digest);
+	payloads[count++] = &b->kernel;
+	payloads[count++] = &v->initrd;
+	payloads[count++] = &v->config;
+	for (i = 0; i < count; i++) {
+		table[i] = payloads[i]->entry;
+		dirty[i] = payloads[i] != &b->kernel;
+	}
+
+	// The chunk digests are laid out as a build of this variant would,
+	// so the kernel ones come first and are shared; room the biggest
+	// variant needs and this one does not stays zero
+	chunks = malloc(b->chunks_size);
+	if (chunks == NULL) return 1;
+	memcpy(chunks, b->chunks, b->chunks_size);
+	size = chunk_layout(table, count, b->chunks_start);
+	error = chunk_tables(v->fd, NULL, table, count, dirty, chunks, b->chunks_start, b->threads) ||
+		write_all(v->fd, chunks, b->chunks_size, b->chunks_start);
+	free(chunks);
+	if (error) return 1;
+
+	if (write_all(v->fd, (unsigned char *)table, count * sizeof(struct payload_entry), b->table_start))
+		return 1;
+	if (write_all(v->fd, b->loader, b->loadersize, 0)) return 1;
+
+	// ImageSize is what a build of just this variant would give it
+	size += b->loadersize + count * sizeof(struct payload_entry);
+	for (i = 0; i < count; i++) size += payload_span(&table[i]);
+	for (i = 0; i < 4; i++) field[i] = size >> (i * 8);
+	if (write_all(v->fd, field, sizeof(field), XBE_IMAGE_SIZE)) return 1;
+
+	// Carry on from the shared prefix with what differs
+	if (ftruncate(v->fd, b->section_end) < 0) return 1;
+	map = mmap(NULL, b->section_end, PROT_READ, MAP_SHARED, v->fd, 0);
+	if (map == MAP_FAILED) return 1;
+	madvise(map + b->initrd_start, b->section_end - b->initrd_start, MADV_SEQUENTIAL);
+	context = b->prefix;
+	SHA1Input(&context, map + b->initrd_start, b->section_end - b->initrd_start);
+	SHA1Result(&context, &sha_Message_Digest[0]);
+	munmap(map, b->section_end);
+
+	if (write_all(v->fd, sha_Message_Digest, SHA1HashSize, b->sha_offset)) return 1;
+	if (ftruncate(v->fd, b->xbesize) < 0) return 1;
+
+	imagebld_log(b->ib, "Xbeboot.xbe Created    : %s\n", v->xbename);
+	return 0;
+}
+
+/* Reads the manifest, one "xbe initrd config" per line, # starts a comment */
+static int batch_manifest(struct batch *b, const char *name)
+{
+	FILE *f;
+	char line[1024];
+	char *xbe, *initrd, *config;
+	struct variant *v;
+	int fd;
+
+	fd = imagebld_open(b->ib, name, O_RDONLY, 0);
+	if (fd < 0) return 1;
+	f = fdopen(fd, "r");
+	if (f == NULL) {
+		close(fd);
+		return 1;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strchr(line, '#') != NULL) *strchr(line, '#') = 0;
+		xbe = strtok(line, " \t\r\n");
+		if (xbe == NULL) continue;
+		initrd = strtok(NULL, " \t\r\n");
+		config = strtok(NULL, " \t\r\n");
+		if (config == NULL) {
+			imagebld_log(b->ib, "%s: expected \"xbe initrd config\" in %s\n", name, xbe);
+			fclose(f);
+			return 1;
+		}
+
+		v = realloc(b->variants, (b->count + 1) * sizeof(struct variant));
+		if (v == NULL) {
+			fclose(f);
+			return 1;
+		}
+		b->variants = v;
+		v = &b->variants[b->count++];
+		memset(v, 0, sizeof(*v));
+		v->fd = -1;
+		v->xbename = strdup(xbe);
+		v->initrd.name = strdup(initrd);
+		v->initrd.what = "InitRD";
+		v->initrd.entry.type = PAYLOAD_INITRD;
+		v->initrd.file.fd = -1;
+		v->config.name = strdup(config);
+		v->config.what = "Config";
+		v->config.entry.type = PAYLOAD_CONFIG;
+		v->config.file.fd = -1;
+	}
+	fclose(f);
+
+	return b->count == 0;
+}
+
+int imagebld_batch(struct imagebld *ib, const char *loadername, const char *vmlinuzname,
+		   const char *manifestname)
+{
+	struct batch b;
+	struct payload_file loader;
+	struct variant *v;
+	struct payload_dir dir;
+	struct xbe x;
+	struct xbe_section sec;
+	const char *bad;
+	unsigned char *map;
+	unsigned int initrd_max = 0, config_max = 0;
+	unsigned int initrd_chunks = 0, config_chunks = 0;
+	unsigned int i, s;
+	int stdin_taken = 0;
+	int error = 1;
+
+	imagebld_log(ib, "ImageBLD Hasher by XBL Project (c) hamtitampti\n");
+	imagebld_log(ib, "XBEBOOT Modus, batch build\n\n");
+
+	// The variants share one section hash up to their initrds, and
+	// their kernel already
+	if (ib->sections || ib->store != NULL) {
+		imagebld_log(ib, "-sections and -store do not go with -batch\n");
+		return 1;
+	}
+
+	memset(&b, 0, sizeof(b));
+	pthread_mutex_init(&b.lock, NULL);
+	b.ib = ib;
+	b.kernelfd = -1;
+	b.kernel.file.fd = -1;
+
+	if (batch_manifest(&b, manifestname)) {
+		imagebld_log(ib, "%s: no variants\n", manifestname);
+		goto out;
+	}
+
+	if (payload_open(ib, &loader, loadername, 0, &stdin_taken)) {
+		imagebld_log(ib, "%s not found ----> ERROR \n", loadername);
+		goto out;
+	}
+	b.loadersize = loader.size;
+	b.loader = malloc(loader.size);
+	if (b.loader != NULL) memcpy(b.loader, loader.data, loader.size);
+	payload_close(&loader);
+	if (b.loader == NULL) goto out;
+	bad = xbe_open(&x, b.loader, b.loadersize);
+	if (bad == NULL) bad = payload_section(&x, &s);
+	if (bad != NULL) {
+		imagebld_log(ib, "%s: %s\n", loadername, bad);
+		goto out;
+	}
+
+	b.kernel.name = vmlinuzname;
+	b.kernel.what = "Linux Kernel";
+	b.kernel.compress = ib->compress;
+	b.kernel.entry.type = PAYLOAD_KERNEL;
+	if (payload_open(ib, &b.kernel.file, vmlinuzname, 0, &stdin_taken)) {
+		imagebld_log(ib, "%s not found ----> ERROR \n", vmlinuzname);
+		goto out;
+	}
+
+	for (i = 0; i < b.count; i++) {
+		v = &b.variants[i];
+		v->initrd.compress = ib->compress;
+		if (payload_open(ib, &v->initrd.file, v->initrd.name, 0, &stdin_taken)) {
+			imagebld_log(ib, "%s not found ----> ERROR \n", v->initrd.name);
+			goto out;
+		}
+		if (payload_open(ib, &v->config.file, v->config.name, 0, &stdin_taken)) {
+			imagebld_log(ib, "%s not found ----> ERROR \n", v->config.name);
+			goto out;
+		}
+		v->fd = imagebld_open(ib, v->xbename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (v->fd < 0) {
+			imagebld_log(ib, "Error creating %s\n", v->xbename);
+			goto out;
+		}
+	}
+
+	// The kernel is stored once, into the first image, and copied from
+	// there; the initrds follow it at the same place in every image
+	b.kernelfd = b.variants[0].fd;
+	if (payload_store(ib, b.kernelfd, &b.kernel, payload_align(ib, b.loadersize), ib_threads(ib))) {
+		imagebld_log(ib, "Error writing %s\n", b.variants[0].xbename);
+		goto out;
+	}
+	SHA1Result(&b.kernel.digest, b.kernel.entry.digest);
+	b.initrd_start = payload_align(ib, b.kernel.entry.offset + payload_span(&b.kernel.entry));
+
+	if (batch_run(&b, batch_store_initrd)) goto out;
+
+	for (i = 0; i < b.count; i++) {
+		v = &b.variants[i];
+		if (payload_span(&v->initrd.entry) > initrd_max) initrd_max = payload_span(&v->initrd.entry);
+		if (v->config.file.size > config_max) config_max = v->config.file.size;
+		if (chunk_table_size(&v->initrd.entry) > initrd_chunks)
+			initrd_chunks = chunk_table_size(&v->initrd.entry);
+		v->config.entry.size = v->config.file.size;
+		if (chunk_table_size(&v->config.entry) > config_chunks)
+			config_chunks = chunk_table_size(&v->config.entry);
+	}
+
+	// Same rules as xbebuild(), with the biggest payloads of the batch
+	b.config_start = payload_align(ib, b.initrd_start + initrd_max);
+	b.table_start = payload_align(ib, b.config_start + config_max);
+	b.chunks_start = b.table_start + BATCH_PAYLOADS * sizeof(struct payload_entry);
+	b.chunks_size = chunk_layout(&b.kernel.entry, 1, b.chunks_start) + initrd_chunks + config_chunks;
+	b.section_end = payload_align(ib, b.chunks_start + b.chunks_size);
+	b.xbesize = payload_align(ib, b.section_end);
+
+	b.chunks = calloc(1, b.chunks_size ? b.chunks_size : 1);
+	if (b.chunks == NULL ||
+	    chunk_tables(b.kernelfd, NULL, &b.kernel.entry, 1, NULL, b.chunks, b.chunks_start, ib_threads(ib))) {
+		imagebld_log(ib, "Error hashing %s\n", vmlinuzname);
+		goto out;
+	}
+
+	memset(&dir, 0, sizeof(dir));
+	dir.magic = PAYLOAD_DIR_MAGIC;
+	dir.version = PAYLOAD_DIR_VERSION;
+	dir.header_size = sizeof(struct payload_dir);
+	dir.entry_size = sizeof(struct payload_entry);
+	dir.count = BATCH_PAYLOADS;
+	dir.table = b.table_start;
+	if (ib->page_align) dir.flags |= PAYLOAD_DIR_PAGE_ALIGNED;
+	memcpy(&b.loader[PAYLOAD_DIR_OFFSET], &dir, sizeof(dir));
+
+	xbe_section(&x, s, &sec);
+	xbe_set_section_size(&x, s, b.section_end - sec.file_address, b.section_end - sec.file_address);
+	xbe_section(&x, s, &sec);
+	b.sha_offset = xbe_section_digest_offset(&x, s);
+
+	imagebld_log(ib, "Start of Linux Kernel    : 0x%08X\n", b.kernel.entry.offset);
+	imagebld_log(ib, "Size of Linux Kernel     : 0x%08X\n", b.kernel.entry.size);
+	imagebld_log(ib, "Start of InitRD          : 0x%08X\n", b.initrd_start);
+	imagebld_log(ib, "Largest InitRD           : 0x%08X\n", initrd_max);
+	imagebld_log(ib, "Start of Config          : 0x%08X\n", b.config_start);
+	imagebld_log(ib, "Largest Config           : 0x%08X\n", config_max);
+	imagebld_log(ib, "Payload directory        : 0x%08X\n", b.table_start);
+	imagebld_log(ib, "S%u: File size            : 0x%08X\n", s, sec.file_size);
+	imagebld_log(ib, "----------------\n");
+
+	// The part of the section every variant has in common
+	SHA1Reset(&b.prefix);
+	xbe_hash_size(&b.prefix, sec.file_size);
+	SHA1Input(&b.prefix, b.loader + sec.file_address, b.loadersize - sec.file_address);
+	hash_zeros(&b.prefix, b.kernel.entry.offset - b.loadersize);
+	map = mmap(NULL, b.initrd_start, PROT_READ, MAP_SHARED, b.kernelfd, 0);
+	if (map == MAP_FAILED) goto out;
+	SHA1Input(&b.prefix, map + b.kernel.entry.offset, payload_span(&b.kernel.entry));
+	munmap(map, b.initrd_start);
+	hash_zeros(&b.prefix, b.initrd_start - b.kernel.entry.offset - payload_span(&b.kernel.entry));
+
+	if (batch_run(&b, batch_finish)) goto out;
+
+	error = 0;
+out:
+	for (i = 0; i < b.count; i++) {
+		v = &b.variants[i];
+		if (v->fd >= 0) close(v->fd);
+		payload_close(&v->initrd.file);
+		payload_close(&v->config.file);
+		free(v->xbename);
+		free((char *)v->initrd.name);
+		free((char *)v->config.name);
+	}
+	payload_close(&b.kernel.file);
+	free(b.variants);
+	free(b.loader);
+	free(b.chunks);
+	pthread_mutex_destroy(&b.lock);
+
+	return error;
+}
+
+
+/* Moves len bytes at from up to to, back to front as the ranges overlap */
+static int move_range(int fd, unsigned int from, unsigned int to, unsigned int len)
+{
+	unsigned char *buf;
+	unsigned int n;
+	int error = 0;
+
+	buf = malloc(STREAM_CHUNK);
+	if (buf == NULL) return 1;
+
+	while (!error && len) {
+		n = len < STREAM_CHUNK ? len : STREAM_CHUNK;
+		len -= n;
+		error = pread(fd, buf, n, from + len) != n ||
+			write_all(fd, buf, n, to + len);
+	}
+
+	free(buf);
+	return error;
+}
+
+/* Zeroes len bytes at ofs, as a hole where the filesystem can */
+static int zero_range(int fd, unsigned int ofs, unsigned int len)
+{
+	static const unsigned char zero[0x1000];
+	unsigned int n;
+
+	if (len == 0) return 0;
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, ofs, len) == 0) return 0;
+
+	while (len) {
+		n = len < sizeof(zero) ? len : sizeof(zero);
+		if (write_all(fd, zero, n, ofs)) return 1;
+		ofs += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Replaces one payload of a built image in place.  The new payload is
+ * stored the way the old one was.  If it does not fit into its slot, what
+ * follows it in the section (later payloads and the entry table) moves up
+ * by whole 0x100 steps; nothing in front of it is rewritten.  The chunk
+ * digests are laid out again behind the entry table, only the new payload
+ * is hashed for them.  The section hash still has to read the whole
+ * section.
+ */
+int imagebld_replace(struct imagebld *ib, const char *xbeimage, unsigned int type,
+		     const char *filename, struct imagebld_result *res)
+{
+	struct imagebld layout = *ib;
+	int xbefd;
+	struct stat st;
+	unsigned char *xbe;
+	unsigned int xbesize;
+	unsigned char sha_Message_Digest[SHA1HashSize];
+
+	struct xbe x;
+	struct xbe_section sec;
+	unsigned int s, section_end;
+
+	struct payload_dir dir;
+	struct payload_entry *table = NULL, was;
+	struct payload pl;
+	unsigned int r = 0, i;
+	unsigned int start, next, delta = 0;
+	unsigned int table_end, end;
+	unsigned int pos;
+
+	int chunked;
+	unsigned int *from = NULL;
+	char *dirty = NULL;
+	unsigned char *chunks = NULL;
+	unsigned int chunks_start = 0, chunks_size = 0, chunks_was = 0;
+	FILE *tmp = NULL;
+	int stdin_taken = 0;
+	int error = 1;
+
+	memset(&pl, 0, sizeof(pl));
+	pl.name = filename;
+	pl.what = filename;
+	if (payload_open(ib, &pl.file, filename, 0, &stdin_taken)) {
+		imagebld_log(ib, "%s not found ----> ERROR \n", filename);
+		return 1;
+	}
+
+	xbefd = imagebld_open(ib, xbeimage, O_RDWR, 0);
+	if (xbefd < 0 || fstat(xbefd, &st) < 0) {
+		imagebld_log(ib, "Error opening %s\n", xbeimage);
+		if (xbefd >= 0) close(xbefd);
+		payload_close(&pl.file);
+		return 1;
+	}
+	xbesize = st.st_size;
+	xbe = mmap(NULL, xbesize, PROT_READ | PROT_WRITE, MAP_SHARED, xbefd, 0);
+	if (xbe == MAP_FAILED) {
+		close(xbefd);
+		payload_close(&pl.file);
+		return 1;
+	}
+
+	if (payload_dir_read(xbe, xbesize, &dir)) {
+		imagebld_log(ib, "No payload directory in %s\n", xbeimage);
+		goto out;
+	}
+	table = calloc(dir.count, sizeof(struct payload_entry));
+	if (table == NULL) goto out;
+	for (i = 0; i < dir.count; i++) {
+		if (payload_entry_read(xbe, xbesize, &dir, i, &table[i])) {
+			imagebld_log(ib, "Payload %d is outside the image\n", i);
+			goto out;
+		}
+		if (table[i].type == type) r = i + 1;
+	}
+	if (r == 0) {
+		imagebld_log(ib, "No payload of type %u in %s\n", type, xbeimage);
+		goto out;
+	}
+	r--;
+
+	if (xbe_headers(&x, &s, &section_end, xbe, xbesize) != NULL) {
+		imagebld_log(ib, "Bad section in %s\n", xbeimage);
+		goto out;
+	}
+	xbe_section(&x, s, &sec);
+	if (section_end != sec.file_address + sec.file_size) {
+		imagebld_log(ib, "%s has its payloads in sections of their own, build it again\n", xbeimage);
+		goto out;
+	}
+	table_end = dir.table + dir.count * dir.entry_size;
+	if (table_end > section_end) {
+		imagebld_log(ib, "Bad section in %s\n", xbeimage);
+		goto out;
+	}
+	// Entries from before the chunk digests have no room for them
+	chunked = dir.entry_size >= sizeof(struct payload_entry);
+
+	// Replacements keep to the layout of the image
+	layout.page_align = (dir.flags & PAYLOAD_DIR_PAGE_ALIGNED) != 0;
+
+	// Whatever comes next in the section limits the slot
+	start = table[r].offset;
+	next = dir.table;
+	for (i = 0; i < dir.count; i++)
+		if (table[i].offset > start && table[i].offset < next) next = table[i].offset;
+
+	pl.entry = table[r];
+	pl.compress = table[r].compression == PAYLOAD_COMP_LZ4;
+	if (pl.compress) {
+		// The frame size is only known once it is written
+		tmp = tmpfile();
+		if (tmp == NULL || payload_store(&layout, fileno(tmp), &pl, 0, ib_threads(ib))) {
+			imagebld_log(ib, "Error compressing %s\n", filename);
+			goto out;
+		}
+		pl.entry.offset = start;
+	} else {
+		payload_place(&layout, &pl, start);
+	}
+
+	if (payload_align(&layout, start + payload_span(&pl.entry)) > next)
+		delta = payload_align(&layout, start + payload_span(&pl.entry)) - next;
+	end = section_end + delta;
+	was = table[r];
+	table[r] = pl.entry;
+
+	// The tables of the other payloads are kept if they are all there
+	if (chunked) {
+		from = calloc(dir.count, sizeof(unsigned int));
+		dirty = calloc(dir.count, 1);
+		if (from == NULL || dirty == NULL) goto out;
+		for (i = 0; i < dir.count; i++) {
+			from[i] = table[i].chunk_table;
+			dirty[i] = i == r || !chunk_table_found(&table[i], table_end, section_end);
+			if (!dirty[i]) chunks_was += chunk_table_size(&table[i]);
+		}
+		// The old table of the replaced payload is in ImageSize as well
+		if (chunk_table_found(&was, table_end, section_end)) chunks_was += chunk_table_size(&was);
+
+		chunks_start = table_end + delta;
+		chunks_size = chunk_layout(table, dir.count, chunks_start);
+		chunks = calloc(1, chunks_size ? chunks_size : 1);
+		if (chunks == NULL) goto out;
+		for (i = 0; i < dir.count; i++)
+			if (!dirty[i])
+				memcpy(chunks + table[i].chunk_table - chunks_start, xbe + from[i],
+				       chunk_table_size(&table[i]));
+		if (payload_align(&layout, chunks_start + chunks_size) > end)
+			end = payload_align(&layout, chunks_start + chunks_size);
+	}
+
+	if (end > section_end) {
+		munmap(xbe, xbesize);
+		// The chunk tables are written anew, they need not move
+		if (ftruncate(xbefd, xbesize + end - section_end) < 0 ||
+		    move_range(xbefd, section_end, end, xbesize - section_end) ||
+		    (delta && move_range(xbefd, next, next + delta, (chunked ? table_end : section_end) - next))) {
+			imagebld_log(ib, "Error writing %s\n", xbeimage);
+			xbe = MAP_FAILED;
+			goto out;
+		}
+		xbesize += end - section_end;
+		xbe = mmap(NULL, xbesize, PROT_READ | PROT_WRITE, MAP_SHARED, xbefd, 0);
+		if (xbe == MAP_FAILED) goto out;
+		xbe_open(&x, xbe, xbesize);
+	}
+
+	pos = start;
+	if (pl.compress ? copy_range(fileno(tmp), 0, xbefd, start, pl.entry.size) :
+			  payload_link(xbefd, &pos, &pl, NULL)) {
+		imagebld_log(ib, "Error writing %s\n", xbeimage);
+		goto out;
+	}
+	// Leftovers of the old payload
+	pos = start + payload_span(&pl.entry);
+	if (zero_range(xbefd, pos, next + delta - pos)) {
+		imagebld_log(ib, "Error writing %s\n", xbeimage);
+		goto out;
+	}
+	SHA1Result(&pl.digest, table[r].digest);
+
+	imagebld_log(ib, "Start of payload         : 0x%08X\n", start);
+	imagebld_log(ib, "Old size                 : 0x%08X\n", table[r].size);
+	imagebld_log(ib, "New size                 : 0x%08X\n", pl.entry.size);
+	imagebld_log(ib, "Moved up                 : 0x%08X\n", delta);
+	imagebld_log(ib, "----------------\n");
+
+	for (i = 0; i < dir.count; i++)
+		if (table[i].offset > start) table[i].offset += delta;
+	dir.table += delta;
+
+	if (chunked &&
+	    (chunk_tables(xbefd, xbe, table, dir.count, dirty, chunks, chunks_start, ib_threads(ib)) ||
+	     write_all(xbefd, chunks, chunks_size, chunks_start) ||
+	     zero_range(xbefd, chunks_start + chunks_size, end - chunks_start - chunks_size))) {
+		imagebld_log(ib, "Error writing %s\n", xbeimage);
+		goto out;
+	}
+
+	xbe_set_image_size(&x, x.image_size + payload_span(&table[r]) - payload_span(&was) +
+			   chunks_size - chunks_was);
+	memcpy(&xbe[PAYLOAD_DIR_OFFSET], &dir, sizeof(dir));
+	// Only the fields both this version and the image know, anything behind them stays
+	for (i = 0; i < dir.count; i++)
+		memcpy(&xbe[dir.table + i * dir.entry_size], &table[i],
+		       dir.entry_size < sizeof(struct payload_entry) ? dir.entry_size : sizeof(struct payload_entry));
+
+	xbe_set_section_size(&x, s, end - sec.file_address, sec.virtual_size + end - section_end);
+	xbe_section(&x, s, &sec);
+
+	madvise(xbe + sec.file_address, sec.file_size, MADV_SEQUENTIAL);
+	xbe_section_hash(&x, s, sha_Message_Digest);
+	xbe_set_section_digest(&x, s, sha_Message_Digest);
+
+	if (res != NULL) {
+		memset(res, 0, sizeof(*res));
+		result_read(&x, s, res);
+	}
+	error = 0;
+out:
+	if (tmp != NULL) fclose(tmp);
+	free(chunks);
+	free(dirty);
+	free(from);
+	free(table);
+	if (xbe != MAP_FAILED) munmap(xbe, xbesize);
+	close(xbefd);
+	payload_close(&pl.file);
+
+	return error;
+}
+
+
+/*
+ * Checks the chunk digests of a payload, hashing it on threads threads.  A
+ * chunk that does not match goes to res->bad_offset and res->bad_size.
+ */
+static const char *chunk_check(const unsigned char *xbe, const struct payload_entry *entry,
+			       unsigned int table_end, unsigned int section_end,
+			       unsigned int threads, struct imagebld_result *res)
+{
+	struct chunk_range range;
+	unsigned char root[SHA1HashSize];
+	const unsigned char *table = xbe + entry->chunk_table;
+	unsigned int chunks, i;
+
+	if (entry->chunk_shift < PAYLOAD_CHUNK_SHIFT_MIN || entry->chunk_shift > PAYLOAD_CHUNK_SHIFT_MAX)
+		return "bad chunk size";
+	chunks = chunk_count(entry->size, entry->chunk_shift);
+	if (entry->chunk_table < table_end || entry->chunk_table > section_end ||
+	    (unsigned long long)chunks * SHA1HashSize > section_end - entry->chunk_table)
+		return "chunk digests outside the section";
+
+	chunk_root(table, chunks, root);
+	if (memcmp(root, entry->chunk_root, SHA1HashSize)) return "chunk root mismatch";
+
+	range.offset = entry->offset;
+	range.size = entry->size;
+	range.digests = malloc(chunks ? chunks * SHA1HashSize : 1);
+	if (range.digests == NULL) return "out of memory";
+	chunk_hash(-1, xbe, &range, 1, entry->chunk_shift, threads);
+	res->hashed += entry->size;
+
+	for (i = 0; i < chunks; i++)
+		if (memcmp(range.digests + i * SHA1HashSize, table + i * SHA1HashSize, SHA1HashSize))
+			break;
+	free(range.digests);
+	if (i == chunks) return NULL;
+
+	res->bad_offset = entry->offset + (i << entry->chunk_shift);
+	res->bad_size = entry->size - (i << entry->chunk_shift);
+	if (res->bad_size > 1U << entry->chunk_shift) res->bad_size = 1U << entry->chunk_shift;
+	return "payload chunk digest mismatch";
+}
+
+/*
+ * Checks an image: the headers and every section are inside the file, the
+ * payload directory and every payload are inside the payload section, or
+ * the sections behind it, and do not overlap, and the section hashes and
+ * the payload digests match.  The sections are hashed on threads threads.
+ * Payloads with chunk digests are checked chunk by chunk on threads
+ * threads, instead of by their digest.  Returns NULL if all is well, or
+ * what is wrong.  res->hashed is what had to be read for it.
+ */
+static const char *xbecheck(const unsigned char *xbe, unsigned int xbesize, unsigned int threads,
+			    struct imagebld_result *res)
+{
+	struct xbe x;
+	struct xbe_section sec;
+	struct payload_dir dir;
+	struct payload_entry entry, other;
+	unsigned char sha_Message_Digest[SHA1HashSize];
+	unsigned char *digests;
+	struct imagebld layout;
+	unsigned int section_start, section_end;
+	unsigned int first, used;
+	unsigned int i, k, s;
+	const char *bad;
+
+	bad = xbe_headers(&x, &s, &section_end, xbe, xbesize);
+	if (bad != NULL) return bad;
+	xbe_section(&x, s, &sec);
+
+	section_start = sec.file_address;
+
+	if (payload_dir_read(xbe, xbesize, &dir)) return "no payload directory";
+	if (dir.table < section_start || dir.table + dir.count * dir.entry_size > section_end)
+		return "entry table outside the section";
+
+	first = section_end;
+	used = dir.count * dir.entry_size;
+	for (i = 0; i < dir.count; i++) {
+		if (payload_entry_read(xbe, xbesize, &dir, i, &entry) ||
+		    entry.offset < section_start || payload_span(&entry) > section_end - entry.offset)
+			return "payload outside the section";
+		if (entry.offset < dir.table + dir.count * dir.entry_size &&
+		    entry.offset + payload_span(&entry) > dir.table)
+			return "payload overlaps the entry table";
+		if ((entry.flags & PAYLOAD_FLAG_RESIDENT) &&
+		    (entry.compression != PAYLOAD_COMP_NONE || (entry.offset & 0xfff)))
+			return "resident payload not stored in place";
+		if (entry.compression == PAYLOAD_COMP_NONE && entry.raw_size != entry.size)
+			return "payload size mismatch";
+		if (entry.load_size < entry.raw_size) return "payload bigger than its load size";
+		for (k = 0; k < i; k++) {
+			payload_entry_read(xbe, xbesize, &dir, k, &other);
+			if (entry.offset < other.offset + payload_span(&other) &&
+			    other.offset < entry.offset + payload_span(&entry))
+				return "payloads overlap";
+		}
+		if (entry.chunk_table) {
+			bad = chunk_check(xbe, &entry, dir.table + dir.count * dir.entry_size,
+					  section_end, threads, res);
+			if (bad != NULL) return bad;
+		} else if (entry.digest_type == PAYLOAD_DIGEST_SHA1) {
+			SHA1Context context;
+
+			SHA1Reset(&context);
+			SHA1Input(&context, xbe + entry.offset, entry.size);
+			SHA1Result(&context, sha_Message_Digest);
+			res->hashed += entry.size;
+			if (memcmp(sha_Message_Digest, entry.digest, SHA1HashSize))
+				return "payload digest mismatch";
+		}
+		if (entry.offset < first) first = entry.offset;
+		used += payload_span(&entry);
+		if (entry.chunk_table) used += chunk_count(entry.size, entry.chunk_shift) * SHA1HashSize;
+	}
+
+	// Built, the image size is the loader, the payloads, the entries and
+	// the chunk digests without the alignment in between.  Only how much
+	// the loader was aligned by is not known.
+	memset(&layout, 0, sizeof(layout));
+	layout.page_align = (dir.flags & PAYLOAD_DIR_PAGE_ALIGNED) != 0;
+	if (dir.count > 0 && (used > x.image_size || payload_align(&layout, x.image_size - used) != first))
+		return "image size does not match the layout";
+
+	digests = malloc(x.sections * SHA1HashSize);
+	if (digests == NULL || section_hashes(&x, digests, NULL, threads)) {
+		free(digests);
+		return "out of memory";
+	}
+	for (i = 0; i < x.sections; i++) {
+		xbe_section(&x, i, &sec);
+		res->hashed += sec.file_size;
+		if (memcmp(digests + i * SHA1HashSize, sec.digest, SHA1HashSize)) break;
+	}
+	free(digests);
+	if (i < x.sections) return "section hash mismatch";
+
+	return NULL;
+}
+
+int imagebld_verify(struct imagebld *ib, const char *xbeimage, struct imagebld_result *res,
+		    const char **status)
+{
+	struct payload_file f;
+	struct xbe x;
+	unsigned int s, end;
+	int stdin_taken = 0;
+
+	memset(res, 0, sizeof(*res));
+	if (payload_open(ib, &f, xbeimage, 0, &stdin_taken)) {
+		*status = "cannot read";
+		return 1;
+	}
+	*status = xbecheck(f.data, f.size, ib_threads(ib), res);
+	if (xbe_headers(&x, &s, &end, f.data, f.size) == NULL) result_read(&x, s, res);
+	res->image_size = f.size;
+	payload_close(&f);
+
+	return *status != NULL;
+}
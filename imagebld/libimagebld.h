@@ -0,0 +1,99 @@
+/*
+ *  libimagebld.h
+ *
+ *  imagebld as a library: builds, patches, extracts and verifies XBE
+ *  images in-process.  Everything a call needs comes in through its
+ *  struct imagebld, there is no global state, so calls on different
+ *  images can run on different threads at the same time.
+ *
+ *  The calls return 0 on success.  What the command line tool prints goes
+ *  to the log callback; the offsets, sizes and digests that were written
+ *  or found come back in a struct imagebld_result.
+ */
+
+#ifndef _LIBIMAGEBLD_H_
+#define _LIBIMAGEBLD_H_
+
+#include <stdarg.h>
+#include "../BootPayload.h"
+
+/* kernel, initrd and config */
+#define IMAGEBLD_MAX_PAYLOADS	3
+
+#define IMAGEBLD_HASH_SIZE	20
+
+struct imagebld_io {
+	void *arg;
+	/*
+	 * Opens a file like open(2), every image and payload goes through
+	 * here.  NULL is open(2) itself.  "-" is stdin and does not.
+	 */
+	int (*open)(void *arg, const char *name, int flags, int mode);
+	/* Progress and error messages, NULL keeps quiet */
+	void (*log)(void *arg, const char *fmt, va_list ap);
+};
+
+struct imagebld {
+	unsigned int threads;	/* worker threads, 0 is taken as 1 */
+	int compress;		/* store kernel and initrd as LZ4 frames */
+	int page_align;		/* payloads on 4 KB pages, PAYLOAD_FLAG_RESIDENT */
+	int sections;		/* every payload in an XBE section of its own */
+	const char *output;	/* build into this, not into the loader in place */
+	const char *cache;	/* build cache, with output only */
+	const char *store;	/* payload store directory, see store.h */
+	struct imagebld_io io;
+};
+
+struct imagebld_result {
+	unsigned int image_size;	/* of the file */
+	unsigned int section_size;	/* FileSize of the section */
+	unsigned char section_hash[IMAGEBLD_HASH_SIZE];
+	unsigned long long hashed;	/* bytes imagebld_verify() read */
+	unsigned int bad_offset;	/* the chunk imagebld_verify() found bad, */
+	unsigned int bad_size;		/* 0 if it is not down to one */
+	unsigned int count;		/* entries below, the first ones of the table */
+	struct payload_entry entries[IMAGEBLD_MAX_PAYLOADS];
+};
+
+void imagebld_init(struct imagebld *ib);
+
+/*
+ * Links the payloads into the loader xbe, in place.  With ib->sections
+ * the loader section is followed by one section per payload and one for
+ * the entry table, hashed on ib->threads threads.  With ib->store the
+ * payloads are copied in from the store, and added to it first if they
+ * are not in there yet.
+ */
+int imagebld_build(struct imagebld *ib, const char *xbe, const char *kernel,
+		   const char *initrd, const char *config, struct imagebld_result *res);
+
+/* Builds an image per "xbe initrd config" line of manifest */
+int imagebld_batch(struct imagebld *ib, const char *loader, const char *kernel,
+		   const char *manifest);
+
+/* Swaps the payload of type (PAYLOAD_KERNEL, ...) in a built image */
+int imagebld_replace(struct imagebld *ib, const char *xbe, unsigned int type,
+		     const char *file, struct imagebld_result *res);
+
+/* Reads the headers and the payload directory of an image */
+int imagebld_list(struct imagebld *ib, const char *xbe, struct imagebld_result *res);
+
+/* Writes the payload of type to out as it is stored, and its entry to *entry */
+int imagebld_extract(struct imagebld *ib, const char *xbe, unsigned int type, int out,
+		     struct payload_entry *entry);
+
+/*
+ * Writes an ISO 9660/UDF disc image with the files in its root directory,
+ * laid out in the order they are named.  "-" as iso is stdout.
+ */
+int imagebld_iso(struct imagebld *ib, const char *iso, const char **files, unsigned int count);
+
+/*
+ * Checks the layout, the section hash and the payload digests of an
+ * image, chunked payloads on ib->threads threads.  *status is NULL if all
+ * is well, or what is wrong.
+ */
+int imagebld_verify(struct imagebld *ib, const char *xbe, struct imagebld_result *res,
+		    const char **status);
+
+#endif /* _LIBIMAGEBLD_H_ */
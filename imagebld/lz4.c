@@ -0,0 +1,225 @@
+/*
+ *  lz4.c
+ *
+ *  Description:
+ *      A small greedy LZ4 block compressor and the bits of the LZ4 frame
+ *      format imagebld needs.  The output is the standard format, frames
+ *      written by imagebld can be checked with "lz4 -d".
+ *
+ *      Compression speed matters more than ratio here, the payloads are
+ *      usually already compressed kernels and cpio.gz images; blocks that
+ *      do not shrink are stored as they are by the caller.
+ */
+
+#include <string.h>
+#include "lz4.h"
+
+#define MINMATCH	4
+#define LASTLITERALS	5	/* the last 5 bytes of a block are literals */
+#define MFLIMIT		12	/* and no match starts in the last 12 */
+#define MAX_DISTANCE	65535
+#define HASH_LOG	14
+
+static unsigned int read32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+/* Frame fields are little endian whatever the host is */
+void lz4_write32(unsigned char *p, unsigned int v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static unsigned int hash4(const unsigned char *p)
+{
+	return (read32(p) * 2654435761U) >> (32 - HASH_LOG);
+}
+
+static unsigned char *put_length(unsigned char *op, unsigned int len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+/*
+ *  lz4_compress_block
+ *
+ *  Description:
+ *      Compresses srclen bytes into a single LZ4 block.
+ *
+ *  Returns:
+ *      The compressed size, or 0 if it does not fit into dstlen bytes.
+ *
+ */
+unsigned int lz4_compress_block(const unsigned char *src, unsigned int srclen,
+				unsigned char *dst, unsigned int dstlen)
+{
+	unsigned int table[1 << HASH_LOG];
+	unsigned char *op = dst;
+	unsigned char *oend = dst + dstlen;
+	unsigned char *token;
+	unsigned int ip = 0, anchor = 0, ref, h;
+	unsigned int litlen, matchlen;
+	unsigned int misses = 0;
+
+	memset(table, 0, sizeof(table));
+
+	while (srclen > MFLIMIT && ip < srclen - MFLIMIT) {
+		h = hash4(src + ip);
+		ref = table[h];
+		table[h] = ip;
+
+		if (ref >= ip || ip - ref > MAX_DISTANCE ||
+		    read32(src + ref) != read32(src + ip)) {
+			// Skip ahead faster the longer nothing matches
+			ip += 1 + (misses++ >> 6);
+			continue;
+		}
+		misses = 0;
+
+		matchlen = MINMATCH;
+		while (ip + matchlen < srclen - LASTLITERALS &&
+		       src[ref + matchlen] == src[ip + matchlen])
+			matchlen++;
+		while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+			ip--;
+			ref--;
+			matchlen++;
+		}
+
+		litlen = ip - anchor;
+		if (op + 1 + litlen / 255 + 1 + litlen + 2 + matchlen / 255 + 1 > oend)
+			return 0;
+
+		token = op++;
+		if (litlen >= 15) {
+			*token = 15 << 4;
+			op = put_length(op, litlen - 15);
+		} else {
+			*token = litlen << 4;
+		}
+		memcpy(op, src + anchor, litlen);
+		op += litlen;
+
+		*op++ = ip - ref;
+		*op++ = (ip - ref) >> 8;
+
+		if (matchlen - MINMATCH >= 15) {
+			*token |= 15;
+			op = put_length(op, matchlen - MINMATCH - 15);
+		} else {
+			*token |= matchlen - MINMATCH;
+		}
+
+		ip += matchlen;
+		anchor = ip;
+		if (ip < srclen - MFLIMIT)
+			table[hash4(src + ip - 2)] = ip - 2;
+	}
+
+	litlen = srclen - anchor;
+	if (op + 1 + litlen / 255 + 1 + litlen > oend)
+		return 0;
+
+	token = op++;
+	if (litlen >= 15) {
+		*token = 15 << 4;
+		op = put_length(op, litlen - 15);
+	} else {
+		*token = litlen << 4;
+	}
+	memcpy(op, src + anchor, litlen);
+	op += litlen;
+
+	return op - dst;
+}
+
+/*
+ *  lz4_frame_header
+ *
+ *  Description:
+ *      Builds the header of a frame of independent blocks that records
+ *      the decompressed size, the loader sizes its buffer from it.
+ *
+ *  Returns:
+ *      The header size, LZ4_FRAME_HEADER_SIZE.
+ *
+ */
+unsigned int lz4_frame_header(unsigned char *hdr, unsigned long long content_size)
+{
+	lz4_write32(hdr, LZ4_FRAME_MAGIC);
+	hdr[4] = LZ4_FLG_VERSION | LZ4_FLG_BLOCK_INDEP | LZ4_FLG_CONTENT_SIZE;
+	hdr[5] = LZ4_BLOCK_SIZE_ID << 4;
+	lz4_write32(hdr + 6, content_size);
+	lz4_write32(hdr + 10, content_size >> 32);
+	// Header checksum: second byte of the xxh32 of the descriptor
+	hdr[14] = xxh32(hdr + 4, 10, 0) >> 8;
+
+	return LZ4_FRAME_HEADER_SIZE;
+}
+
+/*
+ *  xxh32
+ *
+ *  Description:
+ *      xxHash32, the frame header checksum of the LZ4 frame format.
+ *
+ */
+#define PRIME32_1	2654435761U
+#define PRIME32_2	2246822519U
+#define PRIME32_3	3266489917U
+#define PRIME32_4	 668265263U
+#define PRIME32_5	 374761393U
+
+#define XXH_rotl32(x,r)	(((x) << (r)) | ((x) >> (32 - (r))))
+
+unsigned int xxh32(const unsigned char *p, unsigned int len, unsigned int seed)
+{
+	const unsigned char *end = p + len;
+	unsigned int v1, v2, v3, v4, h;
+
+	if (len >= 16) {
+		v1 = seed + PRIME32_1 + PRIME32_2;
+		v2 = seed + PRIME32_2;
+		v3 = seed;
+		v4 = seed - PRIME32_1;
+		do {
+			v1 = XXH_rotl32(v1 + read32(p) * PRIME32_2, 13) * PRIME32_1; p += 4;
+			v2 = XXH_rotl32(v2 + read32(p) * PRIME32_2, 13) * PRIME32_1; p += 4;
+			v3 = XXH_rotl32(v3 + read32(p) * PRIME32_2, 13) * PRIME32_1; p += 4;
+			v4 = XXH_rotl32(v4 + read32(p) * PRIME32_2, 13) * PRIME32_1; p += 4;
+		} while (p + 16 <= end);
+		h = XXH_rotl32(v1, 1) + XXH_rotl32(v2, 7) + XXH_rotl32(v3, 12) + XXH_rotl32(v4, 18);
+	} else {
+		h = seed + PRIME32_5;
+	}
+
+	h += len;
+
+	while (p + 4 <= end) {
+		h += read32(p) * PRIME32_3;
+		h = XXH_rotl32(h, 17) * PRIME32_4;
+		p += 4;
+	}
+	while (p < end) {
+		h += *p * PRIME32_5;
+		h = XXH_rotl32(h, 11) * PRIME32_1;
+		p++;
+	}
+
+	h ^= h >> 15;
+	h *= PRIME32_2;
+	h ^= h >> 13;
+	h *= PRIME32_3;
+	h ^= h >> 16;
+
+	return h;
+}
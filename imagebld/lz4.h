@@ -0,0 +1,33 @@
+/*
+ *  lz4.h
+ *
+ *  LZ4 block compressor and frame helpers for imagebld.  The matching
+ *  decoder is BootLZ4.c in the loader.
+ */
+
+#ifndef _LZ4_H_
+#define _LZ4_H_
+
+#include "../BootLZ4.h"
+
+/*
+ * Uncompressed bytes per frame block; BD code 6 = 1 MB.  Blocks are
+ * compressed independently, so this is also the unit of work for the
+ * compression threads.
+ */
+#define LZ4_BLOCK_SIZE		(1024*1024)
+#define LZ4_BLOCK_SIZE_ID	6
+
+/* Worst case size of a compressed block */
+#define LZ4_COMPRESSBOUND(n)	((n) + (n)/255 + 16)
+
+/* magic, FLG, BD, content size, header checksum */
+#define LZ4_FRAME_HEADER_SIZE	15
+
+unsigned int lz4_compress_block(const unsigned char *src, unsigned int srclen,
+				unsigned char *dst, unsigned int dstlen);
+void lz4_write32(unsigned char *p, unsigned int v);
+unsigned int lz4_frame_header(unsigned char *hdr, unsigned long long content_size);
+unsigned int xxh32(const unsigned char *p, unsigned int len, unsigned int seed);
+
+#endif /* _LZ4_H_ */
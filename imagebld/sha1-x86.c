@@ -0,0 +1,232 @@
+/*
+ *  sha1-x86.c
+ *
+ *  Description:
+ *      SHA-1 block functions for x86 CPUs, picked at run time by
+ *      SHA1SelectBlocks() from what CPUID reports:
+ *
+ *        shani  - the SHA extensions (sha1rnds4 and friends)
+ *        ssse3  - message schedule and W+K four words at a time in SSE
+ *                 registers, the rounds themselves stay scalar
+ *        ref    - SHA1ProcessBlocksRef() in sha1.c
+ *
+ *      The functions are compiled with target attributes, so no special
+ *      compiler flags are needed and the rest of imagebld still runs on
+ *      any x86 CPU.  IMAGEBLD_SHA1=ref|ssse3|shani in the environment
+ *      forces one of them (if the CPU has it), to compare or to rule
+ *      them out.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "sha1.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define SHA1CircularShift(bits,word) \
+                (((word) << (bits)) | ((word) >> (32-(bits))))
+
+/*
+ *  SHA-NI: four rounds per sha1rnds4, the schedule in sha1msg1/sha1msg2.
+ *  Rounds 12 to 67 all look the same, four message registers rotate
+ *  through them.
+ */
+#define SHA1_NI_ROUNDS(ea, eb, m0, m1, m2, m3, f) \
+	ea = _mm_sha1nexte_epu32(ea, m0); \
+	eb = abcd; \
+	m1 = _mm_sha1msg2_epu32(m1, m0); \
+	abcd = _mm_sha1rnds4_epu32(abcd, ea, f); \
+	m3 = _mm_sha1msg1_epu32(m3, m0); \
+	m2 = _mm_xor_si128(m2, m0)
+
+__attribute__((target("sha,sse4.1")))
+static void SHA1ProcessBlocksShaNi(uint32_t *H, const uint8_t *data, unsigned int blocks)
+{
+	const __m128i swap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	__m128i abcd, abcd_save, e0, e0_save, e1;
+	__m128i m0, m1, m2, m3;
+
+	abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)H), 0x1b);
+	e0 = _mm_set_epi32(H[4], 0, 0, 0);
+
+	while (blocks--) {
+		abcd_save = abcd;
+		e0_save = e0;
+
+		/* rounds 0-11, the message words come in */
+		m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 0)), swap);
+		e0 = _mm_add_epi32(e0, m0);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+		m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), swap);
+		e1 = _mm_sha1nexte_epu32(e1, m1);
+		e0 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+		m0 = _mm_sha1msg1_epu32(m0, m1);
+
+		m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), swap);
+		e0 = _mm_sha1nexte_epu32(e0, m2);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+		m1 = _mm_sha1msg1_epu32(m1, m2);
+		m0 = _mm_xor_si128(m0, m2);
+
+		m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), swap);
+
+		/* rounds 12-67 */
+		SHA1_NI_ROUNDS(e1, e0, m3, m0, m1, m2, 0);
+		SHA1_NI_ROUNDS(e0, e1, m0, m1, m2, m3, 0);
+		SHA1_NI_ROUNDS(e1, e0, m1, m2, m3, m0, 1);
+		SHA1_NI_ROUNDS(e0, e1, m2, m3, m0, m1, 1);
+		SHA1_NI_ROUNDS(e1, e0, m3, m0, m1, m2, 1);
+		SHA1_NI_ROUNDS(e0, e1, m0, m1, m2, m3, 1);
+		SHA1_NI_ROUNDS(e1, e0, m1, m2, m3, m0, 1);
+		SHA1_NI_ROUNDS(e0, e1, m2, m3, m0, m1, 2);
+		SHA1_NI_ROUNDS(e1, e0, m3, m0, m1, m2, 2);
+		SHA1_NI_ROUNDS(e0, e1, m0, m1, m2, m3, 2);
+		SHA1_NI_ROUNDS(e1, e0, m1, m2, m3, m0, 2);
+		SHA1_NI_ROUNDS(e0, e1, m2, m3, m0, m1, 2);
+		SHA1_NI_ROUNDS(e1, e0, m3, m0, m1, m2, 3);
+		SHA1_NI_ROUNDS(e0, e1, m0, m1, m2, m3, 3);
+
+		/* rounds 68-79, the schedule runs out */
+		e1 = _mm_sha1nexte_epu32(e1, m1);
+		e0 = abcd;
+		m2 = _mm_sha1msg2_epu32(m2, m1);
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+		m3 = _mm_xor_si128(m3, m1);
+
+		e0 = _mm_sha1nexte_epu32(e0, m2);
+		e1 = abcd;
+		m3 = _mm_sha1msg2_epu32(m3, m2);
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+		e1 = _mm_sha1nexte_epu32(e1, m3);
+		e0 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+		e0 = _mm_sha1nexte_epu32(e0, e0_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+
+		data += 64;
+	}
+
+	_mm_storeu_si128((__m128i *)H, _mm_shuffle_epi32(abcd, 0x1b));
+	H[4] = _mm_extract_epi32(e0, 3);
+}
+
+/*
+ *  SSSE3: W[t] for four t at a time.  W[t+3] needs W[t] from the same
+ *  group, so it is computed with that term left out and patched in
+ *  afterwards: rol1(x ^ rol1(y)) = rol1(x) ^ rol2(y).
+ */
+#define SHA1_SSE_ROL(x, n) \
+	_mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - (n)))
+
+#define SHA1_ROUND(f, t) \
+	temp = SHA1CircularShift(5,A) + (f) + E + WK[t]; \
+	E = D; \
+	D = C; \
+	C = SHA1CircularShift(30,B); \
+	B = A; \
+	A = temp
+
+__attribute__((target("ssse3")))
+static void SHA1ProcessBlocksSsse3(uint32_t *H, const uint8_t *data, unsigned int blocks)
+{
+	const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	uint32_t W[80] __attribute__((aligned(16)));
+	uint32_t WK[80] __attribute__((aligned(16)));
+	uint32_t A, B, C, D, E, temp;
+	__m128i w, x;
+	int t;
+
+	while (blocks--) {
+		for (t = 0; t < 16; t += 4) {
+			w = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + t * 4)), swap);
+			_mm_store_si128((__m128i *)&W[t], w);
+		}
+		for (t = 16; t < 80; t += 4) {
+			x = _mm_srli_si128(_mm_loadu_si128((const __m128i *)&W[t - 4]), 4);
+			x = _mm_xor_si128(x, _mm_load_si128((const __m128i *)&W[t - 8]));
+			x = _mm_xor_si128(x, _mm_loadu_si128((const __m128i *)&W[t - 14]));
+			x = _mm_xor_si128(x, _mm_load_si128((const __m128i *)&W[t - 16]));
+			w = SHA1_SSE_ROL(x, 1);
+			x = _mm_slli_si128(x, 12);
+			w = _mm_xor_si128(w, SHA1_SSE_ROL(x, 2));
+			_mm_store_si128((__m128i *)&W[t], w);
+		}
+		for (t = 0; t < 80; t += 4) {
+			w = _mm_load_si128((const __m128i *)&W[t]);
+			w = _mm_add_epi32(w, _mm_set1_epi32(t < 20 ? 0x5A827999 :
+							     t < 40 ? 0x6ED9EBA1 :
+							     t < 60 ? 0x8F1BBCDC : 0xCA62C1D6));
+			_mm_store_si128((__m128i *)&WK[t], w);
+		}
+
+		A = H[0];
+		B = H[1];
+		C = H[2];
+		D = H[3];
+		E = H[4];
+
+		for (t = 0; t < 20; t++) {
+			SHA1_ROUND((B & C) | ((~B) & D), t);
+		}
+		for (t = 20; t < 40; t++) {
+			SHA1_ROUND(B ^ C ^ D, t);
+		}
+		for (t = 40; t < 60; t++) {
+			SHA1_ROUND((B & C) | (B & D) | (C & D), t);
+		}
+		for (t = 60; t < 80; t++) {
+			SHA1_ROUND(B ^ C ^ D, t);
+		}
+
+		H[0] += A;
+		H[1] += B;
+		H[2] += C;
+		H[3] += D;
+		H[4] += E;
+
+		data += 64;
+	}
+}
+
+SHA1BlockFunc SHA1SelectBlocks(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	int ssse3 = 0, shani = 0, sse41 = 0;
+	const char *force = getenv("IMAGEBLD_SHA1");
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+		ssse3 = (ecx & bit_SSSE3) != 0;
+		sse41 = (ecx & bit_SSE4_1) != 0;
+	}
+	if (__get_cpuid_max(0, NULL) >= 7) {
+		__cpuid_count(7, 0, eax, ebx, ecx, edx);
+		shani = (ebx & bit_SHA) != 0 && ssse3 && sse41;
+	}
+
+	if (force != NULL) {
+		if (!strcmp(force, "ref")) return SHA1ProcessBlocksRef;
+		if (!strcmp(force, "ssse3")) shani = 0;
+	}
+
+	if (shani) return SHA1ProcessBlocksShaNi;
+	if (ssse3) return SHA1ProcessBlocksSsse3;
+	return SHA1ProcessBlocksRef;
+}
+
+#else
+
+SHA1BlockFunc SHA1SelectBlocks(void)
+{
+	return SHA1ProcessBlocksRef;
+}
+
+#endif
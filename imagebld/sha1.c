@@ -30,6 +30,11 @@
  *
  *  2002-09-13  franz@caos.at   Mods to Reset functions to use fixed states for avoiding keys
  *  2002-09-18  franz@caos.at   Some minor cleanup and creating a single SMAC_SHA1_calculation() routine
+ *
+ *  Whole 64 byte blocks of input are handed to the block function
+ *  straight from the caller's buffer, only the ragged ends go through
+ *  Message_Block.  The block function is chosen on the first
+ *  SHA1Reset(), see sha1-x86.c.
  */
 
 
@@ -43,6 +48,8 @@
                 (((word) << (bits)) | ((word) >> (32-(bits))))
 /* Local Function Prototyptes */ void SHA1PadMessage(SHA1Context *); void SHA1ProcessMessageBlock(SHA1Context *); 
 
+static SHA1BlockFunc SHA1Blocks;
+
 /*
  *  SHA1Reset
  *
@@ -67,6 +74,12 @@ int SHA1Reset(SHA1Context *context)
         return shaNull;
     }
 
+    /* every thread picks the same one, racing here is harmless */
+    if (!SHA1Blocks)
+    {
+        SHA1Blocks = SHA1SelectBlocks();
+    }
+
     context->Length_Low             = 0;
     context->Length_High            = 0;
     context->Message_Block_Index    = 0;
@@ -185,6 +198,59 @@ int SHA1Input(    SHA1Context    *context,
     {
          return context->Corrupted;
     }
+
+    /* Top up a partly filled block first */
+    while(length && context->Message_Block_Index && !context->Corrupted)
+    {
+        context->Message_Block[context->Message_Block_Index++] =
+                        (*message_array & 0xFF);
+
+        context->Length_Low += 8;
+        if (context->Length_Low == 0)
+        {
+            context->Length_High++;
+            if (context->Length_High == 0)
+            {
+                /* Message is too long */
+                context->Corrupted = 1;
+            }
+        }
+
+        if (context->Message_Block_Index == 64)
+        {
+            SHA1ProcessMessageBlock(context);
+        }
+
+        message_array++;
+        length--;
+    }
+
+    /* Whole blocks need no copying */
+    if (length >= 64 && !context->Corrupted)
+    {
+        unsigned blocks = length / 64;
+        uint32_t bits_low = blocks << 9;
+        uint32_t bits_high = blocks >> 23;
+
+        context->Length_Low += bits_low;
+        if (context->Length_Low < bits_low)
+        {
+            bits_high++;
+        }
+        context->Length_High += bits_high;
+        if (context->Length_High < bits_high)
+        {
+            /* Message is too long */
+            context->Corrupted = 1;
+            return shaSuccess;
+        }
+
+        SHA1Blocks(context->Intermediate_Hash, message_array, blocks);
+        message_array += blocks * 64;
+        length -= blocks * 64;
+    }
+
+    /* and keep the rest for later */
     while(length-- && !context->Corrupted)
     {
     context->Message_Block[context->Message_Block_Index++] =
@@ -225,6 +291,21 @@ int SHA1Input(    SHA1Context    *context,
  *  Returns:
  *      Nothing.
  *
+ */
+void SHA1ProcessMessageBlock(SHA1Context *context)
+{
+    SHA1Blocks(context->Intermediate_Hash, context->Message_Block, 1);
+
+    context->Message_Block_Index = 0;
+}
+
+/*
+ *  SHA1ProcessBlocksRef
+ *
+ *  Description:
+ *      The reference block function, processes blocks * 512 bits of
+ *      data into the intermediate hash H.
+ *
  *  Comments:
 
  *      Many of the variable names in this code, especially the
@@ -233,7 +314,7 @@ int SHA1Input(    SHA1Context    *context,
  *
  *
  */
-void SHA1ProcessMessageBlock(SHA1Context *context)
+void SHA1ProcessBlocksRef(uint32_t *H, const uint8_t *data, unsigned int blocks)
 {
     const uint32_t K[] =    {       /* Constants defined in SHA-1   */
                             0x5A827999,
@@ -246,82 +327,80 @@ void SHA1ProcessMessageBlock(SHA1Context *context)
     uint32_t      W[80];             /* Word sequence               */
     uint32_t      A, B, C, D, E;     /* Word buffers                */
 
-    /*
-     *  Initialize the first 16 words in the array W
-     */
-    for(t = 0; t < 16; t++)
+    for(; blocks; blocks--, data += 64)
     {
-        W[t] = context->Message_Block[t * 4] << 24;
-        W[t] |= context->Message_Block[t * 4 + 1] << 16;
-        W[t] |= context->Message_Block[t * 4 + 2] << 8;
-        W[t] |= context->Message_Block[t * 4 + 3];
-    }
-
-
-    for(t = 16; t < 80; t++)
-    {
-       W[t] = SHA1CircularShift(1,W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16]);
-    }
-
-    A = context->Intermediate_Hash[0];
-    B = context->Intermediate_Hash[1];
-    C = context->Intermediate_Hash[2];
-    D = context->Intermediate_Hash[3];
-    E = context->Intermediate_Hash[4];
-
-    for(t = 0; t < 20; t++)
-    {
-        temp =  SHA1CircularShift(5,A) +
-                ((B & C) | ((~B) & D)) + E + W[t] + K[0];
-        E = D;
-        D = C;
-        C = SHA1CircularShift(30,B);
-
-        B = A;
-        A = temp;
-    }
+        /*
+         *  Initialize the first 16 words in the array W
+         */
+        for(t = 0; t < 16; t++)
+        {
+            W[t] = data[t * 4] << 24;
+            W[t] |= data[t * 4 + 1] << 16;
+            W[t] |= data[t * 4 + 2] << 8;
+            W[t] |= data[t * 4 + 3];
+        }
 
-    for(t = 20; t < 40; t++)
-    {
-        temp = SHA1CircularShift(5,A) + (B ^ C ^ D) + E + W[t] + K[1];
-        E = D;
-        D = C;
-        C = SHA1CircularShift(30,B);
-        B = A;
-        A = temp;
-    }
 
-    for(t = 40; t < 60; t++)
-    {
-        temp = SHA1CircularShift(5,A) +
-               ((B & C) | (B & D) | (C & D)) + E + W[t] + K[2];
-        E = D;
-        D = C;
-        C = SHA1CircularShift(30,B);
-        B = A;
-        A = temp;
-    }
+        for(t = 16; t < 80; t++)
+        {
+           W[t] = SHA1CircularShift(1,W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16]);
+        }
 
-    for(t = 60; t < 80; t++)
-    {
-        temp = SHA1CircularShift(5,A) + (B ^ C ^ D) + E + W[t] + K[3];
-        E = D;
-        D = C;
-        C = SHA1CircularShift(30,B);
-        B = A;
-        A = temp;
-    }
+        A = H[0];
+        B = H[1];
+        C = H[2];
+        D = H[3];
+        E = H[4];
 
-    context->Intermediate_Hash[0] += A;
-    context->Intermediate_Hash[1] += B;
-    context->Intermediate_Hash[2] += C;
-    context->Intermediate_Hash[3] += D;
-    context->Intermediate_Hash[4] += E;
+        for(t = 0; t < 20; t++)
+        {
+            temp =  SHA1CircularShift(5,A) +
+                    ((B & C) | ((~B) & D)) + E + W[t] + K[0];
+            E = D;
+            D = C;
+            C = SHA1CircularShift(30,B);
+
+            B = A;
+            A = temp;
+        }
 
-    context->Message_Block_Index = 0;  
+        for(t = 20; t < 40; t++)
+        {
+            temp = SHA1CircularShift(5,A) + (B ^ C ^ D) + E + W[t] + K[1];
+            E = D;
+            D = C;
+            C = SHA1CircularShift(30,B);
+            B = A;
+            A = temp;
+        }
 
+        for(t = 40; t < 60; t++)
+        {
+            temp = SHA1CircularShift(5,A) +
+                   ((B & C) | (B & D) | (C & D)) + E + W[t] + K[2];
+            E = D;
+            D = C;
+            C = SHA1CircularShift(30,B);
+            B = A;
+            A = temp;
+        }
 
+        for(t = 60; t < 80; t++)
+        {
+            temp = SHA1CircularShift(5,A) + (B ^ C ^ D) + E + W[t] + K[3];
+            E = D;
+            D = C;
+            C = SHA1CircularShift(30,B);
+            B = A;
+            A = temp;
+        }
 
+        H[0] += A;
+        H[1] += B;
+        H[2] += C;
+        H[3] += D;
+        H[4] += E;
+    }
 }
 
 /*
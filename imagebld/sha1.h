@@ -70,5 +70,15 @@ int SHA1Input(  SHA1Context *,
 int SHA1Result( SHA1Context *,
                 uint8_t Message_Digest[SHA1HashSize]);
 
+/*
+ *  Block functions: process blocks * 64 bytes of data into the
+ *  intermediate hash H.  The reference one is in sha1.c, the faster ones
+ *  for x86 in sha1-x86.c; SHA1SelectBlocks() picks one for this CPU.
+ */
+typedef void (*SHA1BlockFunc)(uint32_t *H, const uint8_t *data, unsigned int blocks);
+
+void SHA1ProcessBlocksRef(uint32_t *H, const uint8_t *data, unsigned int blocks);
+SHA1BlockFunc SHA1SelectBlocks(void);
+
 
 #endif /* _SHA1_H_ */
@@ -0,0 +1,83 @@
+/*
+ *  store.c
+ *
+ *  Description:
+ *      Names, meta files and copies of the blobs in the payload store.
+ *      Images built from the store share the blocks of its blobs on
+ *      filesystems that reflink (btrfs, XFS); elsewhere copy_file_range
+ *      still keeps the copy in the kernel.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include "store.h"
+
+void store_name(char *name, const unsigned char *digest, unsigned int type, const char *form)
+{
+	unsigned int i;
+
+	for (i = 0; i < SHA1HashSize; i++) sprintf(name + i * 2, "%02x", digest[i]);
+	snprintf(name + SHA1HashSize * 2, STORE_NAME_SIZE - SHA1HashSize * 2, ".%u.%s", type, form);
+}
+
+int store_meta_read(int fd, struct store_meta *m, unsigned char **chunks)
+{
+	unsigned int size;
+
+	*chunks = NULL;
+	if (pread(fd, m, sizeof(*m), 0) != sizeof(*m)) return 1;
+	if (m->magic != STORE_MAGIC || m->version != STORE_VERSION) return 1;
+	if (m->chunks > m->span / 512 + 1) return 1;
+
+	size = m->chunks * SHA1HashSize;
+	*chunks = malloc(size ? size : 1);
+	if (*chunks == NULL) return 1;
+	if (pread(fd, *chunks, size, sizeof(*m)) != size) {
+		free(*chunks);
+		*chunks = NULL;
+		return 1;
+	}
+	return 0;
+}
+
+int store_meta_write(int fd, const struct store_meta *m, const unsigned char *chunks)
+{
+	unsigned int size = m->chunks * SHA1HashSize;
+
+	if (pwrite(fd, m, sizeof(*m), 0) != sizeof(*m)) return 1;
+	if (pwrite(fd, chunks, size, sizeof(*m)) != size) return 1;
+	return 0;
+}
+
+int store_copy(int blob, int out, unsigned int offset, unsigned int len)
+{
+	struct file_clone_range clone;
+	unsigned char buf[0x10000];
+	loff_t in_ofs = 0, out_ofs = offset;
+	ssize_t n;
+
+	// The whole blob, so its tail need not be on a block boundary
+	clone.src_fd = blob;
+	clone.src_offset = 0;
+	clone.src_length = 0;
+	clone.dest_offset = offset;
+	if (len && ioctl(out, FICLONERANGE, &clone) == 0) return 0;
+
+	while (len) {
+		n = copy_file_range(blob, &in_ofs, out, &out_ofs, len, 0);
+		if (n <= 0) {
+			n = pread(blob, buf, len < sizeof(buf) ? len : sizeof(buf), in_ofs);
+			if (n <= 0 || pwrite(out, buf, n, out_ofs) != n) return 1;
+			in_ofs += n;
+			out_ofs += n;
+		}
+		len -= n;
+	}
+	return 0;
+}
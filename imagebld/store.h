@@ -0,0 +1,49 @@
+/*
+ *  store.h
+ *
+ *  The payload store of imagebld -build -store: payloads kept once per
+ *  content in a directory, the way they go into an image, and shared by
+ *  every image built from them.  A blob is named after the SHA-1 of the
+ *  input, its payload type and how it is stored.  Next to it, in
+ *  name.meta, is what would otherwise have to be hashed again: the entry
+ *  with the payload digest, the chunk digests and the hash of the blob as
+ *  an XBE section of its own.  Blobs are local files, the meta is in host
+ *  byte order.
+ */
+
+#ifndef _STORE_H_
+#define _STORE_H_
+
+#include "sha1.h"
+#include "../BootPayload.h"
+
+#define STORE_MAGIC		0x53424958	/* "XIBS" */
+#define STORE_VERSION		1
+
+/* 40 hex digits, ".", type, ".", form and the 0 */
+#define STORE_NAME_SIZE		64
+
+struct store_meta {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int span;		/* bytes of the blob, padding included */
+	unsigned int chunks;		/* chunk digests behind the meta */
+	struct payload_entry entry;	/* offset and chunk_table are 0 */
+	unsigned char section_digest[SHA1HashSize];
+};
+
+/* The blob name for an input digest, form is "raw", "page" or "lz4" */
+void store_name(char *name, const unsigned char *digest, unsigned int type, const char *form);
+
+/* Reads the meta and its chunk digests into *chunks, which is malloc'd */
+int store_meta_read(int fd, struct store_meta *m, unsigned char **chunks);
+int store_meta_write(int fd, const struct store_meta *m, const unsigned char *chunks);
+
+/*
+ * Puts len bytes of a blob at offset in out, as a reflink where the
+ * filesystem can (offset on a block boundary), else with copy_file_range
+ * or a plain copy.
+ */
+int store_copy(int blob, int out, unsigned int offset, unsigned int len);
+
+#endif /* _STORE_H_ */
@@ -0,0 +1,301 @@
+/*
+ *  xbe.c
+ *
+ *  Description:
+ *      The XBE headers, read and written a field at a time at their file
+ *      offsets, so the layout of host structures and the byte order of
+ *      the host do not come into it.  Addresses in the headers are
+ *      virtual; everything is checked to be inside the file before it is
+ *      turned into a file offset.
+ */
+
+#include <string.h>
+#include "xbe.h"
+
+/* Image header fields */
+#define XBE_BASE_ADDRESS	0x104
+#define XBE_HEADER_SIZE		0x108
+#define XBE_XBE_HEADER_SIZE	0x110
+#define XBE_CERTIFICATE		0x118
+#define XBE_NUM_SECTIONS	0x11c
+#define XBE_SECTIONS		0x120
+#define XBE_ENTRY_POINT		0x128
+#define XBE_TLS_DIRECTORY	0x12c
+
+/* Section header fields */
+#define SEC_FLAGS		0x00
+#define SEC_VIRTUAL_ADDRESS	0x04
+#define SEC_VIRTUAL_SIZE	0x08
+#define SEC_FILE_ADDRESS	0x0c
+#define SEC_FILE_SIZE		0x10
+#define SEC_NAME		0x14
+#define SEC_REFERENCE_COUNT	0x18
+#define SEC_HEAD_REFERENCE	0x1c
+#define SEC_TAIL_REFERENCE	0x20
+#define SEC_DIGEST		0x24
+
+/* Certificate fields, up to the game region */
+#define CERT_SIZE		0x00
+#define CERT_TITLE_ID		0x08
+#define CERT_MEDIA_TYPES	0x9c
+#define CERT_GAME_REGION	0xa0
+#define CERT_MIN_SIZE		0xa4
+
+#define TLS_SIZE		0x18
+
+static unsigned int rd32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+static void wr32(unsigned char *p, unsigned int v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/* File offset of len bytes of the headers at va, 0 if they are not in there */
+static unsigned int xbe_in_headers(const struct xbe *x, unsigned int va, unsigned int len)
+{
+	if (va < x->base || va - x->base > x->header_size || len > x->header_size - (va - x->base))
+		return 0;
+	return va - x->base;
+}
+
+static unsigned int section_header(const struct xbe *x, unsigned int i)
+{
+	return x->section_headers + i * XBE_SECTION_HEADER_SIZE;
+}
+
+static const char *section_check(const struct xbe *x, unsigned int i)
+{
+	const unsigned char *h = x->data + section_header(x, i);
+	unsigned int file_address = rd32(h + SEC_FILE_ADDRESS);
+	unsigned int file_size = rd32(h + SEC_FILE_SIZE);
+	unsigned int va = rd32(h + SEC_VIRTUAL_ADDRESS);
+	unsigned int name = rd32(h + SEC_NAME);
+	unsigned int ofs;
+
+	if (file_address + file_size < file_address) return "section wraps around";
+	if (va + rd32(h + SEC_VIRTUAL_SIZE) < va) return "section wraps around";
+	if (name) {
+		ofs = xbe_in_headers(x, name, 1);
+		if (ofs == 0 || memchr(x->data + ofs, 0, x->header_size - ofs) == NULL)
+			return "section name outside the headers";
+	}
+	if ((rd32(h + SEC_HEAD_REFERENCE) && !xbe_in_headers(x, rd32(h + SEC_HEAD_REFERENCE), 2)) ||
+	    (rd32(h + SEC_TAIL_REFERENCE) && !xbe_in_headers(x, rd32(h + SEC_TAIL_REFERENCE), 2)))
+		return "section page count outside the headers";
+
+	return NULL;
+}
+
+const char *xbe_open(struct xbe *x, const unsigned char *data, unsigned int size)
+{
+	unsigned int va, ofs, i;
+	const char *bad;
+
+	memset(x, 0, sizeof(*x));
+	x->data = (unsigned char *)data;
+	x->size = size;
+
+	if (size < XBE_IMAGE_HEADER_SIZE || memcmp(data, "XBEH", 4)) return "not an XBE";
+	x->base = rd32(data + XBE_BASE_ADDRESS);
+	x->header_size = rd32(data + XBE_HEADER_SIZE);
+	x->image_size = rd32(data + XBE_IMAGE_SIZE);
+	x->entry = rd32(data + XBE_ENTRY_POINT);
+	if (x->header_size < XBE_IMAGE_HEADER_SIZE || x->header_size > size ||
+	    x->base > 0xffffffffU - x->header_size ||
+	    rd32(data + XBE_XBE_HEADER_SIZE) > x->header_size)
+		return "headers outside the file";
+
+	x->sections = rd32(data + XBE_NUM_SECTIONS);
+	if (x->sections < 1 || x->sections > x->header_size / XBE_SECTION_HEADER_SIZE)
+		return "bad number of sections";
+	x->section_headers = xbe_in_headers(x, rd32(data + XBE_SECTIONS),
+					    x->sections * XBE_SECTION_HEADER_SIZE);
+	if (x->section_headers == 0) return "section headers outside the headers";
+	for (i = 0; i < x->sections; i++) {
+		bad = section_check(x, i);
+		if (bad != NULL) return bad;
+	}
+
+	va = rd32(data + XBE_CERTIFICATE);
+	if (va) {
+		ofs = xbe_in_headers(x, va, CERT_MIN_SIZE);
+		if (ofs == 0 || rd32(data + ofs + CERT_SIZE) < CERT_MIN_SIZE ||
+		    !xbe_in_headers(x, va, rd32(data + ofs + CERT_SIZE)))
+			return "certificate outside the headers";
+		x->certificate = ofs;
+		x->title_id = rd32(data + ofs + CERT_TITLE_ID);
+		x->media_types = rd32(data + ofs + CERT_MEDIA_TYPES);
+		x->game_region = rd32(data + ofs + CERT_GAME_REGION);
+	}
+
+	// The TLS directory may be in memory that is only zero filled at load
+	x->tls = rd32(data + XBE_TLS_DIRECTORY);
+	if (x->tls && !xbe_in_headers(x, x->tls, TLS_SIZE)) {
+		struct xbe_section s;
+
+		for (i = 0; i < x->sections; i++) {
+			xbe_section(x, i, &s);
+			if (x->tls >= s.virtual_address &&
+			    x->tls - s.virtual_address <= s.virtual_size &&
+			    TLS_SIZE <= s.virtual_size - (x->tls - s.virtual_address))
+				break;
+		}
+		if (i == x->sections) return "TLS directory outside the image";
+	}
+
+	return NULL;
+}
+
+const char *xbe_check_sections(const struct xbe *x)
+{
+	struct xbe_section s;
+	unsigned int i;
+
+	for (i = 0; i < x->sections; i++) {
+		xbe_section(x, i, &s);
+		if (s.file_address > x->size || s.file_size > x->size - s.file_address)
+			return "section outside the file";
+	}
+	return NULL;
+}
+
+void xbe_section(const struct xbe *x, unsigned int i, struct xbe_section *s)
+{
+	const unsigned char *h = x->data + section_header(x, i);
+	unsigned int name = rd32(h + SEC_NAME);
+
+	s->flags = rd32(h + SEC_FLAGS);
+	s->virtual_address = rd32(h + SEC_VIRTUAL_ADDRESS);
+	s->virtual_size = rd32(h + SEC_VIRTUAL_SIZE);
+	s->file_address = rd32(h + SEC_FILE_ADDRESS);
+	s->file_size = rd32(h + SEC_FILE_SIZE);
+	s->name = name ? (const char *)x->data + xbe_in_headers(x, name, 1) : "";
+	memcpy(s->digest, h + SEC_DIGEST, SHA1HashSize);
+}
+
+int xbe_section_at(const struct xbe *x, unsigned int offset)
+{
+	struct xbe_section s;
+	unsigned int i;
+
+	for (i = 0; i < x->sections; i++) {
+		xbe_section(x, i, &s);
+		if (offset >= s.file_address && offset - s.file_address < s.file_size) return i;
+	}
+	return -1;
+}
+
+unsigned int xbe_va_to_file(const struct xbe *x, unsigned int va, unsigned int len)
+{
+	struct xbe_section s;
+	unsigned int i;
+
+	if (xbe_in_headers(x, va, len)) return va - x->base;
+	for (i = 0; i < x->sections; i++) {
+		xbe_section(x, i, &s);
+		if (va >= s.virtual_address && va - s.virtual_address <= s.file_size &&
+		    len <= s.file_size - (va - s.virtual_address) &&
+		    s.file_address + (va - s.virtual_address) <= x->size &&
+		    len <= x->size - s.file_address - (va - s.virtual_address))
+			return s.file_address + (va - s.virtual_address);
+	}
+	return 0;
+}
+
+void xbe_hash_size(SHA1Context *context, unsigned int size)
+{
+	unsigned char le[4];
+
+	wr32(le, size);
+	SHA1Input(context, le, 4);
+}
+
+void xbe_section_hash(const struct xbe *x, unsigned int i, unsigned char *digest)
+{
+	struct xbe_section s;
+	SHA1Context context;
+
+	xbe_section(x, i, &s);
+	SHA1Reset(&context);
+	xbe_hash_size(&context, s.file_size);
+	SHA1Input(&context, x->data + s.file_address, s.file_size);
+	SHA1Result(&context, digest);
+}
+
+void xbe_set_image_size(struct xbe *x, unsigned int size)
+{
+	wr32(x->data + XBE_IMAGE_SIZE, size);
+	x->image_size = size;
+}
+
+void xbe_set_section_size(struct xbe *x, unsigned int i, unsigned int file_size,
+			  unsigned int virtual_size)
+{
+	unsigned char *h = x->data + section_header(x, i);
+
+	wr32(h + SEC_FILE_SIZE, file_size);
+	wr32(h + SEC_VIRTUAL_SIZE, virtual_size);
+}
+
+void xbe_set_section_digest(struct xbe *x, unsigned int i, const unsigned char *digest)
+{
+	memcpy(x->data + xbe_section_digest_offset(x, i), digest, SHA1HashSize);
+}
+
+unsigned int xbe_section_digest_offset(const struct xbe *x, unsigned int i)
+{
+	return section_header(x, i) + SEC_DIGEST;
+}
+
+int xbe_set_sections(struct xbe *x, const struct xbe_section *sections, unsigned int count)
+{
+	unsigned int table = (x->header_size + 3) & ~3U;
+	unsigned int counts = table + count * XBE_SECTION_HEADER_SIZE;
+	unsigned int names = counts + (count + 1) * 2;
+	unsigned int end = names, first = x->size;
+	unsigned char *h;
+	unsigned int i, n;
+
+	if (count < 1) return 1;
+	for (i = 0; i < count; i++) {
+		end += strlen(sections[i].name) + 1;
+		if (sections[i].file_address > x->size ||
+		    sections[i].file_size > x->size - sections[i].file_address)
+			return 1;
+		if (sections[i].file_size && sections[i].file_address < first)
+			first = sections[i].file_address;
+	}
+	if (end > first) return 1;
+
+	memset(x->data + table, 0, end - table);
+	for (i = 0; i < count; i++) {
+		h = x->data + table + i * XBE_SECTION_HEADER_SIZE;
+		wr32(h + SEC_FLAGS, sections[i].flags);
+		wr32(h + SEC_VIRTUAL_ADDRESS, sections[i].virtual_address);
+		wr32(h + SEC_VIRTUAL_SIZE, sections[i].virtual_size);
+		wr32(h + SEC_FILE_ADDRESS, sections[i].file_address);
+		wr32(h + SEC_FILE_SIZE, sections[i].file_size);
+		// Neighbours share the count of the page between them
+		wr32(h + SEC_HEAD_REFERENCE, x->base + counts + i * 2);
+		wr32(h + SEC_TAIL_REFERENCE, x->base + counts + (i + 1) * 2);
+		memcpy(h + SEC_DIGEST, sections[i].digest, SHA1HashSize);
+		n = strlen(sections[i].name);
+		if (n) {
+			wr32(h + SEC_NAME, x->base + names);
+			memcpy(x->data + names, sections[i].name, n);
+		}
+		names += n + 1;
+	}
+
+	wr32(x->data + XBE_NUM_SECTIONS, count);
+	wr32(x->data + XBE_SECTIONS, x->base + table);
+	wr32(x->data + XBE_HEADER_SIZE, end);
+
+	return xbe_open(x, x->data, x->size) != NULL;
+}
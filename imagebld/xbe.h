@@ -0,0 +1,86 @@
+/*
+ *  xbe.h
+ *
+ *  Reads and patches XBE headers field by field, as the little-endian
+ *  32-bit values they are in the file, whatever the host.  xbe_open()
+ *  checks everything the other calls rely on up front: the image
+ *  header, every section header, the section names, the certificate and
+ *  the TLS directory.  Nothing is allocated, so images can be looked at
+ *  straight from a mapping.
+ *
+ *  The sections themselves are only checked to be inside the file by
+ *  xbe_check_sections(): a loader that has yet to be built claims more
+ *  than there is.
+ */
+
+#ifndef _XBE_H_
+#define _XBE_H_
+
+#include "sha1.h"
+#include "xbe-header.h"
+
+#define XBE_IMAGE_HEADER_SIZE	0x178
+#define XBE_SECTION_HEADER_SIZE	0x38
+/* Image header field, for writing ImageSize into a file that is not mapped */
+#define XBE_IMAGE_SIZE		0x10c
+
+struct xbe {
+	unsigned char *data;		/* writable for the xbe_set calls */
+	unsigned int size;
+	unsigned int base;
+	unsigned int header_size;
+	unsigned int image_size;
+	unsigned int entry;		/* still XOR'd */
+	unsigned int section_headers;	/* file offsets */
+	unsigned int sections;
+	unsigned int certificate;	/* 0 if there is none */
+	unsigned int title_id;
+	unsigned int media_types;
+	unsigned int game_region;
+	unsigned int tls;		/* virtual address, 0 if there is none */
+};
+
+struct xbe_section {
+	unsigned int flags;		/* XBE_SEC_ */
+	unsigned int virtual_address;
+	unsigned int virtual_size;
+	unsigned int file_address;
+	unsigned int file_size;
+	const char *name;		/* in the image, "" if it has none */
+	unsigned char digest[SHA1HashSize];
+};
+
+/* Returns NULL if data is an XBE the calls below can work on, else what is wrong */
+const char *xbe_open(struct xbe *x, const unsigned char *data, unsigned int size);
+
+/* NULL if the data of every section is in the file, else what is wrong */
+const char *xbe_check_sections(const struct xbe *x);
+
+void xbe_section(const struct xbe *x, unsigned int i, struct xbe_section *s);
+
+/* The section whose file data holds offset, -1 if there is none */
+int xbe_section_at(const struct xbe *x, unsigned int offset);
+
+/* File offset of len bytes at a virtual address, 0 if they are not all in the file */
+unsigned int xbe_va_to_file(const struct xbe *x, unsigned int va, unsigned int len);
+
+/* Section digests are over FileSize, as 4 little-endian bytes, then the data */
+void xbe_hash_size(SHA1Context *context, unsigned int size);
+void xbe_section_hash(const struct xbe *x, unsigned int i, unsigned char *digest);
+
+void xbe_set_image_size(struct xbe *x, unsigned int size);
+void xbe_set_section_size(struct xbe *x, unsigned int i, unsigned int file_size,
+			  unsigned int virtual_size);
+void xbe_set_section_digest(struct xbe *x, unsigned int i, const unsigned char *digest);
+/* Where xbe_set_section_digest() puts it, for writing it some other way */
+unsigned int xbe_section_digest_offset(const struct xbe *x, unsigned int i);
+
+/*
+ * Replaces the section table with count sections.  The new table, the
+ * shared page counts and the names go right behind the headers, which
+ * have to keep clear of the first section.  Digests are copied as they
+ * are.  x is read again afterwards.
+ */
+int xbe_set_sections(struct xbe *x, const struct xbe_section *sections, unsigned int count);
+
+#endif /* _XBE_H_ */
@@ -14,6 +14,9 @@
 #include "BootString.h"
 #include "BootParser.h"
 #include "BootEEPROM.h"
+#include "BootPayload.h"
+#include "BootRead.h"
+#include "BootLZ4.h"
 #include "config.h"
 
 int NewFramebuffer;
@@ -39,41 +42,217 @@ void die() {
 }
 
 #ifdef LOADHDD
-/* Loads the kernel image file into contiguous physical memory */
-long LoadFile(PVOID Filename, long *lFileSize) {
+#define LOAD_FILES 2
 
+typedef struct _LOAD_FILE {
+	READ_STREAM Stream;
 	HANDLE hFile;
-	PBYTE Buffer = 0;
 	ULONGLONG FileSize;
+	PBYTE Buffer;
+	ULONG Align;		/* READ_ALIGN if opened unbuffered */
+	PBYTE Load;		/* what is handed on, Buffer or the unpacked file */
+	ULONG LoadSize;
+	int Packed;		/* an LZ4 frame, unpacked from Buffer into Load */
+	struct lz4_stream Lz4;
+	int Check;		/* a .sha1 came with it */
+	BYTE Expected[XC_SHA_DIGEST_SIZE];
+	BYTE Sha[XC_SHA_CONTEXT_SIZE];
+	int x, y;		/* where its percentage goes */
+} LOAD_FILE;
+
+/* Reads the expected SHA-1 of a file from the <file>.sha1 next to it, as
+   sha1sum writes it.  Returns 0 if there is none. */
+static int LoadDigest(PCSZ Filename, BYTE *Digest) {
+	char Name[MAX_LINE + 8];
+	char Text[2 * XC_SHA_DIGEST_SIZE];
+	HANDLE hFile;
+	int i, c, Length = HelpStrlen((char *)Filename);
+
+	if (Length + 6 > (int)sizeof(Name)) return 0;
+	xbememcpy(Name, Filename, Length);
+	xbememcpy(Name + Length, ".sha1", 6);
 
-    if (!(hFile = OpenFile(NULL, Filename, -1, FILE_NON_DIRECTORY_FILE))) {
-		dprintf("Error opening file %s\n",Filename);
-    	die();
+	if (!(hFile = OpenFile(NULL, Name, -1, FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE)))
+		return 0;
+	c = ReadFile(hFile, Text, sizeof(Text));
+	NtClose(hFile);
+	if (!c) {
+		dprintf("Error reading %s\n", Name);
+		die();
 	}
 
-	if(!GetFileSize(hFile,&FileSize)) {
+	for (i = 0; i < 2 * XC_SHA_DIGEST_SIZE; i++) {
+		c = Text[i] | 0x20;
+		if (c >= '0' && c <= '9') c -= '0';
+		else if (c >= 'a' && c <= 'f') c -= 'a' - 10;
+		else {
+			dprintf("%s does not start with a SHA-1\n", Name);
+			die();
+		}
+		if (i & 1) Digest[i / 2] |= c;
+		else Digest[i / 2] = c << 4;
+	}
+
+	return 1;
+}
+
+/* Compares the SHA-1 of all of a file with its .sha1, returns 0 if
+   they differ */
+static int LoadCheck(LOAD_FILE *File) {
+	BYTE Digest[XC_SHA_DIGEST_SIZE];
+
+	XcSHAFinal(File->Sha, Digest);
+	if (_memcmp(Digest, File->Expected, XC_SHA_DIGEST_SIZE) == 0) return 1;
+
+	cx = 0;
+	cy = File->y;
+	dprintf("%s does not match its .sha1, the file is damaged\n", File->Stream.Name);
+	return 0;
+}
+
+/* Hashes and unpacks what is in of a file while the next chunks are
+   read, and draws how much is in over the last percentage */
+static int LoadChunk(READ_STREAM *Stream, BYTE *Data, ULONG Length) {
+	LOAD_FILE *File = Stream->Context;
+
+	if (File->Check) {
+		XcSHAUpdate(File->Sha, Data, Length);
+		if (Stream->Done == Stream->Size && !LoadCheck(File)) return 0;
+	}
+
+	if (File->Packed && BootLz4StreamDecompress(&File->Lz4, Stream->Done) < 0) {
+		cx = 0;
+		cy = File->y;
+		dprintf("%s is damaged at byte %u\n", Stream->Name, File->Lz4.pos);
+		return 0;
+	}
+
+	cx = File->x;
+	cy = File->y;
+	dprintf("%3u%%", Stream->Done == Stream->Size ? 100 :
+		(Stream->Done >> 8) * 100 / ((Stream->Size >> 8) + 1));
+
+	return 1;
+}
+
+/* Opens a file and sets up a stream into contiguous physical memory for it */
+static void LoadOpen(LOAD_FILE *File, PVOID Filename) {
+
+	// Not synchronous, BootRead keeps reads in flight.  Straight from the
+	// disk into the buffer if the file system lets us, we never read it again
+	File->Align = READ_ALIGN;
+	if (!(File->hFile = OpenFile(NULL, Filename, -1, FILE_NON_DIRECTORY_FILE |
+			FILE_NO_INTERMEDIATE_BUFFERING | FILE_SEQUENTIAL_ONLY))) {
+		File->Align = 0;
+		if (!(File->hFile = OpenFile(NULL, Filename, -1, FILE_NON_DIRECTORY_FILE |
+				FILE_SEQUENTIAL_ONLY))) {
+			dprintf("Error opening file %s\n",Filename);
+			die();
+		}
+	}
+
+	if(!GetFileSize(File->hFile,&File->FileSize)) {
 		dprintf("Error getting file size %s\n",Filename);
 		die();
 	}
 
-	Buffer = MmAllocateContiguousMemoryEx(FileSize + 0x1000, MIN_KERNEL, MAX_KERNEL, 0, PAGE_READWRITE);
-	if (!Buffer) {
+	File->Buffer = MmAllocateContiguousMemoryEx(File->FileSize + 0x1000, MIN_KERNEL, MAX_KERNEL, 0, PAGE_READWRITE);
+	if (!File->Buffer) {
 		dprintf("Error allocating memory for file %s\n",Filename);
 		die();
 	}
 
-	xbememset(Buffer,0xff,FileSize + 0x1000);
-	if (!ReadFile(hFile, Buffer, FileSize)) {
-		dprintf("Error loading file %s\n",Filename);
+	// Checked as it arrives if there is a .sha1 for it
+	if ((File->Check = LoadDigest(Filename, File->Expected)))
+		XcSHAInit(File->Sha);
+
+	// A file that is an LZ4 frame is read into Buffer and unpacked into a
+	// buffer of its own as it arrives, sized from the frame header
+	File->Load = File->Buffer;
+	File->LoadSize = File->FileSize;
+	File->Packed = 0;
+	if (BootReadPeek(File->hFile, File->Buffer, READ_ALIGN) >= 4 &&
+			*(DWORD *)File->Buffer == LZ4_FRAME_MAGIC) {
+		File->LoadSize = BootLz4FrameContentSize(File->Buffer, READ_ALIGN);
+		if (!File->LoadSize) {
+			dprintf("%s has no content size, pack it with lz4 --content-size\n",Filename);
+			die();
+		}
+		File->Load = MmAllocateContiguousMemoryEx(File->LoadSize + 0x1000, MIN_KERNEL, MAX_KERNEL, 0, PAGE_READWRITE);
+		if (!File->Load) {
+			dprintf("Error allocating memory for unpacking %s\n",Filename);
+			die();
+		}
+		BootLz4StreamInit(&File->Lz4, File->Buffer, File->Load, File->LoadSize);
+		File->Packed = 1;
+	}
+
+	// The buffer is page aligned, the padding has room for the last sector
+	if (!BootReadOpen(&File->Stream, File->hFile, Filename, File->Buffer, File->FileSize)) {
+		dprintf("Error setting up the read of %s\n",Filename);
 		die();
 	}
-	dprintf("%s is %llu bytes and is located at %p\n", Filename, (unsigned long long)FileSize, (void *)Buffer);
+	File->Stream.Align = File->Align;
+	File->Stream.Process = LoadChunk;
+	File->Stream.Context = File;
+
+	dprintf("Loading %s ", Filename);
+	File->x = cx;
+	File->y = cy;
+	dprintf("  0%%\n");
+}
 
-	NtClose(hFile);
+/* Loads the kernel image file and the initrd into contiguous physical
+   memory, both at once so the disk never waits between them */
+void LoadFiles(PVOID *Filenames, int Count, long *Positions, long *Sizes) {
+
+	LOAD_FILE Files[LOAD_FILES], *File;
+	READ_STREAM *Streams[LOAD_FILES];
+	int i, x, y;
 
-	*lFileSize = FileSize + 0x1000;
+	for (i = 0; i < Count; i++) {
+		LoadOpen(&Files[i], Filenames[i]);
+		Streams[i] = &Files[i].Stream;
+	}
+	x = cx;
+	y = cy;
 
-	return (long)Buffer;
+	if (!BootReadRun(Streams, Count)) {
+		cx = 0;
+		if (cy < y) cy = y;
+		dprintf("Error loading files\n");
+		die();
+	}
+	// An empty file has no chunks for LoadChunk to check it with
+	for (i = 0; i < Count; i++) {
+		File = &Files[i];
+		if (File->Check && !File->Stream.Size && !LoadCheck(File)) die();
+	}
+	cx = x;
+	cy = y;
+
+	for (i = 0; i < Count; i++) {
+		File = &Files[i];
+		BootReadClose(&File->Stream);
+		NtClose(File->hFile);
+		if (File->Packed) {
+			if (!File->Lz4.done || File->Lz4.out != File->LoadSize) {
+				dprintf("%s is cut short\n", Filenames[i]);
+				die();
+			}
+			MmFreeContiguousMemory(File->Buffer);
+			dprintf("%s is %llu bytes packed, %u unpacked, ", Filenames[i],
+				(unsigned long long)File->FileSize, File->LoadSize);
+		} else
+			dprintf("%s is %u bytes, ", Filenames[i], File->LoadSize);
+		// The file itself is read over, only the padding behind it needs
+		// filling, after the rounded up last read
+		xbememset(File->Load + File->LoadSize,0xff,0x1000);
+		dprintf("located at %p, read in %u KB chunks%s\n", (void *)File->Load,
+			BootReadChunk(&File->Stream) / 1024, File->Check ? ", SHA-1 ok" : "");
+		Positions[i] = (long)File->Load;
+		Sizes[i] = File->LoadSize + 0x1000;
+	}
 }
 #endif
 
@@ -81,27 +260,36 @@ long LoadFile(PVOID Filename, long *lFileSize) {
 long LoadKernelXBE(long *FileSize) {
 
 	PVOID Buffer;
-	/* Size of the kernel file */
-	ULONGLONG TempKernelStart;
-	ULONGLONG TempKernelSize;
-	ULONGLONG TempKernelSizev;
-	TempKernelSize = *FileSize;
-
-	// This is where the real kernel starts in the XBE
-	xbememcpy(&TempKernelStart,(void*)0x011080,4);
-	// This is the real kernel Size
-	xbememcpy(&TempKernelSizev,(void*)0x011080+0x04,4);
+	struct payload_entry *Kernel;
+	int Size;
+
+	if (!(Kernel = BootPayloadFind(PAYLOAD_KERNEL))) {
+		dprintf("No kernel in the XBE\n");
+		return 0;
+	}
+
 	// this is the kernel size we pass to the kernel loader
-	xbememcpy(&TempKernelSize,(void*)0x011080+0x08,4);
+	*FileSize = Kernel->load_size;
 
-	*FileSize = TempKernelSize;
+	// Already in one piece with its 0xff padding, no need to copy it
+	if ((Buffer = BootPayloadResident(Kernel, MIN_KERNEL))) {
+		if (!BootPayloadVerify(Kernel)) return 0;
+		asm volatile ("wbinvd\n");
+		return (long)Buffer;
+	}
 
-	Buffer = MmAllocateContiguousMemoryEx((ULONG) TempKernelSize, MIN_KERNEL, MAX_KERNEL, 0, PAGE_READWRITE);
+	Buffer = MmAllocateContiguousMemoryEx(Kernel->load_size,
+		Kernel->load_addr ? Kernel->load_addr : MIN_KERNEL, MAX_KERNEL, 0, PAGE_READWRITE);
 	if (!Buffer) return 0;
 
+	// Copy or decompress straight into the kernel buffer
+	Size = BootPayloadLoad(Kernel, Buffer, Kernel->load_size);
+	if (Size < 0) {
+		dprintf("Error unpacking kernel\n");
+		return 0;
+	}
 	// We fill the complete space with 0xff
-	xbememcpy(Buffer,(void*)0x010000+TempKernelStart,TempKernelSizev);
-	xbememset(Buffer+TempKernelSizev,0xff,TempKernelSize-TempKernelSizev);
+	xbememset(Buffer+Size,0xff,Kernel->load_size-Size);
 
 	// We force the cache to write back the changes to RAM
 	asm volatile ("wbinvd\n");
@@ -112,21 +300,32 @@ long LoadKernelXBE(long *FileSize) {
 long LoadIinitrdXBE(long *FileSize) {
 
 	PVOID Buffer;
-	/* Size of the initrd file */
-	ULONGLONG TempInitrdStart;
-	ULONGLONG TempInitrdSize;
+	struct payload_entry *Initrd;
+
+	if (!(Initrd = BootPayloadFind(PAYLOAD_INITRD))) {
+		dprintf("No initrd in the XBE\n");
+		return 0;
+	}
 
-	xbememcpy(&TempInitrdStart,(void*)0x011080+0xC,4);	// This is the where the real kernel starts in the XBE
-	xbememcpy(&TempInitrdSize,(void*)0x011080+0x10,4);	// This is the real kernel Size
+	*FileSize= Initrd->raw_size;
 
-	*FileSize= TempInitrdSize;
+	// The escape code copies the kernel to PM_KERNEL_DEST, an initrd
+	// left where it is must be above that
+	if ((Buffer = BootPayloadResident(Initrd, PM_KERNEL_DEST + KernelSize))) {
+		if (!BootPayloadVerify(Initrd)) return 0;
+		asm volatile ("wbinvd\n");
+		return (long)Buffer;
+	}
 
-	Buffer = MmAllocateContiguousMemoryEx((ULONG) TempInitrdSize,
-		MIN_KERNEL, MAX_KERNEL, 0, PAGE_READWRITE);
+	Buffer = MmAllocateContiguousMemoryEx(Initrd->load_size,
+		Initrd->load_addr ? Initrd->load_addr : MIN_KERNEL, MAX_KERNEL, 0, PAGE_READWRITE);
 
 	if (!Buffer) return 0;
 
-	xbememcpy(Buffer,(void*)0x010000+TempInitrdStart,TempInitrdSize);
+	if (BootPayloadLoad(Initrd, Buffer, Initrd->load_size) != Initrd->raw_size) {
+		dprintf("Error unpacking initrd\n");
+		return 0;
+	}
 	// We force the Cache to write back the changes to RAM
 	asm volatile ("wbinvd\n");
 
@@ -143,6 +342,11 @@ void boot() {
 	NTSTATUS Error;
 	int data_PAGE_SIZE;
 	extern int EscapeCode;
+#ifdef LOADHDD
+	PVOID Files[LOAD_FILES];
+	long Positions[LOAD_FILES], Sizes[LOAD_FILES];
+	int Count;
+#endif
 
 	//int i;
 	
@@ -192,24 +396,22 @@ void boot() {
 #endif
 	if (!NT_SUCCESS(Error)) die();
 
-	// Load the kernel image into RAM
-	KernelPos = LoadFile(entry.szKernel, &KernelSize);
+	// Load the kernel image and the initrd into RAM, their reads queued
+	// together
+	Files[0] = entry.szKernel;
+	Count = 1;
+	// ED : only if initrd
+	if(entry.szInitrd[0]) Files[Count++] = entry.szInitrd;
+	LoadFiles(Files, Count, Positions, Sizes);
 
+	KernelPos = Positions[0];
+	KernelSize = Sizes[0];
 	/* get physical addresses */
 	PhysKernelPos = MmGetPhysicalAddress((PVOID)KernelPos);
 
-	if (KernelPos == 0) {
-		dprintf("Error Loading Kernel\n");
-		die();
-	}
-
-	// ED : only if initrd
 	if(entry.szInitrd[0]) {
-		InitrdPos = LoadFile(entry.szInitrd, &InitrdSize);
-		if (InitrdPos == 0) {
-		        dprintf("Error Loading Initrd\n");
-			die();
-		}
+		InitrdPos = Positions[1];
+		InitrdSize = Sizes[1];
 		PhysInitrdPos = MmGetPhysicalAddress((PVOID)InitrdPos);
 	} else {
 		InitrdSize = 0;
@@ -223,10 +425,18 @@ void boot() {
 
 	// Load the kernel image into the correct RAM
 	KernelPos = LoadKernelXBE(&KernelSize);
+	if (KernelPos == 0) {
+		dprintf("Error Loading Kernel\n");
+		die();
+	}
 	PhysKernelPos = MmGetPhysicalAddress((PVOID)KernelPos);
 
 	// Load the Ramdisk into the correct RAM
     InitrdPos = LoadIinitrdXBE(&InitrdSize);
+	if (InitrdPos == 0) {
+		dprintf("Error Loading Initrd\n");
+		die();
+	}
 	PhysInitrdPos = MmGetPhysicalAddress((PVOID)InitrdPos);
 #endif
 
@@ -365,7 +575,8 @@ NTSTATUS GetConfig(CONFIGENTRY *entry) {
 
 	xbememset(entry,0,sizeof(CONFIGENTRY));
 
-        if (!(hFile = OpenFile(NULL, "\\??\\E:\\linuxboot.cfg", -1, FILE_NON_DIRECTORY_FILE)))
+        if (!(hFile = OpenFile(NULL, "\\??\\E:\\linuxboot.cfg", -1,
+                FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE)))
                 return 1;
 
 	if(!GetFileSize(hFile,&FileSize)) {
@@ -395,18 +606,21 @@ NTSTATUS GetConfig(CONFIGENTRY *entry) {
 
 NTSTATUS GetConfigXBE(CONFIGENTRY *entry) {
 	PBYTE Buffer;
-        unsigned int TempConfigStart;
-        unsigned int TempConfigSize;
+	struct payload_entry *Config;
 
-	// This is the Real kernel Size
-	xbememcpy(&TempConfigStart,(void*)0x011080+0x14,4);
-	// this is the kernel Size we pass to the Kernel loader
-	xbememcpy(&TempConfigSize, (void*)0x011080+0x18,4);
+	if (!(Config = BootPayloadFind(PAYLOAD_CONFIG))) {
+		dprintf("No linuxboot.cfg in the XBE\n");
+		return 1;
+	}
 
 	Buffer = MmAllocateContiguousMemoryEx(CONFIG_BUFFERSIZE, MIN_KERNEL, MAX_KERNEL, 0, PAGE_READWRITE);
 
     xbememset(Buffer,0x00,CONFIG_BUFFERSIZE);
-    xbememcpy(Buffer,(void*)0x010000+TempConfigStart,TempConfigSize);
+	// Keep the terminating 0
+	if (BootPayloadLoad(Config, Buffer, CONFIG_BUFFERSIZE - 1) < 0) {
+		dprintf("linuxboot.cfg in the XBE is too big\n");
+		return 1;
+	}
 
 	ParseConfig("\\??\\E:\\",Buffer,entry);
 
@@ -458,7 +672,8 @@ int RemapDrive(char *szDrive)
 // Length parameter is negative means use strlen()
 // This was originally designed to open directories, but it turned out to be
 // too much of a hassle and was scrapped.  Use only for files with the
-// FILE_NON_DIRECTORY_FILE mode.
+// FILE_NON_DIRECTORY_FILE mode.  Add FILE_SYNCHRONOUS_IO_NONALERT to the
+// mode for ReadFile(), BootRead wants the file without it.
 HANDLE OpenFile(HANDLE Root, LPCSTR Filename, LONG Length, ULONG Mode)
 {
         ANSI_STRING FilenameString;
@@ -486,8 +701,7 @@ HANDLE OpenFile(HANDLE Root, LPCSTR Filename, LONG Length, ULONG Mode)
         // Try to open the file or directory
         if (!NT_SUCCESS(NtCreateFile(&Handle, GENERIC_READ | SYNCHRONIZE,
                 &Attributes, &IoStatus, NULL, 0, FILE_SHARE_READ | FILE_SHARE_WRITE
-                | FILE_SHARE_DELETE, FILE_OPEN, FILE_SYNCHRONOUS_IO_NONALERT |
-                Mode)))
+                | FILE_SHARE_DELETE, FILE_OPEN, Mode)))
                 return NULL;
 
         return Handle;
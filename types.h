@@ -88,6 +88,12 @@ typedef struct _IO_STATUS_BLOCK
         ULONG Information;
 } IO_STATUS_BLOCK, *PIO_STATUS_BLOCK;
 
+typedef enum _EVENT_TYPE
+{
+        NotificationEvent = 0,
+        SynchronizationEvent
+} EVENT_TYPE;
+
 // CreateDisposition values for NtCreateFile()
 #define FILE_SUPERSEDE                          0x00000000
 #define FILE_OPEN                               0x00000001
@@ -147,6 +153,7 @@ typedef struct _IO_STATUS_BLOCK
 #define PAGE_EXECUTE_READWRITE		0x40
 #define STATUS_NO_MEMORY		0xc0000017
 #define STATUS_SUCCESS  		0x00000000
+#define STATUS_PENDING			0x00000103
 #define MEM_RESERVE			0x00002000
 #define MEM_COMMIT			0x00001000
 
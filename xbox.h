@@ -51,7 +51,9 @@
 /* Size of a page on x86 */
 #define PAGE_SIZE			4096
 
-/* Size of the read chunks to use when reading the kernel; bigger = a lot faster */
+/* Size of the first read chunks when reading the kernel; bigger = a lot faster */
 #define READ_CHUNK_SIZE 128*1024
+/* BootRead tries bigger chunks up to this while they get faster */
+#define READ_CHUNK_MAX (1024*1024)
 
 #endif // _XBOX_H_
@@ -44,6 +44,15 @@ extern VOID __attribute__((__stdcall__))
 (*XcRC4Crypt)(PRC4_SBOX Sbox, SIZE_T DataLength, CONST BYTE *Data);
 extern VOID __attribute__((__stdcall__))
 (*XcRC4Key)(PRC4_SBOX Sbox, SIZE_T KeyLength, CONST BYTE *Key);
+/* SHA-1, the context is opaque, the kernel uses 116 bytes of it */
+#define XC_SHA_CONTEXT_SIZE	128
+#define XC_SHA_DIGEST_SIZE	20
+extern VOID __attribute__((__stdcall__))
+(*XcSHAInit)(PUCHAR pbSHAContext);
+extern VOID __attribute__((__stdcall__))
+(*XcSHAUpdate)(PUCHAR pbSHAContext, PUCHAR pbInput, ULONG dwInputLength);
+extern VOID __attribute__((__stdcall__))
+(*XcSHAFinal)(PUCHAR pbSHAContext, PUCHAR pbDigest);
 extern PVOID __attribute__((__stdcall__))
 (*ExAllocatePoolWithTag)(SIZE_T NumberOfBytes,ULONG Tag);
 extern VOID __attribute__((__stdcall__))
@@ -83,6 +92,19 @@ extern NTSTATUS __attribute__((__stdcall__))(*NtSetInformationFile)(
         ULONG   Length,
         ULONG   FileInformationClass
 );
+extern NTSTATUS __attribute__((__stdcall__))(*NtCreateEvent)(
+	PHANDLE EventHandle,
+	POBJECT_ATTRIBUTES ObjectAttributes OPTIONAL,
+	EVENT_TYPE EventType,
+	BOOLEAN InitialState
+);
+extern NTSTATUS __attribute__((__stdcall__))(*NtWaitForSingleObject)(
+	HANDLE Handle,
+	BOOLEAN Alertable,
+	PLARGE_INTEGER Timeout OPTIONAL
+);
+extern ULONGLONG __attribute__((__stdcall__))
+(*KeQueryPerformanceCounter)(VOID);
 extern NTSTATUS __attribute__((__stdcall__))(*IoCreateSymbolicLink)(
 	PANSI_STRING SymbolicLinkName,
 	PANSI_STRING DeviceName